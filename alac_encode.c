@@ -0,0 +1,61 @@
+/*
+ * Uncompressed ALAC encoding, for the test tools. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include "alac_encode.h"
+
+int alac_encode_uncompressed(const int16_t *samples, int frames, uint8_t *out) {
+  uint32_t accumulator = 0;
+  int bits = 0, length = 0, i;
+#define put_bits(value, n)                                                                         \
+  do {                                                                                             \
+    accumulator = (accumulator << (n)) | ((value) & ((1 << (n)) - 1));                             \
+    bits += (n);                                                                                   \
+    while (bits >= 8) {                                                                            \
+      out[length++] = accumulator >> (bits - 8);                                                   \
+      bits -= 8;                                                                                   \
+    }                                                                                              \
+  } while (0)
+  put_bits(1, 3);  // two channels
+  put_bits(0, 4);  // unused
+  put_bits(0, 12); // unused
+  if (frames == 352) {
+    put_bits(0, 1); // no size
+  } else {
+    put_bits(1, 1);
+    put_bits(frames >> 16, 16);
+    put_bits(frames & 0xffff, 16);
+  }
+  put_bits(0, 2); // no uncompressed bytes
+  put_bits(1, 1); // not compressed
+  for (i = 0; i < frames * 2; i++)
+    put_bits((uint16_t)samples[i], 16);
+  if (bits)
+    out[length++] = accumulator << (8 - bits);
+#undef put_bits
+  return length;
+}
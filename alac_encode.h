@@ -0,0 +1,14 @@
+#ifndef _ALAC_ENCODE_H
+#define _ALAC_ENCODE_H
+
+#include <stdint.h>
+
+// the most space an uncompressed ALAC frame of this many stereo frames can take
+#define alac_encoded_size(frames) (8 + (frames)*4)
+
+// Encode interleaved 16-bit stereo samples as an uncompressed ALAC frame, as a source would send
+// it. out must have room for alac_encoded_size(frames) bytes. Returns the number of bytes used.
+// Only a frame of 352 frames -- the size given in the fmtp -- can leave out its size.
+int alac_encode_uncompressed(const int16_t *samples, int frames, uint8_t *out);
+
+#endif // _ALAC_ENCODE_H
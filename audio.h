@@ -37,6 +37,10 @@ typedef struct {
   // will change dynamically, so keep watching it. Implemented in ALSA only.
   uint32_t (*delay)();
 
+  // may be NULL. Like delay(), but also returns the time, as from get_absolute_time_in_fp(), at
+  // which the delay was true. Returns 0 if successful, -1 otherwise.
+  int (*timed_delay)(int32_t *the_delay, uint64_t *the_time);
+
   // may be NULL, in which case soft volume is applied
   void (*volume)(double vol);
 
@@ -42,6 +42,7 @@ static void play(short buf[], int samples);
 static void stop(void);
 static void flush(void);
 static uint32_t delay(void);
+static int timed_delay(int32_t *the_delay, uint64_t *the_time);
 static void volume(double vol);
 static void parameters(audio_parameters *info);
 static int has_mute = 0;
@@ -57,6 +58,7 @@ audio_output audio_alsa = {
     .stop = &stop,
     .flush = &flush,
     .delay = &delay,
+    .timed_delay = &timed_delay,
     .play = &play,
     .volume = NULL,    // to be set later on...
     .parameters = NULL // to be set later on...
@@ -80,6 +82,15 @@ static char *alsa_mix_dev = NULL;
 static char *alsa_mix_ctrl = "Master";
 static int alsa_mix_index = 0;
 
+// The DAC delay is read with snd_pcm_status(), which gives the delay along with the time of the
+// hardware pointer update it refers to. Between reads, the delay is extrapolated at the nominal
+// rate and topped up by play(), so the hardware is asked at most once per period.
+static int delay_is_cached = 0;
+static snd_pcm_sframes_t cached_delay; // frames in the DAC at cached_delay_time
+static uint64_t cached_delay_time;     // when cached_delay was true, as from get_absolute_time_in_fp()
+static uint64_t period_time_fp;        // duration of one period, in the same units
+static int htstamp_is_monotonic = 0;   // if not, ALSA's timestamps can't be compared with ours
+
 static int play_number;
 static int64_t accumulated_delay, accumulated_da_delay;
 
@@ -270,6 +281,34 @@ int open_alsa_device(void) {
     die("Can't set the D/A converter to %d -- set to %d instead./n", desired_sample_rate,
         my_sample_rate);
   }
+
+  snd_pcm_uframes_t period_size;
+  if (snd_pcm_hw_params_get_period_size(alsa_params, &period_size, &dir) == 0) {
+    period_time_fp = ((uint64_t)period_size << 32) / desired_sample_rate;
+    debug(2, "ALSA period size is %lu frames.", period_size);
+  } else {
+    period_time_fp = 0; // never use the cache
+  }
+
+  // ask for the status timestamps to be taken with CLOCK_MONOTONIC, so that they can be compared
+  // with get_absolute_time_in_fp()
+  htstamp_is_monotonic = 0;
+  snd_pcm_sw_params_t *alsa_swparams;
+  snd_pcm_sw_params_alloca(&alsa_swparams);
+  if ((snd_pcm_sw_params_current(alsa_handle, alsa_swparams) == 0) &&
+      (snd_pcm_sw_params_set_tstamp_mode(alsa_handle, alsa_swparams, SND_PCM_TSTAMP_ENABLE) == 0)
+#if SND_LIB_VERSION >= 0x01001c
+      && (snd_pcm_sw_params_set_tstamp_type(alsa_handle, alsa_swparams,
+                                            SND_PCM_TSTAMP_TYPE_MONOTONIC) == 0)
+#endif
+      && (snd_pcm_sw_params(alsa_handle, alsa_swparams) == 0)) {
+#if SND_LIB_VERSION >= 0x01001c
+    htstamp_is_monotonic = 1;
+#endif
+  }
+  if (htstamp_is_monotonic == 0)
+    debug(1, "ALSA monotonic timestamps are not available -- DAC delays will be timed when read.");
+  delay_is_cached = 0;
   return (0);
 }
 
@@ -279,42 +318,97 @@ static void start(int sample_rate) {
   desired_sample_rate = sample_rate; // must be a variable
 }
 
-static uint32_t delay() {
+static uint64_t htstamp_to_fp(snd_htimestamp_t *ts) {
+  return ((uint64_t)ts->tv_sec << 32) + ((uint64_t)ts->tv_nsec << 32) / 1000000000;
+}
+
+// get the delay and the time it was true, from the cache if it's less than a period old,
+// otherwise from the hardware. Call with alsa_mutex locked.
+static int measure_delay(snd_pcm_sframes_t *the_delay, uint64_t *the_time) {
+  uint64_t time_now = get_absolute_time_in_fp();
+  if ((delay_is_cached) && (time_now - cached_delay_time < period_time_fp)) {
+    snd_pcm_sframes_t frames_played =
+        ((time_now - cached_delay_time) * desired_sample_rate) >> 32;
+    if (frames_played < cached_delay) {
+      *the_delay = cached_delay - frames_played;
+      *the_time = time_now;
+      return 0;
+    }
+    // if the DAC might have run dry, ask the hardware
+  }
+  delay_is_cached = 0;
+  int derr, ignore;
+  snd_pcm_sframes_t current_delay = 0;
+  if (snd_pcm_state(alsa_handle) == SND_PCM_STATE_RUNNING) {
+    snd_pcm_status_t *alsa_status;
+    snd_pcm_status_alloca(&alsa_status);
+    derr = snd_pcm_status(alsa_handle, alsa_status);
+    if (derr == 0) {
+      snd_htimestamp_t update_time, trigger_time;
+      current_delay = snd_pcm_status_get_delay(alsa_status);
+      snd_pcm_status_get_htstamp(alsa_status, &update_time);
+      snd_pcm_status_get_trigger_htstamp(alsa_status, &trigger_time);
+      uint64_t update_time_fp = htstamp_to_fp(&update_time);
+      // the update time is only meaningful if it's on our clock and it's from this run of the
+      // stream, i.e. after the trigger, otherwise take the time now
+      if ((htstamp_is_monotonic) && (update_time_fp >= htstamp_to_fp(&trigger_time)) &&
+          (update_time_fp <= time_now))
+        time_now = update_time_fp;
+      cached_delay = current_delay;
+      cached_delay_time = time_now;
+      delay_is_cached = 1;
+    } else {
+      ignore = snd_pcm_recover(alsa_handle, derr, 0);
+      debug(1, "Error %d in delay(): %s.", derr, snd_strerror(derr));
+      current_delay = -1;
+    }
+  } else if (snd_pcm_state(alsa_handle) == SND_PCM_STATE_PREPARED) {
+    current_delay = 0;
+  } else {
+    if (snd_pcm_state(alsa_handle) == SND_PCM_STATE_XRUN)
+      current_delay = 0;
+    else {
+      current_delay = -1;
+      debug(1, "Error -- ALSA delay(): bad state: %d.", snd_pcm_state(alsa_handle));
+    }
+    if ((derr = snd_pcm_prepare(alsa_handle))) {
+      ignore = snd_pcm_recover(alsa_handle, derr, 0);
+      debug(1, "Error preparing after delay error: %s.", snd_strerror(derr));
+      current_delay = -1;
+    }
+  }
+  *the_delay = current_delay;
+  *the_time = time_now;
+  return (current_delay == -1) ? -1 : 0;
+}
+
+static int timed_delay(int32_t *the_delay, uint64_t *the_time) {
   if (alsa_handle == NULL) {
+    *the_delay = 0;
+    *the_time = get_absolute_time_in_fp();
     return 0;
   } else {
+    snd_pcm_sframes_t current_delay;
     pthread_mutex_lock(&alsa_mutex);
-    snd_pcm_sframes_t current_avail, current_delay = 0;
-    int derr, ignore;
-    if (snd_pcm_state(alsa_handle) == SND_PCM_STATE_RUNNING) {
-      derr = snd_pcm_avail_delay(alsa_handle, &current_avail, &current_delay);
-      // current_avail not used
-      if (derr != 0) {
-        ignore = snd_pcm_recover(alsa_handle, derr, 0);
-        debug(1, "Error %d in delay(): %s. Delay reported is %d frames.", derr, snd_strerror(derr),
-              current_delay);
-        current_delay = -1;
-      }
-    } else if (snd_pcm_state(alsa_handle) == SND_PCM_STATE_PREPARED) {
-      current_delay = 0;
-    } else {
-      if (snd_pcm_state(alsa_handle) == SND_PCM_STATE_XRUN)
-        current_delay = 0;
-      else {
-        current_delay = -1;
-        debug(1, "Error -- ALSA delay(): bad state: %d.", snd_pcm_state(alsa_handle));
-      }
-      if ((derr = snd_pcm_prepare(alsa_handle))) {
-        ignore = snd_pcm_recover(alsa_handle, derr, 0);
-        debug(1, "Error preparing after delay error: %s.", snd_strerror(derr));
-        current_delay = -1;
-      }
-    }
+    int response = measure_delay(&current_delay, the_time);
     pthread_mutex_unlock(&alsa_mutex);
-    return current_delay;
+    *the_delay = current_delay;
+    return response;
   }
 }
 
+static uint32_t delay() {
+  int32_t current_delay;
+  uint64_t time_of_delay;
+  if (timed_delay(&current_delay, &time_of_delay) != 0)
+    return -1;
+  // bring the delay up to now
+  int64_t frames_played = ((get_absolute_time_in_fp() - time_of_delay) * desired_sample_rate) >> 32;
+  if (frames_played >= current_delay)
+    return 0;
+  return current_delay - frames_played;
+}
+
 static void play(short buf[], int samples) {
   int ret = 0;
   if (alsa_handle == NULL) {
@@ -329,13 +423,17 @@ static void play(short buf[], int samples) {
     if ((snd_pcm_state(alsa_handle) == SND_PCM_STATE_PREPARED) ||
         (snd_pcm_state(alsa_handle) == SND_PCM_STATE_RUNNING)) {
       err = snd_pcm_writei(alsa_handle, (char *)buf, samples);
+      if ((err >= 0) && (delay_is_cached))
+        cached_delay += err; // the frames just written are now in the DAC too
       if (err < 0) {
+        delay_is_cached = 0;
         ignore = snd_pcm_recover(alsa_handle, err, 0);
         debug(1, "Error %d writing %d samples in play() %s.", err, samples, snd_strerror(err));
       }
     } else {
       debug(1, "Error -- ALSA device in incorrect state (%d) for play.",
             snd_pcm_state(alsa_handle));
+      delay_is_cached = 0;
       if ((err = snd_pcm_prepare(alsa_handle))) {
         ignore = snd_pcm_recover(alsa_handle, err, 0);
         debug(1, "Error preparing after play error: %s.", snd_strerror(err));
@@ -347,6 +445,8 @@ static void play(short buf[], int samples) {
 
 static void flush(void) {
   int derr;
+  pthread_mutex_lock(&alsa_mutex);
+  delay_is_cached = 0;
   if (alsa_handle) {
     // debug(1,"Dropping frames for flush...");
     if ((derr = snd_pcm_drop(alsa_handle)))
@@ -369,6 +469,7 @@ static void flush(void) {
     snd_pcm_close(alsa_handle);
     alsa_handle = NULL;
   }
+  pthread_mutex_unlock(&alsa_mutex);
 }
 
 static void stop(void) {
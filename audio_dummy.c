@@ -25,15 +25,166 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include "common.h"
 #include "audio.h"
 
+// The dummy back end discards the audio, but it models a DAC, so that synchronisation can be
+// exercised without sound hardware. Frames go into a FIFO which drains in real time at the
+// nominal rate plus an offset, in ppm. A random error, up to the jitter, is applied to the time
+// reported with each delay, as if the hardware pointer were read at an uncertain moment.
+// play() waits, as a real device would, if the FIFO is full. If the FIFO empties while running,
+// that's an underrun.
+
+static void help(void);
+
 int Fs;
 long long starttime, samples_played;
 
-static int init(int argc, char **argv) { return 0; }
+static pthread_mutex_t dummy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int fifo_size = 22050;  // frames
+static double drift_ppm = 0.0; // how much faster than nominal the FIFO drains
+static int jitter_us = 0;      // the maximum error in the time a delay is measured at
+
+static double fifo_frames;    // frames in the FIFO at fifo_time
+static uint64_t fifo_time;    // as from get_absolute_time_in_fp()
+static int fifo_running;      // the FIFO is draining
+static long long underruns, underrun_frames; // frames of silence played in underruns
+
+static double drain_rate(void) { return Fs * (1.0 + drift_ppm * 1e-6); }
+
+// bring the FIFO up to the time given
+static void fifo_update(uint64_t time_now) {
+  if ((fifo_running) && (time_now > fifo_time)) {
+    double frames = ((time_now - fifo_time) * drain_rate()) / 4294967296.0;
+    if (frames > fifo_frames) {
+      underruns++;
+      underrun_frames += frames - fifo_frames;
+      debug(2, "dummy audio underrun");
+      fifo_frames = 0;
+      fifo_running = 0;
+    } else {
+      fifo_frames -= frames;
+    }
+  }
+  fifo_time = time_now;
+}
+
+static uint64_t jittered(uint64_t time_now) {
+  if (jitter_us) {
+    int64_t jitter = (random() % (2 * jitter_us + 1)) - jitter_us;
+    if (jitter >= 0)
+      time_now += ((uint64_t)jitter << 32) / 1000000;
+    else
+      time_now -= ((uint64_t)(-jitter) << 32) / 1000000;
+  }
+  return time_now;
+}
+
+static int init(int argc, char **argv) {
+  int value;
+  double dvalue;
+
+  config.audio_backend_buffer_desired_length = 6615; // as for alsa
+  config.audio_backend_latency_offset = 0;
+
+  if (config.cfg != NULL) {
+    /* Get the FIFO size. */
+    if (config_lookup_int(config.cfg, "dummy.dac_buffer_size", &value)) {
+      if ((value < 352) || (value > 441000))
+        die("Invalid dummy dac_buffer_size \"%d\". It should be between 352 and 441000, default "
+            "is 22050",
+            value);
+      else
+        fifo_size = value;
+    }
+
+    /* Get the drift. */
+    if (config_lookup_float(config.cfg, "dummy.drift_ppm", &dvalue)) {
+      if ((dvalue < -10000.0) || (dvalue > 10000.0))
+        die("Invalid dummy drift_ppm \"%f\". It should be between -10000 and 10000, default is 0",
+            dvalue);
+      else
+        drift_ppm = dvalue;
+    }
+
+    /* Get the jitter. */
+    if (config_lookup_int(config.cfg, "dummy.jitter_us", &value)) {
+      if ((value < 0) || (value > 100000))
+        die("Invalid dummy jitter_us \"%d\". It should be between 0 and 100000, default is 0",
+            value);
+      else
+        jitter_us = value;
+    }
+
+    /* Get the desired buffer size setting. */
+    if (config_lookup_int(config.cfg, "dummy.audio_backend_buffer_desired_length", &value)) {
+      if ((value < 0) || (value > 66150))
+        die("Invalid dummy audio backend buffer desired length \"%d\". It should be between 0 and "
+            "66150, default is 6615",
+            value);
+      else
+        config.audio_backend_buffer_desired_length = value;
+    }
+
+    /* Get the latency offset. */
+    if (config_lookup_int(config.cfg, "dummy.audio_backend_latency_offset", &value)) {
+      if ((value < -66150) || (value > 66150))
+        die("Invalid dummy audio backend buffer latency offset \"%d\". It should be between "
+            "-66150 and +66150, default is 0",
+            value);
+      else
+        config.audio_backend_latency_offset = value;
+    }
+  }
+
+  optind = 1; // optind=0 is equivalent to optind=1 plus special behaviour
+  argv--;     // so we shift the arguments to satisfy getopt()
+  argc++;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:d:j:")) > 0) {
+    switch (opt) {
+    case 'b':
+      value = atoi(optarg);
+      if ((value < 352) || (value > 441000))
+        die("Invalid dummy -b dac buffer size \"%s\". It should be between 352 and 441000, "
+            "default is 22050",
+            optarg);
+      fifo_size = value;
+      break;
+    case 'd':
+      dvalue = atof(optarg);
+      if ((dvalue < -10000.0) || (dvalue > 10000.0))
+        die("Invalid dummy -d drift \"%s\". It should be between -10000 and 10000 ppm, default "
+            "is 0",
+            optarg);
+      drift_ppm = dvalue;
+      break;
+    case 'j':
+      value = atoi(optarg);
+      if ((value < 0) || (value > 100000))
+        die("Invalid dummy -j jitter \"%s\". It should be between 0 and 100000 us, default is 0",
+            optarg);
+      jitter_us = value;
+      break;
+    default:
+      help();
+      die("Invalid audio option -%c specified", opt);
+    }
+  }
+  if (optind < argc)
+    die("Invalid audio argument: %s", argv[optind]);
+
+  if (config.audio_backend_buffer_desired_length >= fifo_size)
+    die("The dummy audio backend buffer desired length (%d) must be less than its "
+        "dac_buffer_size (%d).",
+        config.audio_backend_buffer_desired_length, fifo_size);
+  return 0;
+}
 
 static void deinit(void) {}
 
@@ -41,14 +192,76 @@ static void start(int sample_rate) {
   Fs = sample_rate;
   starttime = 0;
   samples_played = 0;
+  pthread_mutex_lock(&dummy_mutex);
+  fifo_frames = 0;
+  fifo_running = 0;
+  underruns = underrun_frames = 0;
+  pthread_mutex_unlock(&dummy_mutex);
   debug(1, "dummy audio output started at Fs=%d Hz\n", sample_rate);
 }
 
-static void play(short buf[], int samples) {}
+static void play(short buf[], int samples) {
+  pthread_mutex_lock(&dummy_mutex);
+  fifo_update(get_absolute_time_in_fp());
+  // wait for room, as a real device would
+  while ((fifo_running) && (fifo_frames + samples > fifo_size)) {
+    useconds_t wait = ((fifo_frames + samples - fifo_size) * 1000000) / drain_rate() + 1;
+    pthread_mutex_unlock(&dummy_mutex);
+    usleep(wait);
+    pthread_mutex_lock(&dummy_mutex);
+    fifo_update(get_absolute_time_in_fp());
+  }
+  fifo_frames += samples;
+  fifo_running = 1;
+  samples_played += samples;
+  pthread_mutex_unlock(&dummy_mutex);
+}
+
+static int timed_delay(int32_t *the_delay, uint64_t *the_time) {
+  pthread_mutex_lock(&dummy_mutex);
+  uint64_t time_now = get_absolute_time_in_fp();
+  fifo_update(time_now);
+  *the_delay = fifo_frames;
+  *the_time = jittered(time_now);
+  pthread_mutex_unlock(&dummy_mutex);
+  return 0;
+}
+
+static uint32_t delay() {
+  int32_t the_delay;
+  uint64_t the_time;
+  timed_delay(&the_delay, &the_time);
+  // bring the delay to now, carrying the error in the time with it
+  uint64_t time_now = get_absolute_time_in_fp();
+  double frames_played;
+  if (time_now >= the_time)
+    frames_played = ((time_now - the_time) * drain_rate()) / 4294967296.0;
+  else
+    frames_played = -(((the_time - time_now) * drain_rate()) / 4294967296.0);
+  if (frames_played >= the_delay)
+    return 0;
+  return the_delay - frames_played;
+}
 
-static void stop(void) { debug(1, "dummy audio stopped\n"); }
+static void flush(void) {
+  pthread_mutex_lock(&dummy_mutex);
+  fifo_frames = 0;
+  fifo_running = 0;
+  pthread_mutex_unlock(&dummy_mutex);
+}
 
-static void help(void) { printf("    There are no options for dummy audio.\n"); }
+static void stop(void) {
+  flush();
+  debug(1, "dummy audio stopped after %lld frames, with %lld underruns totalling %lld frames\n",
+        samples_played, underruns, underrun_frames);
+}
+
+static void help(void) {
+  printf("    -b frames           the size of the simulated DAC's buffer [22050*]\n"
+         "    -d ppm              the DAC runs this much faster than nominal [0*]\n"
+         "    -j microseconds     the maximum error in the timing of a delay measurement [0*]\n"
+         "    *) default option\n");
+}
 
 audio_output audio_dummy = {.name = "dummy",
                             .help = &help,
@@ -56,8 +269,9 @@ audio_output audio_dummy = {.name = "dummy",
                             .deinit = &deinit,
                             .start = &start,
                             .stop = &stop,
-                            .flush = NULL,
-                            .delay = NULL,
+                            .flush = &flush,
+                            .delay = &delay,
+                            .timed_delay = &timed_delay,
                             .play = &play,
                             .volume = NULL,
                             .parameters = NULL};
@@ -0,0 +1,632 @@
+/*
+ * A stress benchmark for the player's packet buffer. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libdaemon/dlog.h>
+
+#include "common.h"
+#include "alac_encode.h"
+#include "player.h"
+#include "rtp.h"
+#include "rtsp.h"
+
+// This hammers the player's buffer -- player_put_packet() on one or more producer threads, and
+// buffer_get_frame() on the player's own thread -- with a pattern of packets, and measures how
+// fast it goes, how long packets wait between being put and being released, and how long the
+// threads wait for ab_mutex and flush_mutex.
+// Resend requests are answered by a thread of their own, as the source would answer them.
+// The player runs on a virtual clock, so that it plays packets as fast as it is given them. The
+// clock may only move on to when the packet a window behind the latest one put is due; when it
+// can't go further, the player waits, for real, for the producers.
+
+typedef struct {
+  char *name;
+  char *description;
+} pattern;
+
+static pattern patterns[] = {
+    {"in-order", "every packet, in order"},
+    {"reorder", "every packet, shuffled in blocks of eight"},
+    {"burst-loss", "in order, with one packet in a hundred starting a burst of five lost"},
+    {"wrap", "in order, with the sequence number starting just short of 65535"},
+    {"duplicates", "in order, with one packet in twenty sent again up to eight packets later"},
+};
+
+#define number_of_patterns (sizeof(patterns) / sizeof(pattern))
+#define max_producers 16
+
+static pattern pat; // the one being run
+static int64_t number_of_packets = 100000;
+static int number_of_producers = 1;
+static int batch_size = 1;
+static int64_t window = 64; // packets the player is kept behind the latest one put
+static const int64_t max_lead = 128; // packets the producers may get ahead of the player's window
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static const uint32_t rtp_base = 0x10000000;
+static seq_t seq_base;
+
+static int64_t *schedule; // the packet numbers, in the order they're put
+static int64_t *highest_so_far; // the highest packet number in the schedule up to each entry
+static int64_t schedule_length;
+
+static uint64_t *put_time_ns; // when each packet was first put, for real
+static volatile int64_t producer_progress[max_producers]; // entries each has done
+static volatile int producers_finished;
+static uint64_t put_calls, put_ns; // protected by stats_mutex
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int64_t highest_put = -1;
+
+// resend requests waiting to be answered
+#define resend_queue_size 4096
+static pthread_mutex_t resend_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resend_cond = PTHREAD_COND_INITIALIZER;
+static int64_t resend_queue[resend_queue_size];
+static int resends_queued, resender_stop;
+static uint64_t packets_resent;
+
+// the player's progress, which holds the producers back
+static pthread_mutex_t released_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released_cond = PTHREAD_COND_INITIALIZER;
+static int64_t last_released = -1;
+
+static uint64_t *latencies_ns; // from put to release, for each packet released
+static int64_t latencies_recorded;
+static uint64_t frames_released, silent_packets, player_waits_ns;
+
+static pthread_mutex_t finished_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;
+static int finished;
+
+static uint64_t real_time_ns(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return tn.tv_sec * 1000000000ULL + tn.tv_nsec;
+}
+
+// xorshift64*
+static double uniform(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// the pattern
+
+static void add_to_schedule(int64_t packet) {
+  schedule[schedule_length] = packet;
+  int64_t highest = schedule_length ? highest_so_far[schedule_length - 1] : -1;
+  highest_so_far[schedule_length] = packet > highest ? packet : highest;
+  schedule_length++;
+}
+
+static void make_schedule(void) {
+  // room for every packet twice, which the duplicates can't exceed
+  schedule = malloc(2 * number_of_packets * sizeof(int64_t));
+  highest_so_far = malloc(2 * number_of_packets * sizeof(int64_t));
+  if ((schedule == NULL) || (highest_so_far == NULL))
+    die("Can't allocate the schedule.");
+  schedule_length = 0;
+  seq_base = strcmp(pat.name, "wrap") == 0 ? 0xfff0 : 0x1000;
+  int64_t packet, i;
+  if (strcmp(pat.name, "reorder") == 0) {
+    for (packet = 0; packet < number_of_packets; packet += 8) {
+      int64_t block[8], n = number_of_packets - packet < 8 ? number_of_packets - packet : 8;
+      for (i = 0; i < n; i++)
+        block[i] = packet + i;
+      for (i = n - 1; i > 0; i--) {
+        int64_t j = uniform() * (i + 1), t = block[i];
+        block[i] = block[j];
+        block[j] = t;
+      }
+      for (i = 0; i < n; i++)
+        add_to_schedule(block[i]);
+    }
+  } else if (strcmp(pat.name, "burst-loss") == 0) {
+    for (packet = 0; packet < number_of_packets; packet++) {
+      if ((packet > 0) && (uniform() < 0.01))
+        packet += 4; // this one and the next four are lost
+      else
+        add_to_schedule(packet);
+    }
+  } else if (strcmp(pat.name, "duplicates") == 0) {
+    int64_t *again = calloc(number_of_packets + 9, sizeof(int64_t)); // packet + 1, or 0
+    if (again == NULL)
+      die("Can't allocate the schedule.");
+    for (packet = 0; packet < number_of_packets; packet++) {
+      add_to_schedule(packet);
+      if (uniform() < 0.05)
+        again[packet + 1 + (int64_t)(uniform() * 8)] = packet + 1;
+      if (again[packet])
+        add_to_schedule(again[packet] - 1);
+    }
+    free(again);
+  } else {
+    for (packet = 0; packet < number_of_packets; packet++)
+      add_to_schedule(packet);
+  }
+}
+
+// the right channel of every frame carries the low 16 bits of its packet's number
+static int alac_frame_of_packet(int64_t packet, uint8_t *out) {
+  int16_t samples[352 * 2];
+  int i;
+  for (i = 0; i < 352; i++) {
+    samples[i * 2] = 1000;
+    samples[i * 2 + 1] = packet & 0xffff;
+  }
+  return alac_encode_uncompressed(samples, 352, out);
+}
+
+// the producers
+
+static int player_is_behind(int64_t packet) {
+  pthread_mutex_lock(&released_mutex);
+  int behind = packet > last_released + window + max_lead;
+  pthread_mutex_unlock(&released_mutex);
+  return behind;
+}
+
+static void wait_for_player(int64_t packet) {
+  pthread_mutex_lock(&released_mutex);
+  while (packet > last_released + window + max_lead)
+    pthread_cond_wait(&released_cond, &released_mutex);
+  pthread_mutex_unlock(&released_mutex);
+}
+
+typedef struct {
+  int index;
+  uint8_t data[32][alac_encoded_size(352)];
+  rtp_audio_packet batch[32];
+  int64_t packet[32];
+  int in_batch;
+  int64_t done; // entries put
+  uint64_t calls, time_in_calls;
+} producer;
+
+static void put_batch(producer *p) {
+  if (p->in_batch == 0)
+    return;
+  uint64_t before = real_time_ns();
+  int i;
+  for (i = 0; i < p->in_batch; i++) {
+    if (put_time_ns[p->packet[i]] == 0)
+      put_time_ns[p->packet[i]] = before;
+    if (p->packet[i] > highest_put)
+      highest_put = p->packet[i];
+  }
+  if (p->in_batch == 1)
+    player_put_packet(p->batch[0].seqno, p->batch[0].timestamp, p->batch[0].data,
+                      p->batch[0].len);
+  else
+    player_put_packets(p->batch, p->in_batch);
+  p->time_in_calls += real_time_ns() - before;
+  p->calls++;
+  p->done += p->in_batch;
+  p->in_batch = 0;
+  if (p->index >= 0) // not the resender
+    producer_progress[p->index] = p->done;
+}
+
+static void add_to_batch(producer *p, int64_t packet) {
+  rtp_audio_packet *b = &p->batch[p->in_batch];
+  b->seqno = seq_base + packet;
+  b->timestamp = rtp_base + packet * 352;
+  b->len = alac_frame_of_packet(packet, p->data[p->in_batch]);
+  b->data = p->data[p->in_batch];
+  p->packet[p->in_batch++] = packet;
+}
+
+static void *producer_thread(void *arg) {
+  producer *p = calloc(1, sizeof(producer));
+  if (p == NULL)
+    die("Can't allocate a producer.");
+  p->index = (int)(intptr_t)arg;
+  int64_t entry;
+  for (entry = p->index; entry < schedule_length; entry += number_of_producers) {
+    int64_t packet = schedule[entry];
+    if (player_is_behind(packet)) {
+      put_batch(p); // so that the player can catch up
+      wait_for_player(packet);
+    }
+    add_to_batch(p, packet);
+    if (p->in_batch == batch_size)
+      put_batch(p);
+  }
+  put_batch(p);
+  pthread_mutex_lock(&stats_mutex);
+  put_calls += p->calls;
+  put_ns += p->time_in_calls;
+  pthread_mutex_unlock(&stats_mutex);
+  free(p);
+  return NULL;
+}
+
+// answers resend requests, one packet at a time, as they come in
+static void *resender_thread(void *arg) {
+  producer *p = calloc(1, sizeof(producer));
+  if (p == NULL)
+    die("Can't allocate the resender.");
+  p->index = -1;
+  pthread_mutex_lock(&resend_mutex);
+  for (;;) {
+    while ((resends_queued == 0) && (resender_stop == 0))
+      pthread_cond_wait(&resend_cond, &resend_mutex);
+    if (resends_queued == 0)
+      break;
+    int64_t packet = resend_queue[--resends_queued];
+    pthread_mutex_unlock(&resend_mutex);
+    add_to_batch(p, packet);
+    put_batch(p);
+    packets_resent++;
+    pthread_mutex_lock(&resend_mutex);
+  }
+  pthread_mutex_unlock(&resend_mutex);
+  free(p);
+  return NULL;
+}
+
+// the clock
+
+static const uint64_t start_time = (uint64_t)1000 << 32;
+static volatile uint64_t virtual_time;
+
+// when the player may release a packet
+static uint64_t due_time(int64_t packet) {
+  int64_t frames = packet * 352 + config.latency + config.audio_backend_latency_offset -
+                   config.audio_backend_buffer_desired_length;
+  return start_time + (frames << 32) / 44100;
+}
+
+// how far the clock may go: to when the packet a window behind the latest one put is due
+static uint64_t time_limit(void) {
+  if (producers_finished)
+    return due_time(number_of_packets + window);
+  int64_t complete = schedule_length; // all the entries before this have been put
+  int i;
+  for (i = 0; i < number_of_producers; i++) {
+    int64_t next_entry = producer_progress[i] * number_of_producers + i;
+    if (next_entry < complete)
+      complete = next_entry;
+  }
+  if (complete == 0)
+    return start_time;
+  return due_time(highest_so_far[complete - 1] - window);
+}
+
+static uint64_t virtual_now(void) { return virtual_time; }
+
+// called by the player, with ab_mutex locked, when it has nothing to do until the time given
+static int gated_timedwait_until(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t time_fp) {
+  uint64_t limit = time_limit();
+  if (time_fp <= limit) {
+    if (time_fp > virtual_time)
+      virtual_time = time_fp;
+  } else {
+    if (limit > virtual_time)
+      virtual_time = limit;
+    if ((producers_finished) && (virtual_time >= limit)) {
+      pthread_mutex_lock(&finished_mutex);
+      finished = 1;
+      pthread_cond_signal(&finished_cond);
+      pthread_mutex_unlock(&finished_mutex);
+      pthread_mutex_unlock(mutex);
+      usleep(1000); // until the player is stopped
+      pthread_mutex_lock(mutex);
+      return ETIMEDOUT;
+    }
+    // wait for the producers to put more -- they signal the condition
+    uint64_t before = real_time_ns();
+    struct timespec wakeup;
+    clock_gettime(CLOCK_MONOTONIC, &wakeup);
+    wakeup.tv_nsec += 1000000;
+    if (wakeup.tv_nsec >= 1000000000) {
+      wakeup.tv_sec++;
+      wakeup.tv_nsec -= 1000000000;
+    }
+    int rc = pthread_cond_timedwait(cond, mutex, &wakeup);
+    player_waits_ns += real_time_ns() - before;
+    return rc;
+  }
+  return ETIMEDOUT;
+}
+
+static clock_source gated_clock = {.now = &virtual_now, .timedwait_until = &gated_timedwait_until};
+
+// the DAC, which plays at 44,100 frames per second of virtual time
+
+static double dac_frames;
+static uint64_t dac_time;
+
+static void dac_update(void) {
+  double frames = ((virtual_time - dac_time) * 44100.0) / 4294967296.0;
+  dac_frames = frames >= dac_frames ? 0 : dac_frames - frames;
+  dac_time = virtual_time;
+}
+
+static void dac_start(int sample_rate) { dac_time = virtual_time; }
+
+static void dac_play(short buf[], int samples) {
+  dac_update();
+  dac_frames += samples;
+  frames_released += samples;
+  if ((buf[0] == 0) && (buf[1] == 0)) {
+    silent_packets++;
+    return;
+  }
+  pthread_mutex_lock(&released_mutex);
+  int64_t expected = last_released + 1;
+  int64_t packet = expected + (int16_t)((uint16_t)buf[1] - (uint16_t)expected);
+  if ((packet >= 0) && (packet < number_of_packets)) {
+    if (put_time_ns[packet])
+      latencies_ns[latencies_recorded++] = real_time_ns() - put_time_ns[packet];
+    last_released = packet;
+    pthread_cond_broadcast(&released_cond);
+  }
+  pthread_mutex_unlock(&released_mutex);
+}
+
+static uint32_t dac_delay() {
+  dac_update();
+  return dac_frames;
+}
+
+static void dac_flush(void) { dac_frames = 0; }
+
+static void dac_stop(void) { dac_frames = 0; }
+
+static audio_output bench_dac = {.name = "bench",
+                                 .help = NULL,
+                                 .init = NULL,
+                                 .deinit = NULL,
+                                 .start = &dac_start,
+                                 .stop = &dac_stop,
+                                 .flush = &dac_flush,
+                                 .delay = &dac_delay,
+                                 .timed_delay = NULL,
+                                 .play = &dac_play,
+                                 .volume = NULL,
+                                 .parameters = NULL};
+
+// what the player needs from the rest of Shairport Sync
+
+void get_reference_timestamp_stuff(uint32_t *timestamp, uint64_t *timestamp_time,
+                                   uint64_t *remote_timestamp_time) {
+  *timestamp = rtp_base;
+  *timestamp_time = start_time;
+  *remote_timestamp_time = start_time;
+}
+
+void clear_reference_timestamp(void) {} // the reference never changes here
+
+double get_source_drift_ppm(void) { return 0.0; }
+
+// called with ab_mutex locked, so the packets are queued for the resender thread
+void rtp_request_resend(seq_t first, uint32_t count) {
+  int64_t highest = highest_put;
+  int64_t packet = highest - (seq_t)((seq_t)(seq_base + highest) - first);
+  uint32_t i;
+  pthread_mutex_lock(&resend_mutex);
+  for (i = 0; i < count; i++, packet++)
+    if ((packet >= 0) && (packet < number_of_packets) && (resends_queued < resend_queue_size))
+      resend_queue[resends_queued++] = packet;
+  pthread_cond_signal(&resend_cond);
+  pthread_mutex_unlock(&resend_mutex);
+}
+
+void rtsp_request_shutdown_stream(void) { debug(1, "Buffer bench: the player asked to stop."); }
+
+#ifdef CONFIG_METADATA
+int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, enum metadata_policy policy) {
+  return 0;
+}
+#endif
+
+void shairport_shutdown() {}
+
+static int compare_uint64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double p) {
+  if (latencies_recorded == 0)
+    return 0.0;
+  int64_t i = p * (latencies_recorded - 1);
+  return latencies_ns[i] * 0.001;
+}
+
+static void run_pattern(void) {
+  config.output = &bench_dac;
+  config.latency = 88200;
+  config.tolerance = 88;
+  config.resyncthreshold = 441 * 5;
+  config.flushthreshold = 44100;
+  config.buffer_start_fill = 220;
+  config.audio_backend_buffer_desired_length = 6615;
+  config.audio_backend_latency_offset = 0;
+  config.packet_stuffing = ST_basic;
+  config.dont_check_timeout = 1;
+
+  make_schedule();
+  put_time_ns = calloc(number_of_packets, sizeof(uint64_t));
+  latencies_ns = calloc(number_of_packets, sizeof(uint64_t));
+  if ((put_time_ns == NULL) || (latencies_ns == NULL))
+    die("Can't allocate the packet records.");
+  virtual_time = start_time;
+  set_clock_source(&gated_clock);
+
+  stream_cfg stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.encrypted = 0;
+  int32_t fmtp[12] = {96, 352, 0, 16, 40, 10, 14, 2, 255, 0, 0, 44100};
+  memcpy(stream.fmtp, fmtp, sizeof(fmtp));
+
+  uint64_t real_start = real_time_ns();
+  player_play(&stream);
+  pthread_t producers[max_producers], resender;
+  pthread_create(&resender, NULL, resender_thread, NULL);
+  int i;
+  for (i = 0; i < number_of_producers; i++)
+    pthread_create(&producers[i], NULL, producer_thread, (void *)(intptr_t)i);
+  for (i = 0; i < number_of_producers; i++)
+    pthread_join(producers[i], NULL);
+  producers_finished = 1;
+  uint64_t producers_end = real_time_ns();
+  pthread_mutex_lock(&finished_mutex);
+  while (finished == 0)
+    pthread_cond_wait(&finished_cond, &finished_mutex);
+  pthread_mutex_unlock(&finished_mutex);
+  player_statistics statistics;
+  player_get_statistics(&statistics);
+  player_stop();
+  pthread_mutex_lock(&resend_mutex);
+  resender_stop = 1;
+  pthread_cond_signal(&resend_cond);
+  pthread_mutex_unlock(&resend_mutex);
+  pthread_join(resender, NULL);
+  uint64_t real_end = real_time_ns();
+
+  double producing = (producers_end - real_start) * 1e-9, total = (real_end - real_start) * 1e-9;
+  qsort(latencies_ns, latencies_recorded, sizeof(uint64_t), compare_uint64);
+  printf("%s: %s.\n", pat.name, pat.description);
+  printf("  %lld puts of %lld packets by %d producer%s in batches of %d took %.2f seconds: "
+         "%.0f puts per second, %.2f us per call.\n",
+         (long long)schedule_length, (long long)number_of_packets, number_of_producers,
+         number_of_producers == 1 ? "" : "s", batch_size, producing, schedule_length / producing,
+         put_calls ? put_ns * 0.001 / put_calls : 0.0);
+  printf("  %lld packets released in %.2f seconds: %.0f per second; %llu silent packets "
+         "played.\n",
+         (long long)latencies_recorded, total, latencies_recorded / total,
+         (unsigned long long)silent_packets);
+  printf("  release latency (us): median %.1f, 99%% %.1f, 99.9%% %.1f, maximum %.1f.\n",
+         percentile_us(0.5), percentile_us(0.99), percentile_us(0.999), percentile_us(1.0));
+  printf("  waits for ab_mutex: %llu, %.2f ms in all; for flush_mutex: %llu, %.2f ms in all; "
+         "player waited %.2f ms for producers.\n",
+         (unsigned long long)statistics.ab_mutex_waits, statistics.ab_mutex_wait_ns * 1e-6,
+         (unsigned long long)statistics.flush_mutex_waits, statistics.flush_mutex_wait_ns * 1e-6,
+         player_waits_ns * 1e-6);
+  printf("  missing packets %llu; late packets %llu; too late packets %llu; resend requests "
+         "%llu; packets resent %llu.\n",
+         (unsigned long long)statistics.missing_packets,
+         (unsigned long long)statistics.late_packets,
+         (unsigned long long)statistics.too_late_packets,
+         (unsigned long long)statistics.resend_requests, (unsigned long long)packets_resent);
+  fflush(stdout);
+}
+
+static void usage(char *name) {
+  unsigned int i;
+  printf("Usage: %s [options]\n"
+         "Measures the player's packet buffer under load.\n"
+         "    -p pattern      run this pattern [all*", name);
+  for (i = 0; i < number_of_patterns; i++)
+    printf("|%s", patterns[i].name);
+  printf("]\n"
+         "    -n packets      put this many packets [100000*]\n"
+         "    -t threads      the number of producer threads [1*], up to %d\n"
+         "    -b batch        put this many packets at a time [1*], up to 32\n"
+         "    -w packets      keep the player this far behind the latest packet [64*]\n"
+         "    -r seed         random number seed\n"
+         "    -v              more debug messages; repeat for more\n"
+         "    *) default option\n",
+         max_producers);
+}
+
+int main(int argc, char **argv) {
+  char *which = "all";
+  int opt;
+  daemon_log_ident = "shairport-sync-buffer-bench";
+  while ((opt = getopt(argc, argv, "p:n:t:b:w:r:vh")) > 0) {
+    switch (opt) {
+    case 'p':
+      which = optarg;
+      break;
+    case 'n':
+      number_of_packets = atoll(optarg);
+      break;
+    case 't':
+      number_of_producers = atoi(optarg);
+      break;
+    case 'b':
+      batch_size = atoi(optarg);
+      break;
+    case 'w':
+      window = atoll(optarg);
+      break;
+    case 'r':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    case 'v':
+      debuglev++;
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if ((optind != argc) || (number_of_packets < 1) || (number_of_producers < 1) ||
+      (number_of_producers > max_producers) || (batch_size < 1) || (batch_size > 32) ||
+      (window < 8) || (window + max_lead + 2 * max_producers >= 512)) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  unsigned int i, run = 0;
+  for (i = 0; i < number_of_patterns; i++) {
+    if ((strcmp(which, "all") != 0) && (strcmp(which, patterns[i].name) != 0))
+      continue;
+    pat = patterns[i];
+    // the player keeps its state in statics, so each pattern gets a fresh process
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_pattern();
+      exit(0);
+    } else if (pid > 0) {
+      int status;
+      waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+        printf("%s: failed.\n", pat.name);
+    } else {
+      die("Can't fork a pattern: %s.", strerror(errno));
+    }
+    run++;
+  }
+  if (run == 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+  return 0;
+}
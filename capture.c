@@ -0,0 +1,121 @@
+/*
+ * Capture of received RTSP and RTP traffic. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "capture.h"
+
+static FILE *capture_file = NULL;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int capture_open(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    warn("Can't open capture file \"%s\": %s.", path, strerror(errno));
+    return -1;
+  }
+  if (fwrite(capture_magic, 8, 1, f) != 1) {
+    warn("Can't write to capture file \"%s\": %s.", path, strerror(errno));
+    fclose(f);
+    return -1;
+  }
+  setvbuf(f, NULL, _IOFBF, 256 * 1024); // the file is only written out now and again
+  pthread_mutex_lock(&capture_mutex);
+  capture_file = f;
+  pthread_mutex_unlock(&capture_mutex);
+  debug(1, "Capturing to \"%s\".", path);
+  return 0;
+}
+
+void capture_close(void) {
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file) {
+    fclose(capture_file);
+    capture_file = NULL;
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+int capturing(void) { return capture_file != NULL; }
+
+void capture_record(capture_kind kind, uint64_t time, const void *data, uint32_t length) {
+  uint8_t header[capture_record_header_size];
+  int i;
+  for (i = 0; i < 8; i++)
+    header[i] = time >> (56 - 8 * i);
+  for (i = 0; i < 4; i++)
+    header[8 + i] = length >> (24 - 8 * i);
+  header[12] = kind;
+  header[13] = header[14] = header[15] = 0;
+
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file) {
+    if ((fwrite(header, sizeof(header), 1, capture_file) != 1) ||
+        ((length != 0) && (fwrite(data, length, 1, capture_file) != 1))) {
+      warn("Error writing to the capture file -- capture stopped.");
+      fclose(capture_file);
+      capture_file = NULL;
+    }
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_flush(void) {
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file)
+    fflush(capture_file);
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+int capture_read_record(FILE *f, capture_kind *kind, uint64_t *time, uint8_t **data,
+                        uint32_t *length) {
+  uint8_t header[capture_record_header_size];
+  if (fread(header, sizeof(header), 1, f) != 1)
+    return -1;
+  int i;
+  *time = 0;
+  for (i = 0; i < 8; i++)
+    *time = (*time << 8) | header[i];
+  *length = 0;
+  for (i = 0; i < 4; i++)
+    *length = (*length << 8) | header[8 + i];
+  *kind = header[12];
+  if (*length > 16 * 1024 * 1024) // nothing received is anything like this big
+    return -1;
+  uint8_t *buffer = realloc(*data, *length + 1);
+  if (buffer == NULL)
+    return -1;
+  *data = buffer;
+  if ((*length != 0) && (fread(buffer, *length, 1, f) != 1))
+    return -1;
+  buffer[*length] = 0; // handy for RTSP requests, which are text
+  return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// A capture file records the RTSP requests and the RTP packets received during sessions, so that
+// they can be played back later, e.g. by shairport-sync-replay.
+// It starts with the eight bytes of capture_magic. Each record then has a sixteen-byte header --
+// the time of receipt (eight bytes, as from get_absolute_time_in_fp()), the length of the data
+// (four bytes) and the kind of record (one byte), all big-endian, and three bytes of padding --
+// followed by the data itself.
+// An RTSP request is recorded as text, as it would be sent, but with "*" in place of the URI.
+
+#define capture_magic "SSCAP001"
+#define capture_record_header_size 16
+
+typedef enum {
+  capture_rtsp_request = 1,
+  capture_rtp_audio,
+  capture_rtp_control,
+  capture_rtp_timing
+} capture_kind;
+
+int capture_open(const char *path); // returns 0 if successful
+void capture_close(void);
+int capturing(void); // true if a capture file is open
+
+void capture_record(capture_kind kind, uint64_t time, const void *data, uint32_t length);
+void capture_flush(void);
+
+// read the next record from a capture file. The data is put into *data, which is realloced as
+// needed. Returns 0 if successful, -1 at the end of the file or if the record is malformed.
+int capture_read_record(FILE *f, capture_kind *kind, uint64_t *time, uint8_t **data,
+                        uint32_t *length);
+
+#endif // _CAPTURE_H
@@ -34,12 +34,17 @@
 #include <unistd.h>
 #include <popt.h>
 #include <poll.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <assert.h>
 #include "common.h"
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #ifdef COMPILE_FOR_OSX
 #include <CoreServices/CoreServices.h>
 #include <mach/mach.h>
@@ -273,6 +278,9 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
   case RSA_MODE_KEY:
     *outlen = RSA_private_decrypt(inlen, input, out, rsa, RSA_PKCS1_OAEP_PADDING);
     break;
+  case RSA_MODE_WRAP_KEY:
+    *outlen = RSA_public_encrypt(inlen, input, out, rsa, RSA_PKCS1_OAEP_PADDING);
+    break;
   default:
     die("bad rsa mode");
   }
@@ -326,6 +334,16 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
     if (rc != 0)
       debug(1, "decrypt error %d.", rc);
     break;
+  case RSA_MODE_WRAP_KEY:
+    debug(2, "rsa_apply wrap key");
+    trsa.padding = RSA_PKCS_V21;
+    trsa.hash_id = POLARSSL_MD_SHA1;
+    out = malloc(trsa.len);
+    rc = rsa_pkcs1_encrypt(&trsa, ctr_drbg_random, &ctr_drbg, RSA_PUBLIC, inlen, input, out);
+    if (rc != 0)
+      debug(1, "rsa_pkcs1_encrypt error %d.", rc);
+    *outlen = trsa.len;
+    break;
   default:
     die("bad rsa mode");
   }
@@ -472,7 +490,7 @@ double vol2attn(double vol, long max_db, long min_db) {
   return vol_setting;
 }
 
-uint64_t get_absolute_time_in_fp() {
+static uint64_t system_time_in_fp(void) {
   uint64_t time_now_fp;
 #ifdef COMPILE_FOR_LINUX_AND_FREEBSD
   struct timespec tn;
@@ -512,6 +530,80 @@ uint64_t get_absolute_time_in_fp() {
   return time_now_fp;
 }
 
+static int system_timedwait_until(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t time_fp) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD
+  struct timespec time_of_wakeup;
+  time_of_wakeup.tv_sec = time_fp >> 32;
+  time_of_wakeup.tv_nsec = ((time_fp & 0xffffffff) * 1000000000) >> 32;
+  return pthread_cond_timedwait(cond, mutex, &time_of_wakeup);
+#endif
+#ifdef COMPILE_FOR_OSX
+  uint64_t time_now_fp = system_time_in_fp();
+  uint64_t time_to_wait_fp = time_fp > time_now_fp ? time_fp - time_now_fp : 0;
+  struct timespec time_to_wait;
+  time_to_wait.tv_sec = time_to_wait_fp >> 32;
+  time_to_wait.tv_nsec = ((time_to_wait_fp & 0xffffffff) * 1000000000) >> 32;
+  return pthread_cond_timedwait_relative_np(cond, mutex, &time_to_wait);
+#endif
+}
+
+static clock_source system_clock = {.now = &system_time_in_fp,
+                                    .timedwait_until = &system_timedwait_until};
+static clock_source *the_clock = &system_clock;
+
+void set_clock_source(clock_source *source) {
+  if (source)
+    the_clock = source;
+  else
+    the_clock = &system_clock;
+}
+
+uint64_t get_absolute_time_in_fp() { return the_clock->now(); }
+
+int cond_timedwait_until_fp(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t time_fp) {
+  return the_clock->timedwait_until(cond, mutex, time_fp);
+}
+
+int notifier_init(notifier *n) {
+#ifdef HAVE_SYS_EVENTFD_H
+  n->read_fd = n->write_fd = eventfd(0, EFD_NONBLOCK);
+  if (n->read_fd == -1)
+    return -1;
+#else
+  int fds[2];
+  if (pipe(fds) != 0)
+    return -1;
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  n->read_fd = fds[0];
+  n->write_fd = fds[1];
+#endif
+  return 0;
+}
+
+void notifier_notify(notifier *n) {
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t one = 1;
+  ssize_t ignore = write(n->write_fd, &one, sizeof(one));
+#else
+  char one = 1;
+  ssize_t ignore = write(n->write_fd, &one, sizeof(one)); // if the pipe is full, it's notified anyway
+#endif
+}
+
+void notifier_clear(notifier *n) {
+  uint64_t buffer;
+  while (read(n->read_fd, &buffer, sizeof(buffer)) > 0)
+    ;
+}
+
+void notifier_close(notifier *n) {
+  close(n->read_fd);
+  if (n->write_fd != n->read_fd)
+    close(n->write_fd);
+  n->read_fd = n->write_fd = -1;
+}
+
 ssize_t non_blocking_write(int fd, const void *buf, size_t count) {
   // debug(1,"writing %u to pipe...",count);
   // we are assuming that the count is always smaller than the FIFO's buffer
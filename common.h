@@ -2,12 +2,14 @@
 #define _COMMON_H
 
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <libconfig.h>
 
 #include "config.h"
 #include "audio.h"
 #include "mdns.h"
+#include "thread_policy.h"
 
 #if defined(__APPLE__) && defined(__MACH__)
 /* Apple OSX and iOS (Darwin). ------------------------------ */
@@ -44,6 +46,11 @@ typedef struct {
 #ifdef CONFIG_METADATA
   int metadata_enabled;
   char *metadata_pipename;
+  int metadata_binary; // frame items with a binary header and raw data, rather than XML and base64
+  char *metadata_shm_name; // if set, items are also published to a shared memory ring of this name
+  int metadata_shm_size;   // the number of bytes of items the ring holds
+  char *metadata_cover_art_cache_directory; // if set, each different picture is sent only once
+  int metadata_cover_art_cache_size;        // the number of bytes of pictures kept there
   int get_coverart;
 #endif
   uint8_t hw_addr[6];
@@ -53,6 +60,9 @@ typedef struct {
   int ignore_volume_control;
   int resyncthreshold; // if it get's out of whack my more than this, resync. Zero means never
                        // resync.
+  int flushthreshold;  // errors beyond the resync threshold but within this are caught up by
+                       // dropping or inserting frames; bigger ones cause a flush. Zero means
+                       // always flush.
   int allow_session_interruption;
   int timeout; // while in play mode, exit if no packets of audio come in for more than this number
                // of seconds . Zero means never exit.
@@ -82,6 +92,9 @@ typedef struct {
                                             // audio backend buffer -- the DAC buffer for ALSA
   uint32_t audio_backend_latency_offset; // this will be the offset to compensate for any fixed latency
                                      // there might be in the audio
+  thread_settings thread_settings[thread_role_count]; // scheduling of the player, RTP, etc. threads
+  int lock_memory; // lock all memory into RAM at startup, so that threads don't stall on page faults
+  char *capture_file; // if set, record the RTSP requests and RTP packets received in this file
 } shairport_cfg;
 
 // true if Shairport Sync is supposed to be sending output to the output device, false otherwise
@@ -92,6 +105,18 @@ void set_requested_connection_state_to_output(int v);
 
 ssize_t non_blocking_write(int fd, const void *buf, size_t count); // used in a few places
 
+// a way to wake up a thread waiting in poll() -- poll read_fd for POLLIN.
+// It's an eventfd where available, otherwise a pipe.
+typedef struct {
+  int read_fd;
+  int write_fd;
+} notifier;
+
+int notifier_init(notifier *n); // returns 0 if successful
+void notifier_notify(notifier *n);
+void notifier_clear(notifier *n);
+void notifier_close(notifier *n);
+
 int debuglev;
 void die(char *format, ...);
 void warn(char *format, ...);
@@ -103,6 +128,7 @@ char *base64_enc(uint8_t *input, int length);
 
 #define RSA_MODE_AUTH (0)
 #define RSA_MODE_KEY (1)
+#define RSA_MODE_WRAP_KEY (2) // the reverse of RSA_MODE_KEY, as a source does it
 uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode);
 
 // given a volume (0 to -30) and high and low attenuations in dB*100 (e.g. 0 to -6000 for 0 to -60
@@ -113,6 +139,20 @@ double vol2attn(double vol, long max_db, long min_db);
 
 uint64_t get_absolute_time_in_fp(void);
 
+// wait on a condition variable until signalled or until the time given, as from
+// get_absolute_time_in_fp(). The mutex must be locked, as for pthread_cond_timedwait(), whose
+// result is returned. On Linux and FreeBSD, the condition variable must use CLOCK_MONOTONIC.
+int cond_timedwait_until_fp(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t time_fp);
+
+// the clock behind the two functions above. It's the system clock unless replaced, e.g. by a
+// simulator running in virtual time.
+typedef struct {
+  uint64_t (*now)(void);
+  int (*timedwait_until)(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t time_fp);
+} clock_source;
+
+void set_clock_source(clock_source *source); // NULL restores the system clock
+
 // this is for reading an unsigned 32 bit number, such as an RTP timestamp
 
 uint32_t uatoi(const char *nptr);
@@ -122,8 +162,6 @@ config_t config_file_stuff;
 
 uint32_t buffer_occupancy;
 int64_t session_corrections;
-uint32_t play_segment_reference_frame;
-uint64_t play_segment_reference_frame_remote_time;
 
 void command_start(void);
 void command_stop(void);
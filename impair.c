@@ -0,0 +1,793 @@
+/*
+ * A network-impairment proxy for testing. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <libdaemon/dlog.h>
+
+#include "config.h"
+#include "common.h"
+#include "player.h"
+
+// This sits between an AirPlay source and an instance of Shairport Sync. It relays the RTSP
+// conversation, rewriting the ports in the Transport headers of SETUP so that the audio, control
+// and timing traffic comes through it too, and it loses, duplicates, reorders and delays those
+// packets according to a script of impairment profiles.
+// When each profile ends, it asks the instance for its packet counts with a GET_PARAMETER
+// "statistics" request and logs how they changed.
+
+enum channel { audio_channel, control_channel, timing_channel, number_of_channels };
+
+static const char *channel_names[number_of_channels] = {"audio", "control", "timing"};
+
+typedef struct {
+  double loss, duplicate, reorder; // percentages
+  double delay, jitter, reorder_delay; // milliseconds
+} impairment;
+
+typedef struct {
+  double start; // seconds from the start of the session
+  char name[32];
+  impairment channel[number_of_channels];
+} profile;
+
+typedef struct {
+  uint64_t forwarded, dropped, duplicated, reordered;
+} channel_counts;
+
+typedef struct {
+  uint64_t due; // when to send it
+  uint64_t order; // to keep packets due at the same time in order
+  int fd;
+  struct sockaddr_storage to;
+  socklen_t to_length;
+  int length;
+  uint8_t data[2048];
+} pending_packet;
+
+#define max_pending 4096
+#define max_profiles 64
+
+static profile profiles[max_profiles];
+static int number_of_profiles;
+
+static char *target_host = "127.0.0.1", *target_port = "5000";
+static struct sockaddr_storage server_address, client_address;
+static socklen_t server_address_length, client_address_length;
+
+static int udp_socket[number_of_channels];
+static int proxy_port[number_of_channels];
+static int server_port[number_of_channels], client_port[number_of_channels];
+
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_changed = PTHREAD_COND_INITIALIZER;
+static int session_active;      // a SETUP has been relayed and the connection is still open
+static uint64_t session_start;  // when the SETUP was relayed
+static int current_profile;
+static channel_counts counts[number_of_channels];
+static uint64_t resend_requests_seen, resent_packets_seen;
+
+static pending_packet *pending[max_pending]; // a heap, earliest first
+static int number_pending;
+static uint64_t pending_order;
+static uint64_t rng_state;
+
+// die() calls this
+void shairport_shutdown() {}
+
+static double uniform(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t fp_of_ms(double ms) { return (uint64_t)(ms * 4294967.296); }
+
+static double seconds_of_fp(uint64_t fp) { return (fp * 1.0) / ((uint64_t)1 << 32); }
+
+static void set_port(struct sockaddr_storage *address, int port) {
+  if (address->ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)address)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in *)address)->sin_port = htons(port);
+}
+
+static int get_address_port(struct sockaddr_storage *address) {
+  if (address->ss_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6 *)address)->sin6_port);
+  else
+    return ntohs(((struct sockaddr_in *)address)->sin_port);
+}
+
+static int same_host(struct sockaddr_storage *a, struct sockaddr_storage *b) {
+  if (a->ss_family != b->ss_family)
+    return 0;
+  if (a->ss_family == AF_INET6)
+    return memcmp(&((struct sockaddr_in6 *)a)->sin6_addr, &((struct sockaddr_in6 *)b)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+  return ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr;
+}
+
+// profiles
+
+static void parse_setting(profile *p, char *setting, const char *where) {
+  int first = 0, last = number_of_channels - 1, c;
+  char *colon = strchr(setting, ':');
+  if (colon) {
+    *colon = 0;
+    for (c = 0; c < number_of_channels; c++)
+      if (strcmp(setting, channel_names[c]) == 0)
+        first = last = c;
+    if (first != last)
+      die("%s: unknown channel \"%s\" -- it must be audio, control or timing.", where, setting);
+    setting = colon + 1;
+  }
+  char *equals = strchr(setting, '=');
+  if (equals == NULL)
+    die("%s: \"%s\" should be a setting=value pair.", where, setting);
+  *equals = 0;
+  double value = atof(equals + 1);
+  if (value < 0)
+    die("%s: the value of \"%s\" can not be negative.", where, setting);
+  for (c = first; c <= last; c++) {
+    impairment *i = &p->channel[c];
+    if (strcmp(setting, "loss") == 0)
+      i->loss = value;
+    else if (strcmp(setting, "duplicate") == 0)
+      i->duplicate = value;
+    else if (strcmp(setting, "reorder") == 0)
+      i->reorder = value;
+    else if (strcmp(setting, "reorder_delay") == 0)
+      i->reorder_delay = value;
+    else if (strcmp(setting, "delay") == 0)
+      i->delay = value;
+    else if (strcmp(setting, "jitter") == 0)
+      i->jitter = value;
+    else
+      die("%s: unknown setting \"%s\".", where, setting);
+  }
+}
+
+static void new_profile(double start, const char *name) {
+  if (number_of_profiles == max_profiles)
+    die("Too many profiles -- the maximum is %d.", max_profiles);
+  if ((number_of_profiles) && (start <= profiles[number_of_profiles - 1].start))
+    die("Profile \"%s\" must start after the one before it.", name);
+  profile *p = &profiles[number_of_profiles++];
+  memset(p, 0, sizeof(profile));
+  p->start = start;
+  snprintf(p->name, sizeof(p->name), "%s", name);
+  int c;
+  for (c = 0; c < number_of_channels; c++)
+    p->channel[c].reorder_delay = 20;
+}
+
+// each line of a script is: start-time name [channel:]setting=value ...
+static void load_script(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    die("Can't open \"%s\": %s.", path, strerror(errno));
+  char line[1024], where[256];
+  int line_number = 0;
+  while (fgets(line, sizeof(line), f)) {
+    line_number++;
+    snprintf(where, sizeof(where), "%s line %d", path, line_number);
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = 0;
+    char *saveptr;
+    char *start = strtok_r(line, " \t\r\n", &saveptr);
+    if (start == NULL)
+      continue;
+    char *name = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (name == NULL)
+      die("%s: a profile needs a start time and a name.", where);
+    new_profile(atof(start), name);
+    char *setting;
+    while ((setting = strtok_r(NULL, " \t\r\n", &saveptr)))
+      parse_setting(&profiles[number_of_profiles - 1], setting, where);
+  }
+  fclose(f);
+  if (number_of_profiles == 0)
+    die("There are no profiles in \"%s\".", path);
+}
+
+// the packet queue
+
+static void heap_swap(int a, int b) {
+  pending_packet *t = pending[a];
+  pending[a] = pending[b];
+  pending[b] = t;
+}
+
+static int heap_before(int a, int b) {
+  if (pending[a]->due != pending[b]->due)
+    return pending[a]->due < pending[b]->due;
+  return pending[a]->order < pending[b]->order;
+}
+
+static void queue_packet(uint64_t due, int fd, struct sockaddr_storage *to, socklen_t to_length,
+                         uint8_t *data, int length) {
+  if (number_pending == max_pending) {
+    debug(1, "The queue is full; a packet is lost.");
+    return;
+  }
+  pending_packet *p = malloc(sizeof(pending_packet));
+  if (p == NULL)
+    die("Out of memory.");
+  p->due = due;
+  p->order = pending_order++;
+  p->fd = fd;
+  p->to = *to;
+  p->to_length = to_length;
+  p->length = length;
+  memcpy(p->data, data, length);
+  int i = number_pending++;
+  pending[i] = p;
+  while ((i > 0) && heap_before(i, (i - 1) / 2)) {
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static pending_packet *dequeue_packet(void) {
+  pending_packet *p = pending[0];
+  pending[0] = pending[--number_pending];
+  int i = 0;
+  for (;;) {
+    int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+    if ((left < number_pending) && heap_before(left, smallest))
+      smallest = left;
+    if ((right < number_pending) && heap_before(right, smallest))
+      smallest = right;
+    if (smallest == i)
+      break;
+    heap_swap(i, smallest);
+    i = smallest;
+  }
+  return p;
+}
+
+static void send_due_packets(void) {
+  uint64_t time_now = get_absolute_time_in_fp();
+  while ((number_pending) && (pending[0]->due <= time_now)) {
+    pending_packet *p = dequeue_packet();
+    if (sendto(p->fd, p->data, p->length, 0, (struct sockaddr *)&p->to, p->to_length) < 0)
+      debug(1, "Error forwarding a packet: %s.", strerror(errno));
+    free(p);
+  }
+}
+
+// a packet has come in on one of our UDP ports -- impair it and pass it on
+static void relay_packet(enum channel c, uint8_t *data, int length, struct sockaddr_storage *from) {
+  struct sockaddr_storage to;
+  socklen_t to_length;
+  pthread_mutex_lock(&state_lock);
+  if (!session_active) {
+    pthread_mutex_unlock(&state_lock);
+    return;
+  }
+  // the instance sends resend requests from its audio port, so anything from any of its ports
+  // counts as coming from it
+  int port = get_address_port(from);
+  if (same_host(from, &server_address) &&
+      ((port == server_port[audio_channel]) || (port == server_port[control_channel]) ||
+       (port == server_port[timing_channel]))) {
+    if (c == audio_channel) { // audio only goes to the instance
+      pthread_mutex_unlock(&state_lock);
+      return;
+    }
+    to = client_address;
+    to_length = client_address_length;
+    set_port(&to, client_port[c]);
+    if ((c == control_channel) && (length >= 2) && (data[1] == 0xd5))
+      resend_requests_seen++;
+  } else {
+    to = server_address;
+    to_length = server_address_length;
+    set_port(&to, server_port[c]);
+    if ((c == control_channel) && (length >= 2) && (data[1] == 0xd6))
+      resent_packets_seen++;
+  }
+  impairment i = profiles[current_profile].channel[c];
+  channel_counts *count = &counts[c];
+  if (uniform() * 100 < i.loss) {
+    count->dropped++;
+  } else {
+    uint64_t time_now = get_absolute_time_in_fp();
+    int copies = 1, n;
+    if (uniform() * 100 < i.duplicate) {
+      copies = 2;
+      count->duplicated++;
+    }
+    for (n = 0; n < copies; n++) {
+      double delay = i.delay + uniform() * i.jitter;
+      if (uniform() * 100 < i.reorder) {
+        delay += i.reorder_delay;
+        count->reordered++;
+      }
+      queue_packet(time_now + fp_of_ms(delay), udp_socket[c], &to, to_length, data, length);
+    }
+    count->forwarded++;
+  }
+  pthread_mutex_unlock(&state_lock);
+}
+
+static void *udp_thread(void *arg) {
+  struct pollfd fds[number_of_channels];
+  int c;
+  for (c = 0; c < number_of_channels; c++) {
+    fds[c].fd = udp_socket[c];
+    fds[c].events = POLLIN;
+  }
+  uint8_t packet[2048];
+  for (;;) {
+    int timeout = -1;
+    pthread_mutex_lock(&state_lock);
+    send_due_packets();
+    if (number_pending) {
+      uint64_t time_now = get_absolute_time_in_fp();
+      timeout = 0;
+      if (pending[0]->due > time_now)
+        timeout = (((pending[0]->due - time_now) * 1000) >> 32) + 1;
+    }
+    pthread_mutex_unlock(&state_lock);
+    if (poll(fds, number_of_channels, timeout) <= 0)
+      continue;
+    for (c = 0; c < number_of_channels; c++) {
+      if ((fds[c].revents & POLLIN) == 0)
+        continue;
+      struct sockaddr_storage from;
+      socklen_t from_length = sizeof(from);
+      ssize_t nread;
+      while ((nread = recvfrom(udp_socket[c], packet, sizeof(packet), MSG_DONTWAIT,
+                               (struct sockaddr *)&from, &from_length)) > 0) {
+        relay_packet(c, packet, nread, &from);
+        from_length = sizeof(from);
+      }
+    }
+  }
+  return NULL;
+}
+
+// RTSP
+
+// read a whole RTSP message, headers and content, into a malloced string, or return NULL
+static char *read_message(int fd, size_t *length) {
+  size_t size = 4096, received = 0, content_length = 0;
+  char *message = malloc(size + 1);
+  char *end_of_headers = NULL;
+  while ((end_of_headers == NULL) || (received < (end_of_headers + 4 - message) + content_length)) {
+    if (received == size) {
+      size_t headers = end_of_headers ? end_of_headers - message : 0;
+      size *= 2;
+      message = realloc(message, size + 1);
+      if (end_of_headers)
+        end_of_headers = message + headers;
+    }
+    if (message == NULL)
+      die("Out of memory.");
+    ssize_t nread = read(fd, message + received, size - received);
+    if (nread <= 0) {
+      free(message);
+      return NULL;
+    }
+    received += nread;
+    message[received] = 0;
+    if ((end_of_headers == NULL) && ((end_of_headers = strstr(message, "\r\n\r\n")) != NULL)) {
+      char *cl = strstr(message, "Content-Length: ");
+      if (cl && (cl < end_of_headers))
+        content_length = atoi(cl + strlen("Content-Length: "));
+    }
+  }
+  *length = received;
+  return message;
+}
+
+// find "name=port" in the Transport header, replace the port with new_port and return the old
+// one, or zero if it isn't there
+static int replace_port(char **message, size_t *length, const char *name, int new_port) {
+  char *transport = strstr(*message, "Transport: ");
+  char *end_of_headers = strstr(*message, "\r\n\r\n");
+  if ((transport == NULL) || (transport > end_of_headers))
+    return 0;
+  char *end_of_line = strstr(transport, "\r\n");
+  char *p = strstr(transport, name);
+  if ((p == NULL) || (p > end_of_line))
+    return 0;
+  p += strlen(name);
+  int old_port = atoi(p);
+  char *after = p + strspn(p, "0123456789");
+  char number[8];
+  int n = snprintf(number, sizeof(number), "%d", new_port);
+  size_t head = p - *message, tail = *length - (after - *message);
+  char *rewritten = malloc(head + n + tail + 1);
+  if (rewritten == NULL)
+    die("Out of memory.");
+  memcpy(rewritten, *message, head);
+  memcpy(rewritten + head, number, n);
+  memcpy(rewritten + head + n, after, tail);
+  rewritten[head + n + tail] = 0;
+  free(*message);
+  *message = rewritten;
+  *length = head + n + tail;
+  return old_port;
+}
+
+static int write_all(int fd, char *data, size_t length) {
+  while (length) {
+    ssize_t written = write(fd, data, length);
+    if (written <= 0)
+      return -1;
+    data += written;
+    length -= written;
+  }
+  return 0;
+}
+
+static void end_session(void) {
+  pthread_mutex_lock(&state_lock);
+  session_active = 0;
+  while (number_pending)
+    free(dequeue_packet());
+  pthread_cond_broadcast(&state_changed);
+  pthread_mutex_unlock(&state_lock);
+}
+
+// relay requests from the source and responses from the instance until either side closes
+static void relay_rtsp(int client_fd, int server_fd) {
+  char *message;
+  size_t length;
+  while ((message = read_message(client_fd, &length))) {
+    int is_setup = (strncmp(message, "SETUP ", 6) == 0);
+    if (is_setup) {
+      pthread_mutex_lock(&state_lock);
+      client_port[control_channel] =
+          replace_port(&message, &length, "control_port=", proxy_port[control_channel]);
+      client_port[timing_channel] =
+          replace_port(&message, &length, "timing_port=", proxy_port[timing_channel]);
+      pthread_mutex_unlock(&state_lock);
+    }
+    if (write_all(server_fd, message, length) != 0) {
+      free(message);
+      break;
+    }
+    free(message);
+    if ((message = read_message(server_fd, &length)) == NULL)
+      break;
+    if (is_setup && (strncmp(message, "RTSP/1.0 200", 12) == 0)) {
+      pthread_mutex_lock(&state_lock);
+      server_port[audio_channel] =
+          replace_port(&message, &length, "server_port=", proxy_port[audio_channel]);
+      server_port[control_channel] =
+          replace_port(&message, &length, "control_port=", proxy_port[control_channel]);
+      server_port[timing_channel] =
+          replace_port(&message, &length, "timing_port=", proxy_port[timing_channel]);
+      debug(1, "Instance ports: audio %d, control %d, timing %d; source ports: control %d, "
+               "timing %d.",
+            server_port[audio_channel], server_port[control_channel], server_port[timing_channel],
+            client_port[control_channel], client_port[timing_channel]);
+      session_active = 1;
+      session_start = get_absolute_time_in_fp();
+      current_profile = 0;
+      pthread_cond_broadcast(&state_changed);
+      pthread_mutex_unlock(&state_lock);
+    }
+    if (write_all(client_fd, message, length) != 0) {
+      free(message);
+      break;
+    }
+    free(message);
+  }
+  end_session();
+}
+
+static int connect_to_instance(void) {
+  int fd = socket(server_address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&server_address, server_address_length) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// ask the instance for its packet counts on a connection of our own
+static int get_instance_statistics(player_statistics *statistics) {
+  int fd = connect_to_instance();
+  if (fd < 0)
+    return -1;
+  char request[] = "GET_PARAMETER rtsp://127.0.0.1/statistics RTSP/1.0\r\nCSeq: 1\r\n"
+                   "Content-Type: text/parameters\r\nContent-Length: 12\r\n\r\nstatistics\r\n";
+  size_t length;
+  char *response = NULL;
+  if (write_all(fd, request, strlen(request)) == 0)
+    response = read_message(fd, &length);
+  close(fd);
+  if (response == NULL)
+    return -1;
+  int found = 0;
+  char *p;
+  if ((p = strstr(response, "missing_packets: ")))
+    found += sscanf(p, "missing_packets: %" SCNu64, &statistics->missing_packets);
+  if ((p = strstr(response, "\nlate_packets: ")))
+    found += sscanf(p, "\nlate_packets: %" SCNu64, &statistics->late_packets);
+  if ((p = strstr(response, "too_late_packets: ")))
+    found += sscanf(p, "too_late_packets: %" SCNu64, &statistics->too_late_packets);
+  if ((p = strstr(response, "resend_requests: ")))
+    found += sscanf(p, "resend_requests: %" SCNu64, &statistics->resend_requests);
+  free(response);
+  return found == 4 ? 0 : -1;
+}
+
+// move through the profiles as the session goes on, logging what happened in each one
+static void *script_thread(void *arg) {
+  player_statistics before, after;
+  channel_counts counts_before[number_of_channels];
+  uint64_t resend_requests_before = 0, resent_before = 0;
+  pthread_mutex_lock(&state_lock);
+  for (;;) {
+    while (!session_active)
+      pthread_cond_wait(&state_changed, &state_lock);
+    int p = 0;
+    uint64_t profile_start = session_start;
+    pthread_mutex_unlock(&state_lock);
+    int have_before = (get_instance_statistics(&before) == 0);
+    pthread_mutex_lock(&state_lock);
+    memcpy(counts_before, counts, sizeof(counts));
+    resend_requests_before = resend_requests_seen;
+    resent_before = resent_packets_seen;
+    inform("Session started; profile \"%s\".", profiles[0].name);
+    int session_over = 0;
+    while (!session_over) {
+      // wait for the profile to end, or the session
+      uint64_t profile_end = 0;
+      if (p + 1 < number_of_profiles)
+        profile_end = session_start + (uint64_t)(profiles[p + 1].start * 4294967296.0);
+      while (session_active && ((profile_end == 0) || (get_absolute_time_in_fp() < profile_end))) {
+        if (profile_end == 0) {
+          pthread_cond_wait(&state_changed, &state_lock);
+        } else {
+          cond_timedwait_until_fp(&state_changed, &state_lock, profile_end);
+        }
+      }
+      session_over = !session_active;
+      if (!session_over)
+        current_profile = p + 1;
+      uint64_t profile_end_time = get_absolute_time_in_fp();
+      channel_counts counts_after[number_of_channels];
+      memcpy(counts_after, counts, sizeof(counts));
+      uint64_t resend_requests_after = resend_requests_seen, resent_after = resent_packets_seen;
+      pthread_mutex_unlock(&state_lock);
+
+      int have_after = (get_instance_statistics(&after) == 0);
+      char line[1024];
+      int n = snprintf(line, sizeof(line), "Profile \"%s\" (%.1f s):", profiles[p].name,
+                       seconds_of_fp(profile_end_time - profile_start));
+      int c;
+      for (c = 0; c < number_of_channels; c++)
+        n += snprintf(line + n, sizeof(line) - n, " %s %llu forwarded, %llu dropped, %llu "
+                                                  "duplicated, %llu reordered;",
+                      channel_names[c],
+                      (unsigned long long)(counts_after[c].forwarded - counts_before[c].forwarded),
+                      (unsigned long long)(counts_after[c].dropped - counts_before[c].dropped),
+                      (unsigned long long)(counts_after[c].duplicated -
+                                           counts_before[c].duplicated),
+                      (unsigned long long)(counts_after[c].reordered - counts_before[c].reordered));
+      n += snprintf(line + n, sizeof(line) - n, " resend requests %llu, packets resent %llu.",
+                    (unsigned long long)(resend_requests_after - resend_requests_before),
+                    (unsigned long long)(resent_after - resent_before));
+      inform("%s", line);
+      if (have_before && have_after)
+        inform("Profile \"%s\": missing_packets +%llu, late_packets +%llu, too_late_packets "
+               "+%llu, resend_requests +%llu.",
+               profiles[p].name,
+               (unsigned long long)(after.missing_packets - before.missing_packets),
+               (unsigned long long)(after.late_packets - before.late_packets),
+               (unsigned long long)(after.too_late_packets - before.too_late_packets),
+               (unsigned long long)(after.resend_requests - before.resend_requests));
+      else
+        inform("Profile \"%s\": can't get the instance's statistics.", profiles[p].name);
+
+      before = after;
+      have_before = have_after;
+      memcpy(counts_before, counts_after, sizeof(counts));
+      resend_requests_before = resend_requests_after;
+      resent_before = resent_after;
+      profile_start = profile_end_time;
+      pthread_mutex_lock(&state_lock);
+      if (!session_over) {
+        p++;
+        inform("Profile \"%s\".", profiles[p].name);
+      }
+    }
+    inform("Session ended.");
+  }
+  return NULL;
+}
+
+static int bind_udp(int family) {
+  struct sockaddr_storage local;
+  socklen_t local_length;
+  memset(&local, 0, sizeof(local));
+  local.ss_family = family;
+  local_length = (family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  int s = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+  if ((s < 0) || (bind(s, (struct sockaddr *)&local, local_length) != 0))
+    die("Can't bind a UDP socket: %s.", strerror(errno));
+  return s;
+}
+
+static void usage(char *name) {
+  printf("Usage: %s [options]\n"
+         "Relays AirPlay sessions to an instance of Shairport Sync, impairing the audio, control\n"
+         "and timing traffic, and logs how the instance's packet counts change.\n"
+         "    -l port           the port to listen on for sources [5001*]\n"
+         "    -t host:port      the instance to relay to [127.0.0.1:5000*]\n"
+         "    -s script         a script of impairment profiles\n"
+         "    -p settings       a single profile, e.g. \"loss=2 audio:jitter=20\"\n"
+         "    -v                more debug messages; repeat for more\n"
+         "    *) default option\n"
+         "Each line of a script is a start time in seconds from the SETUP, a name and settings:\n"
+         "    0  clean\n"
+         "    20 lossy   audio:loss=5\n"
+         "    40 jittery delay=10 jitter=30 reorder=2 reorder_delay=20 duplicate=1\n"
+         "A setting applies to the audio, control and timing channels unless one is named.\n"
+         "Loss, duplicate and reorder are percentages; delay, jitter and reorder_delay are in "
+         "milliseconds.\n",
+         name);
+}
+
+int main(int argc, char **argv) {
+  char *listen_port = "5001", *script = NULL, *settings = NULL;
+  int opt;
+  daemon_log_ident = "shairport-sync-impair";
+  while ((opt = getopt(argc, argv, "l:t:s:p:vh")) > 0) {
+    switch (opt) {
+    case 'l':
+      listen_port = optarg;
+      break;
+    case 't': {
+      target_host = strdup(optarg);
+      char *colon = strrchr(target_host, ':');
+      if (colon) {
+        *colon = 0;
+        target_port = colon + 1;
+      }
+    } break;
+    case 's':
+      script = optarg;
+      break;
+    case 'p':
+      settings = optarg;
+      break;
+    case 'v':
+      debuglev++;
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if ((optind != argc) || (script && settings)) {
+    usage(argv[0]);
+    exit(1);
+  }
+  if (script) {
+    load_script(script);
+  } else {
+    new_profile(0, settings ? "constant" : "clean");
+    if (settings) {
+      char *copy = strdup(settings), *saveptr, *setting;
+      for (setting = strtok_r(copy, " \t", &saveptr); setting;
+           setting = strtok_r(NULL, " \t", &saveptr))
+        parse_setting(&profiles[0], setting, "-p");
+      free(copy);
+    }
+  }
+  rng_state = get_absolute_time_in_fp() | 1;
+
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int ret = getaddrinfo(target_host, target_port, &hints, &info);
+  if (ret != 0)
+    die("Can't find \"%s\": %s.", target_host, gai_strerror(ret));
+  memcpy(&server_address, info->ai_addr, info->ai_addrlen);
+  server_address_length = info->ai_addrlen;
+  freeaddrinfo(info);
+
+  // sources connect over the same family as the instance, so the packets can go either way
+  int family = server_address.ss_family;
+  int c;
+  for (c = 0; c < number_of_channels; c++) {
+    udp_socket[c] = bind_udp(family);
+    struct sockaddr_storage local;
+    socklen_t local_length = sizeof(local);
+    getsockname(udp_socket[c], (struct sockaddr *)&local, &local_length);
+    proxy_port[c] = get_address_port(&local);
+  }
+
+  struct sockaddr_storage local;
+  socklen_t local_length;
+  memset(&local, 0, sizeof(local));
+  local.ss_family = family;
+  set_port(&local, atoi(listen_port));
+  local_length = (family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  int listener = socket(family, SOCK_STREAM, IPPROTO_TCP);
+  int yes = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  if ((listener < 0) || (bind(listener, (struct sockaddr *)&local, local_length) != 0) ||
+      (listen(listener, 4) != 0))
+    die("Can't listen on port %s: %s.", listen_port, strerror(errno));
+
+  pthread_t udp_relay, script_runner;
+  pthread_create(&udp_relay, NULL, udp_thread, NULL);
+  pthread_create(&script_runner, NULL, script_thread, NULL);
+  inform("Relaying port %s to %s port %s with %d profile%s.", listen_port, target_host,
+         target_port, number_of_profiles, number_of_profiles == 1 ? "" : "s");
+
+  // one session at a time, as Shairport Sync plays one at a time
+  for (;;) {
+    struct sockaddr_storage from;
+    socklen_t from_length = sizeof(from);
+    int client_fd = accept(listener, (struct sockaddr *)&from, &from_length);
+    if (client_fd < 0)
+      continue;
+    int server_fd = connect_to_instance();
+    if (server_fd < 0) {
+      warn("Can't connect to %s port %s: %s.", target_host, target_port, strerror(errno));
+      close(client_fd);
+      continue;
+    }
+    pthread_mutex_lock(&state_lock);
+    client_address = from;
+    client_address_length = from_length;
+    memset(counts, 0, sizeof(counts));
+    resend_requests_seen = resent_packets_seen = 0;
+    pthread_mutex_unlock(&state_lock);
+    debug(1, "Relaying a connection.");
+    relay_rtsp(client_fd, server_fd);
+    close(client_fd);
+    close(server_fd);
+  }
+  return 0;
+}
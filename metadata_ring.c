@@ -0,0 +1,313 @@
+/*
+ * A shared memory ring of metadata. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "common.h"
+#include "metadata_ring.h"
+
+#define record_size(length)                                                                        \
+  ((sizeof(metadata_ring_record) + (length) + sizeof(metadata_ring_record) - 1) &                  \
+   ~(sizeof(metadata_ring_record) - 1))
+
+// the publisher's side. Only the metadata thread publishes.
+
+static metadata_ring_header *ring = NULL;
+static char *ring_data;
+
+// the item being published in parts
+static int part_open = 0;
+static uint32_t part_position, part_length, part_received;
+
+int metadata_ring_create(const char *name, uint32_t data_size) {
+  uint32_t size = 4096;
+  while ((size < data_size) && (size < 0x40000000))
+    size <<= 1;
+  // readers of a ring left from before will find it gone, and come to this one
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    warn("could not create the metadata ring \"%s\": %s.", name, strerror(errno));
+    return -1;
+  }
+  size_t mapped_size = sizeof(metadata_ring_header) + size;
+  if (ftruncate(fd, mapped_size) != 0) {
+    warn("could not size the metadata ring \"%s\": %s.", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  void *mapping = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    warn("could not map the metadata ring \"%s\": %s.", name, strerror(errno));
+    shm_unlink(name);
+    return -1;
+  }
+  ring = (metadata_ring_header *)mapping;
+  ring_data = (char *)mapping + sizeof(metadata_ring_header);
+  ring->header_size = sizeof(metadata_ring_header);
+  ring->data_size = size;
+  ring->version = metadata_ring_version;
+  __atomic_store_n(&ring->magic, metadata_ring_magic, __ATOMIC_RELEASE);
+  debug(1, "metadata ring \"%s\" has %u bytes of records.", name, size);
+  return 0;
+}
+
+// make sure a record of size bytes can go at head without wrapping, overwriting the oldest
+// records as necessary. Returns the position for it.
+static uint32_t ring_reserve(uint32_t size) {
+  uint32_t head = ring->head;
+  uint32_t offset = head & (ring->data_size - 1);
+  uint32_t needed = size;
+  if (offset + size > ring->data_size) // it goes at the start, after a filler to the end
+    needed += ring->data_size - offset;
+  uint32_t tail = ring->tail;
+  while (head + needed - tail > ring->data_size)
+    tail += ((metadata_ring_record *)(ring_data + (tail & (ring->data_size - 1))))->size;
+  // readers must see that the records are gone before they're overwritten
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  if (needed != size) {
+    metadata_ring_record *filler = (metadata_ring_record *)(ring_data + offset);
+    memset(filler, 0, sizeof(metadata_ring_record));
+    filler->size = ring->data_size - offset;
+    filler->sequence = ring->sequence;
+    head += filler->size;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+  return head;
+}
+
+// write the record's header and make it visible
+static void ring_commit(uint32_t position, uint32_t type, uint32_t code, uint32_t length) {
+  metadata_ring_record *record =
+      (metadata_ring_record *)(ring_data + (position & (ring->data_size - 1)));
+  memset(record, 0, sizeof(metadata_ring_record));
+  record->size = record_size(length);
+  record->sequence = ring->sequence;
+  record->type = type;
+  record->code = code;
+  record->length = length;
+  __atomic_store_n(&ring->sequence, ring->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->head, position + record->size, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&ring->notify, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+  // readers map the ring read-only, so they can't say whether they're waiting
+  syscall(SYS_futex, &ring->notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+int metadata_ring_publish(uint32_t type, uint32_t code, const char *data, uint32_t length) {
+  if ((ring == NULL) || (record_size(length) > ring->data_size / 2))
+    return 0;
+  uint32_t position = ring_reserve(record_size(length));
+  if (length)
+    memcpy(ring_data + (position & (ring->data_size - 1)) + sizeof(metadata_ring_record), data,
+           length);
+  ring_commit(position, type, code, length);
+  return 1;
+}
+
+int metadata_ring_start(uint32_t type, uint32_t code, uint32_t length) {
+  part_open = 0;
+  if ((ring == NULL) || (record_size(length) > ring->data_size / 2))
+    return 0;
+  part_position = ring_reserve(record_size(length));
+  part_length = length;
+  part_received = 0;
+  metadata_ring_record *record =
+      (metadata_ring_record *)(ring_data + (part_position & (ring->data_size - 1)));
+  record->type = type; // kept here until the record is committed
+  record->code = code;
+  part_open = 1;
+  return 1;
+}
+
+void metadata_ring_data(const char *data, uint32_t length) {
+  if (part_open == 0)
+    return;
+  if (length > part_length - part_received)
+    length = part_length - part_received;
+  memcpy(ring_data + (part_position & (ring->data_size - 1)) + sizeof(metadata_ring_record) +
+             part_received,
+         data, length);
+  part_received += length;
+}
+
+void metadata_ring_end(void) {
+  if (part_open == 0)
+    return;
+  char *record_data = ring_data + (part_position & (ring->data_size - 1));
+  metadata_ring_record *record = (metadata_ring_record *)record_data;
+  memset(record_data + sizeof(metadata_ring_record) + part_received, 0,
+         part_length - part_received);
+  ring_commit(part_position, record->type, record->code, part_length);
+  part_open = 0;
+}
+
+// the reader's side
+
+int metadata_ring_attach(metadata_ring_reader *reader, const char *name, int from_oldest) {
+  memset(reader, 0, sizeof(metadata_ring_reader));
+  reader->name = name;
+  reader->fd = -1;
+  reader->fd = shm_open(name, O_RDONLY, 0);
+  if (reader->fd < 0)
+    return -1;
+  struct stat info;
+  if ((fstat(reader->fd, &info) != 0) || (info.st_size < (off_t)sizeof(metadata_ring_header))) {
+    metadata_ring_detach(reader);
+    return -1;
+  }
+  reader->mapped_size = info.st_size;
+  void *mapping = mmap(NULL, reader->mapped_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+  if (mapping == MAP_FAILED) {
+    metadata_ring_detach(reader);
+    return -1;
+  }
+  reader->header = (metadata_ring_header *)mapping;
+  if ((__atomic_load_n(&reader->header->magic, __ATOMIC_ACQUIRE) != metadata_ring_magic) ||
+      (reader->header->version != metadata_ring_version) ||
+      (reader->header->header_size + reader->header->data_size != reader->mapped_size)) {
+    metadata_ring_detach(reader);
+    return -1;
+  }
+  reader->data = (char *)mapping + reader->header->header_size;
+  if (from_oldest)
+    reader->position = __atomic_load_n(&reader->header->tail, __ATOMIC_ACQUIRE);
+  else
+    reader->position = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+  return 0;
+}
+
+void metadata_ring_detach(metadata_ring_reader *reader) {
+  if (reader->header)
+    munmap(reader->header, reader->mapped_size);
+  reader->header = NULL;
+  if (reader->fd >= 0)
+    close(reader->fd);
+  reader->fd = -1;
+}
+
+// wait up to timeout_ms for head to move from the reader's position. Returns 0 on a timeout.
+static int ring_wait(metadata_ring_reader *reader, int timeout_ms) {
+  metadata_ring_header *header = reader->header;
+  uint32_t notify = __atomic_load_n(&header->notify, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) != reader->position)
+    return 1;
+#ifdef __linux__
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  syscall(SYS_futex, &header->notify, FUTEX_WAIT, notify, &timeout, NULL, 0);
+#else
+  // without futexes, look every ten milliseconds
+  int waited;
+  for (waited = 0; (waited < timeout_ms) &&
+                   (__atomic_load_n(&header->notify, __ATOMIC_SEQ_CST) == notify);
+       waited += 10)
+    usleep(10000);
+#endif
+  return (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) != reader->position);
+}
+
+int metadata_ring_read(metadata_ring_reader *reader, metadata_ring_record *record, char **data,
+                       size_t *data_size, int timeout_ms, uint32_t *lost) {
+  *lost = 0;
+  while (1) {
+    if (reader->header == NULL) {
+      if (metadata_ring_attach(reader, reader->name, 1) != 0) {
+        usleep(timeout_ms * 1000);
+        return 0;
+      }
+    }
+    metadata_ring_header *header = reader->header;
+    uint32_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if (head == reader->position) {
+      if (ring_wait(reader, timeout_ms) == 0) {
+        struct stat info;
+        if ((fstat(reader->fd, &info) == 0) && (info.st_nlink == 0)) {
+          // the publisher has gone and left a new ring in its place
+          const char *name = reader->name;
+          metadata_ring_detach(reader);
+          reader->name = name;
+        }
+        return 0;
+      }
+      continue;
+    }
+    uint32_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    if (((int32_t)(reader->position - tail) < 0) || ((int32_t)(head - reader->position) < 0)) {
+      reader->position = tail; // overtaken
+      continue;
+    }
+    metadata_ring_record *found =
+        (metadata_ring_record *)(reader->data + (reader->position & (header->data_size - 1)));
+    memcpy(record, found, sizeof(metadata_ring_record));
+    int sane = (record->size >= sizeof(metadata_ring_record)) &&
+               (record->size <= header->data_size) &&
+               (record->length <= record->size - sizeof(metadata_ring_record));
+    if ((sane) && (record->type != 0) && (record->length)) {
+      if (*data_size < record->length) {
+        char *bigger = realloc(*data, record->length);
+        if (bigger == NULL)
+          return 0;
+        *data = bigger;
+        *data_size = record->length;
+      }
+      memcpy(*data, (char *)found + sizeof(metadata_ring_record), record->length);
+    }
+    // if the record was overwritten while it was being copied, the copy is no good
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+    if (((int32_t)(reader->position - tail) < 0) || (sane == 0)) {
+      reader->position = tail;
+      continue;
+    }
+    reader->position += record->size;
+    if (record->type == 0) // a filler
+      continue;
+    if (reader->started)
+      *lost = record->sequence - reader->sequence;
+    reader->sequence = record->sequence + 1;
+    reader->started = 1;
+    return 1;
+  }
+}
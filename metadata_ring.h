@@ -0,0 +1,87 @@
+#ifndef _METADATA_RING_H
+#define _METADATA_RING_H
+
+#include <stdint.h>
+
+// A metadata ring is a POSIX shared memory object that the metadata thread publishes each item of
+// metadata into once, and that any number of local readers can follow at their own pace. The
+// publisher never waits for a reader; a reader that falls too far behind finds that the items it
+// hasn't read have been overwritten, and starts again from the oldest item still there.
+//
+// The object starts with a metadata_ring_header, followed by data_size bytes of records. Byte
+// positions in the records are counted from the start, and wrap at 2^32; the record at position p
+// is at offset p % data_size. Each record starts with a metadata_ring_record and is followed by
+// the item's data, padded to a multiple of 32 bytes. A record never wraps around the end of
+// the ring: if there isn't room for it there, a record with a type of zero fills the space up to
+// the end, and should be skipped. All the numbers are in the machine's own byte order.
+//
+// To read, start at head (or at tail, to get everything still there), and read records until
+// head is reached. A record has only been read intact if tail hasn't passed it by the time it's
+// been copied. On Linux, a reader can wait for head to change with FUTEX_WAIT on the notify
+// word; the publisher does a FUTEX_WAKE on it each time. Readers only need to map the ring
+// read-only.
+
+#define metadata_ring_magic 0x53534d52 // "SSMR"
+#define metadata_ring_version 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t header_size; // the data starts this many bytes into the object
+  uint32_t data_size;   // a power of two
+  uint32_t head;        // the position after the last record published
+  uint32_t tail;        // the position of the oldest record that hasn't been overwritten
+  uint32_t sequence;    // the sequence number the next item will have
+  uint32_t notify;      // changed whenever head changes
+  uint32_t reserved[8];
+} metadata_ring_header;
+
+typedef struct {
+  uint32_t size;     // of the whole record, header and padding included
+  uint32_t sequence; // items are numbered from zero, consecutively
+  uint32_t type;     // zero for a record that only fills the space to the end of the ring
+  uint32_t code;
+  uint32_t length; // of the data
+  uint32_t reserved[3];
+} metadata_ring_record; // 32 bytes
+
+// the publisher's side: create the shared memory object and give it data_size bytes of records,
+// rounded up to a power of two. Returns 0 if successful.
+int metadata_ring_create(const char *name, uint32_t data_size);
+
+// publish an item. Returns 0 if it's too big for the ring.
+int metadata_ring_publish(uint32_t type, uint32_t code, const char *data, uint32_t length);
+
+// publish an item that arrives in parts. The record is reserved at the start, filled in as the
+// data arrives and published at the end. If less data than the length given arrives, the rest of
+// the record is filled with zeros.
+int metadata_ring_start(uint32_t type, uint32_t code, uint32_t length);
+void metadata_ring_data(const char *data, uint32_t length);
+void metadata_ring_end(void);
+
+// the reader's side
+typedef struct {
+  const char *name;
+  int fd;
+  metadata_ring_header *header;
+  char *data;
+  size_t mapped_size;
+  uint32_t position; // of the next record to read
+  uint32_t sequence; // of the next item expected
+  int started;       // set once an item has been read, so that sequence is known
+} metadata_ring_reader;
+
+// attach to a ring, to read from the next item to be published, or from the oldest one there if
+// from_oldest is set. Returns 0 if successful. If the publisher restarts, it makes a new ring,
+// which metadata_ring_read() attaches to when it notices.
+int metadata_ring_attach(metadata_ring_reader *reader, const char *name, int from_oldest);
+void metadata_ring_detach(metadata_ring_reader *reader);
+
+// Read the next item, waiting up to timeout_ms milliseconds for one if there's none. The record
+// and its data are copied into *record and *data, which is realloced as needed. Returns 1 if an
+// item was read, 0 on a timeout. If *lost is non-zero afterwards, that many items were
+// overwritten before they could be read.
+int metadata_ring_read(metadata_ring_reader *reader, metadata_ring_record *record, char **data,
+                       size_t *data_size, int timeout_ms, uint32_t *lost);
+
+#endif // _METADATA_RING_H
@@ -0,0 +1,308 @@
+/*
+ * A cache of cover art. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBSSL
+#include <openssl/md5.h>
+#endif
+
+#ifdef HAVE_LIBPOLARSSL
+#include <polarssl/md5.h>
+#endif
+
+#include "common.h"
+#include "picture_cache.h"
+
+#define incoming_name "incoming.tmp"
+
+typedef struct {
+  char hash[33];
+  char extension[4];
+  size_t size;
+  uint64_t used; // pictures used less recently have lower numbers
+} cached_picture;
+
+static char *cache_directory = NULL; // set once the cache is open
+static size_t cache_limit, cache_size;
+static cached_picture *pictures = NULL;
+static int picture_count = 0, picture_capacity = 0;
+static uint64_t last_use = 0;
+
+// the picture being received
+static int incoming_fd = -1;
+static size_t incoming_length, incoming_received;
+static int incoming_failed;
+static unsigned char incoming_start[4]; // enough to tell what kind of picture it is
+#ifdef HAVE_LIBSSL
+static MD5_CTX incoming_hash;
+#endif
+#ifdef HAVE_LIBPOLARSSL
+static md5_context incoming_hash;
+#endif
+
+static void hash_start(void) {
+#ifdef HAVE_LIBSSL
+  MD5_Init(&incoming_hash);
+#endif
+#ifdef HAVE_LIBPOLARSSL
+  md5_starts(&incoming_hash);
+#endif
+}
+
+static void hash_update(const char *data, size_t length) {
+#ifdef HAVE_LIBSSL
+  MD5_Update(&incoming_hash, data, length);
+#endif
+#ifdef HAVE_LIBPOLARSSL
+  md5_update(&incoming_hash, (const unsigned char *)data, length);
+#endif
+}
+
+static void hash_finish(char *hex) {
+  unsigned char digest[16];
+  memset(digest, 0, sizeof(digest));
+#ifdef HAVE_LIBSSL
+  MD5_Final(digest, &incoming_hash);
+#endif
+#ifdef HAVE_LIBPOLARSSL
+  md5_finish(&incoming_hash, digest);
+#endif
+  int i;
+  for (i = 0; i < 16; i++)
+    sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+// the image/type header isn't reliable, so look at the first few bytes
+static const char *picture_extension(void) {
+  size_t known = incoming_received < sizeof(incoming_start) ? incoming_received
+                                                            : sizeof(incoming_start);
+  if ((known >= 3) && (memcmp(incoming_start, "\xff\xd8\xff", 3) == 0))
+    return "jpg";
+  if ((known >= 4) && (memcmp(incoming_start, "\x89PNG", 4) == 0))
+    return "png";
+  if ((known >= 4) && (memcmp(incoming_start, "GIF8", 4) == 0))
+    return "gif";
+  return "bin";
+}
+
+static void picture_path(char *path, const char *hash, const char *extension) {
+  snprintf(path, PATH_MAX, "%s/%s.%s", cache_directory, hash, extension);
+}
+
+static void incoming_path(char *path) {
+  snprintf(path, PATH_MAX, "%s/" incoming_name, cache_directory);
+}
+
+// the names of cached pictures are 32 hex digits, a dot and an extension of up to three letters
+static int cached_name(const char *name, char *hash, char *extension) {
+  int i;
+  for (i = 0; i < 32; i++)
+    if ((name[i] == 0) || (strchr("0123456789abcdef", name[i]) == NULL))
+      return 0;
+  if ((name[32] != '.') || (strlen(name + 33) < 1) || (strlen(name + 33) > 3))
+    return 0;
+  memcpy(hash, name, 32);
+  hash[32] = 0;
+  strcpy(extension, name + 33);
+  return 1;
+}
+
+static int add_picture(const char *hash, const char *extension, size_t size, uint64_t used) {
+  if (picture_count == picture_capacity) {
+    int capacity = picture_capacity ? picture_capacity * 2 : 64;
+    cached_picture *bigger = realloc(pictures, capacity * sizeof(cached_picture));
+    if (bigger == NULL)
+      return -1;
+    pictures = bigger;
+    picture_capacity = capacity;
+  }
+  cached_picture *picture = &pictures[picture_count++];
+  strcpy(picture->hash, hash);
+  strcpy(picture->extension, extension);
+  picture->size = size;
+  picture->used = used;
+  cache_size += size;
+  return picture_count - 1;
+}
+
+// remove the least recently used pictures until the cache is within its limit. The picture at
+// index keep, if there is one, stays.
+static void trim_cache(int keep) {
+  while ((cache_size > cache_limit) && (picture_count > ((keep >= 0) ? 1 : 0))) {
+    int i, oldest = -1;
+    for (i = 0; i < picture_count; i++)
+      if ((i != keep) && ((oldest < 0) || (pictures[i].used < pictures[oldest].used)))
+        oldest = i;
+    char path[PATH_MAX];
+    picture_path(path, pictures[oldest].hash, pictures[oldest].extension);
+    if ((unlink(path) != 0) && (errno != ENOENT))
+      debug(1, "Could not remove \"%s\" from the picture cache: %s.", path, strerror(errno));
+    cache_size -= pictures[oldest].size;
+    pictures[oldest] = pictures[--picture_count];
+    if (keep == picture_count)
+      keep = oldest;
+  }
+}
+
+int picture_cache_open(const char *directory, size_t size_limit) {
+  if ((mkdir(directory, 0755) != 0) && (errno != EEXIST)) {
+    warn("could not create the picture cache directory \"%s\": %s.", directory, strerror(errno));
+    return -1;
+  }
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    warn("could not open the picture cache directory \"%s\": %s.", directory, strerror(errno));
+    return -1;
+  }
+  cache_directory = strdup(directory);
+  cache_limit = size_limit;
+  char path[PATH_MAX];
+  incoming_path(path);
+  unlink(path); // left by a picture that was being received when Shairport Sync stopped
+  // the pictures already there were used in the order they were last modified
+  struct dirent *found;
+  while ((found = readdir(dir)) != NULL) {
+    char hash[33], extension[4];
+    struct stat info;
+    if (cached_name(found->d_name, hash, extension)) {
+      picture_path(path, hash, extension);
+      if ((stat(path, &info) == 0) && (S_ISREG(info.st_mode))) {
+        add_picture(hash, extension, info.st_size, info.st_mtime);
+        if ((uint64_t)info.st_mtime > last_use)
+          last_use = info.st_mtime;
+      }
+    }
+  }
+  closedir(dir);
+  trim_cache(-1);
+  debug(1, "picture cache \"%s\" has %d pictures, taking up %zu bytes.", directory, picture_count,
+        cache_size);
+  return 0;
+}
+
+int picture_cache_start(size_t length) {
+  if ((cache_directory == NULL) || (length == 0))
+    return -1;
+  char path[PATH_MAX];
+  incoming_path(path);
+  incoming_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (incoming_fd < 0) {
+    debug(1, "Could not open \"%s\" to cache a picture: %s.", path, strerror(errno));
+    return -1;
+  }
+  incoming_length = length;
+  incoming_received = 0;
+  incoming_failed = 0;
+  hash_start();
+  return 0;
+}
+
+void picture_cache_data(const char *data, size_t length) {
+  if (incoming_fd < 0)
+    return;
+  if (length > incoming_length - incoming_received)
+    length = incoming_length - incoming_received;
+  if (incoming_received < sizeof(incoming_start)) {
+    size_t count = sizeof(incoming_start) - incoming_received;
+    memcpy(incoming_start + incoming_received, data, count < length ? count : length);
+  }
+  hash_update(data, length);
+  incoming_received += length;
+  while ((length) && (incoming_failed == 0)) {
+    ssize_t written = write(incoming_fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      debug(1, "Could not write a picture to the picture cache: %s.", strerror(errno));
+      incoming_failed = 1;
+    } else {
+      data += written;
+      length -= written;
+    }
+  }
+}
+
+enum picture_cache_result picture_cache_end(picture_cache_entry *entry) {
+  if (incoming_fd < 0)
+    return picture_cache_failed;
+  char incoming[PATH_MAX];
+  incoming_path(incoming);
+  if (close(incoming_fd) != 0)
+    incoming_failed = 1;
+  incoming_fd = -1;
+  if ((incoming_failed) || (incoming_received != incoming_length)) {
+    if (incoming_received != incoming_length)
+      debug(1, "An incomplete picture of %zu bytes out of %zu has not been cached.",
+            incoming_received, incoming_length);
+    unlink(incoming);
+    return picture_cache_failed;
+  }
+  const char *extension = picture_extension();
+  hash_finish(entry->hash);
+  picture_path(entry->path, entry->hash, extension);
+  entry->size = incoming_length;
+  uint64_t now = time(NULL);
+  last_use = (now > last_use) ? now : last_use + 1;
+  int i;
+  for (i = 0; (i < picture_count) && (strcmp(pictures[i].hash, entry->hash) != 0); i++)
+    ;
+  if ((i < picture_count) && (access(entry->path, R_OK) == 0)) {
+    unlink(incoming);
+    utimes(entry->path, NULL); // so that it's kept longest if Shairport Sync is restarted
+    pictures[i].used = last_use;
+    return picture_cache_repeat;
+  }
+  if (rename(incoming, entry->path) != 0) {
+    debug(1, "Could not put a picture into the picture cache at \"%s\": %s.", entry->path,
+          strerror(errno));
+    unlink(incoming);
+    return picture_cache_failed;
+  }
+  if (i < picture_count) { // it was there once, but has been removed
+    cache_size -= pictures[i].size;
+    pictures[i] = pictures[--picture_count];
+  }
+  int added = add_picture(entry->hash, extension, entry->size, last_use);
+  if (added < 0) { // it can't be kept track of, so it can't be kept
+    unlink(entry->path);
+    return picture_cache_failed;
+  }
+  trim_cache(added);
+  return picture_cache_new;
+}
@@ -0,0 +1,33 @@
+#ifndef _PICTURE_CACHE_H
+#define _PICTURE_CACHE_H
+
+#include <limits.h>
+#include <stddef.h>
+
+// A picture cache keeps each different picture of cover art that's been received once, in a
+// directory, in a file named after the MD5 hash of its contents -- e.g.
+// 0123456789abcdef0123456789abcdef.jpg. When the files take up more than the size given, the
+// least recently received pictures are removed. It's used only by the metadata thread.
+
+typedef struct {
+  char hash[33]; // in hex
+  char path[PATH_MAX];
+  size_t size;
+} picture_cache_entry;
+
+enum picture_cache_result {
+  picture_cache_failed, // the picture was incomplete or couldn't be stored
+  picture_cache_new,    // the picture has been added to the cache
+  picture_cache_repeat  // the picture was already in the cache
+};
+
+// pictures that were cached before are kept, within the size limit. Returns 0 if successful.
+int picture_cache_open(const char *directory, size_t size_limit);
+
+// store a picture as it arrives. Returns 0 if the picture is being cached.
+int picture_cache_start(size_t length);
+void picture_cache_data(const char *data, size_t length);
+// finish storing the picture and say where it is
+enum picture_cache_result picture_cache_end(picture_cache_entry *entry);
+
+#endif // _PICTURE_CACHE_H
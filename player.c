@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 
 #include "config.h"
 
@@ -93,12 +94,24 @@ static alac_file *decoder_info;
 static int late_packet_message_sent;
 static uint64_t packet_count = 0;
 static int32_t last_seqno_read;
+static unsigned int random_seed = 0; // if non-zero, used instead of the time of day
 
 // interthread variables
 static double software_mixer_volume = 1.0;
 static int fix_volume = 0x10000;
+static int ramp_volume = 0x10000; // the software volume the last frame ended on; fix_volume is ramped to from here
 static pthread_mutex_t vol_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// while a session is playing, volume changes are applied on their own thread, which only ever
+// applies the latest request
+static pthread_t volume_thread;
+static int volume_thread_started = 0;
+static int volume_thread_stop = 0;
+static int volume_request_pending = 0;
+static double requested_volume;
+static pthread_mutex_t volume_request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t volume_requested = PTHREAD_COND_INITIALIZER;
+
 // default buffer size
 // needs to be a power of 2 because of the way BUFIDX(seqno) works
 #define BUFFER_FRAMES 512
@@ -132,10 +145,37 @@ static pthread_cond_t flowcontrol;
 
 static int64_t first_packet_time_to_play, time_since_play_started; // nanoseconds
 
-static audio_parameters audio_information;
+static audio_parameters audio_information; // protected by vol_mutex
 
 // stats
 static uint64_t missing_packets, late_packets, too_late_packets, resend_requests;
+static uint64_t catch_up_frames_dropped, catch_up_frames_inserted;
+static uint64_t ab_mutex_waits, ab_mutex_wait_ns, flush_mutex_waits, flush_mutex_wait_ns;
+
+// lock a mutex, counting the times it was already taken and how long we waited for it. The
+// counts are only changed with the mutex held.
+static void lock_counting_waits(pthread_mutex_t *mutex, uint64_t *waits, uint64_t *wait_ns) {
+  if (pthread_mutex_trylock(mutex) == 0)
+    return;
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD
+  struct timespec before, after;
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  pthread_mutex_lock(mutex);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  *wait_ns += (after.tv_sec - before.tv_sec) * 1000000000LL + (after.tv_nsec - before.tv_nsec);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+  (*waits)++;
+}
+
+static void lock_ab_mutex(void) {
+  lock_counting_waits(&ab_mutex, &ab_mutex_waits, &ab_mutex_wait_ns);
+}
+
+static void lock_flush_mutex(void) {
+  lock_counting_waits(&flush_mutex, &flush_mutex_waits, &flush_mutex_wait_ns);
+}
 
 static void ab_resync(void) {
   int i;
@@ -292,9 +332,8 @@ static void free_buffer(void) {
     free(audio_buffer[i].data);
 }
 
-void player_put_packet(seq_t seqno, uint32_t timestamp, uint8_t *data, int len) {
-
-  pthread_mutex_lock(&ab_mutex);
+// call with ab_mutex locked
+static void put_packet(seq_t seqno, uint32_t timestamp, uint8_t *data, int len) {
   packet_count++;
   time_of_last_audio_packet = get_absolute_time_in_fp();
   if (connection_state_to_output) { // if we are supposed to be processing these packets
@@ -340,7 +379,7 @@ void player_put_packet(seq_t seqno, uint32_t timestamp, uint8_t *data, int len)
         rtp_request_resend(ab_write, gap);
         resend_requests++;
         ab_write = SUCCESSOR(seqno);
-      } else if (seq_order(ab_read, seqno)) { // late but not yet played
+      } else if ((seqno == ab_read) || seq_order(ab_read, seqno)) { // late but not yet played
         late_packets++;
         abuf = audio_buffer + BUFIDX(seqno);
       } else { // too late.
@@ -364,6 +403,26 @@ void player_put_packet(seq_t seqno, uint32_t timestamp, uint8_t *data, int len)
 
       // pthread_mutex_lock(&ab_mutex);
     }
+  }
+}
+
+void player_put_packet(seq_t seqno, uint32_t timestamp, uint8_t *data, int len) {
+  lock_ab_mutex();
+  put_packet(seqno, timestamp, data, len);
+  if (connection_state_to_output) {
+    int rc = pthread_cond_signal(&flowcontrol);
+    if (rc)
+      debug(1, "Error signalling flowcontrol.");
+  }
+  pthread_mutex_unlock(&ab_mutex);
+}
+
+void player_put_packets(rtp_audio_packet *packets, int count) {
+  int i;
+  lock_ab_mutex();
+  for (i = 0; i < count; i++)
+    put_packet(packets[i].seqno, packets[i].timestamp, packets[i].data, packets[i].len);
+  if ((count) && (connection_state_to_output)) {
     int rc = pthread_cond_signal(&flowcontrol);
     if (rc)
       debug(1, "Error signalling flowcontrol.");
@@ -377,12 +436,12 @@ static inline short lcg_rand(void) {
   return lcg_prev & 0xffff;
 }
 
-static inline short dithered_vol(short sample) {
+static inline short dithered_vol(short sample, int volume) {
   short rand_a, rand_b;
   long out;
 
-  out = (long)sample * fix_volume;
-  if (fix_volume < 0x10000) {
+  out = (long)sample * volume;
+  if (volume < 0x10000) {
     rand_b = rand_a;
     rand_a = lcg_rand();
     out += rand_a;
@@ -391,6 +450,30 @@ static inline short dithered_vol(short sample) {
   return out >> 16;
 }
 
+// apply the software volume to a frame of interleaved stereo samples, in place. If the volume
+// has changed since the last frame, move to it a step at a time across this frame rather than
+// all at once, so that dragging the slider doesn't click.
+static void apply_volume(short *samples, int frames) {
+  pthread_mutex_lock(&vol_mutex);
+  int target = fix_volume;
+  int from = ramp_volume;
+  if ((from != 0x10000) || (target != 0x10000)) {
+    int64_t step = frames > 0 ? (((int64_t)(target - from)) << 16) / frames : 0;
+    int64_t volume = ((int64_t)from) << 16; // the volume, with 16 more bits of fraction
+    int i;
+    for (i = 0; i < frames; i++) {
+      volume += step;
+      int v = volume >> 16;
+      *samples = dithered_vol(*samples, v);
+      samples++;
+      *samples = dithered_vol(*samples, v);
+      samples++;
+    }
+    ramp_volume = target;
+  }
+  pthread_mutex_unlock(&vol_mutex);
+}
+
 // get the next frame, when available. return 0 if underrun/stream reset.
 static abuf_t *buffer_get_frame(void) {
   int16_t buf_fill;
@@ -400,7 +483,7 @@ static abuf_t *buffer_get_frame(void) {
   int i;
   abuf_t *curframe;
 
-  pthread_mutex_lock(&ab_mutex);
+  lock_ab_mutex();
   int wait;
   int32_t dac_delay = 0;
   do {
@@ -428,13 +511,13 @@ static abuf_t *buffer_get_frame(void) {
       connection_state_to_output = rco;
       // change happening
       if (connection_state_to_output == 0) { // going off
-        pthread_mutex_lock(&flush_mutex);
+        lock_flush_mutex();
         flush_requested = 1;
         pthread_mutex_unlock(&flush_mutex);
       }
     }
 
-    pthread_mutex_lock(&flush_mutex);
+    lock_flush_mutex();
     if (flush_requested == 1) {
       if (config.output->flush)
         config.output->flush();
@@ -601,13 +684,10 @@ static abuf_t *buffer_get_frame(void) {
                 // with %d packets.",exact_frame_gap,fs,dac_delay,seq_diff(ab_read, ab_write));
                 config.output->play(silence, fs);
                 free(silence);
-                if (ab_buffering == 0) {
-                  uint64_t reference_timestamp_time; // don't need this...
-                  get_reference_timestamp_stuff(&play_segment_reference_frame, &reference_timestamp_time, &play_segment_reference_frame_remote_time);
 #ifdef CONFIG_METADATA
-                  send_ssnc_metadata('prsm', NULL, 0, 0); // "resume", but don't wait if the queue is locked
+                if (ab_buffering == 0)
+                  send_ssnc_metadata('prsm', NULL, 0, metadata_coalesce); // "resume", never waits
 #endif
-                }
               }
             }
           }
@@ -663,29 +743,12 @@ static abuf_t *buffer_get_frame(void) {
       time_to_wait_for_wakeup_fp *= 4 * 352; // four full 352-frame packets
       time_to_wait_for_wakeup_fp /= 3; // four thirds of a packet time
 
-#ifdef COMPILE_FOR_LINUX_AND_FREEBSD
       uint64_t time_of_wakeup_fp = local_time_now + time_to_wait_for_wakeup_fp;
-      uint64_t sec = time_of_wakeup_fp >> 32;
-      uint64_t nsec = ((time_of_wakeup_fp & 0xffffffff) * 1000000000) >> 32;
-
-      struct timespec time_of_wakeup;
-      time_of_wakeup.tv_sec = sec;
-      time_of_wakeup.tv_nsec = nsec;
-
-      pthread_cond_timedwait(&flowcontrol, &ab_mutex, &time_of_wakeup);
-// int rc = pthread_cond_timedwait(&flowcontrol,&ab_mutex,&time_of_wakeup);
+      cond_timedwait_until_fp(&flowcontrol, &ab_mutex, time_of_wakeup_fp);
+      thread_policy_check_deadline(thread_role_player, time_of_wakeup_fp);
+// int rc = cond_timedwait_until_fp(&flowcontrol, &ab_mutex, time_of_wakeup_fp);
 // if (rc!=0)
-//  debug(1,"pthread_cond_timedwait returned error code %d.",rc);
-#endif
-#ifdef COMPILE_FOR_OSX
-      uint64_t sec = time_to_wait_for_wakeup_fp >> 32;
-      ;
-      uint64_t nsec = ((time_to_wait_for_wakeup_fp & 0xffffffff) * 1000000000) >> 32;
-      struct timespec time_to_wait;
-      time_to_wait.tv_sec = sec;
-      time_to_wait.tv_nsec = nsec;
-      pthread_cond_timedwait_relative_np(&flowcontrol, &ab_mutex, &time_to_wait);
-#endif
+//  debug(1,"cond_timedwait_until_fp returned error code %d.",rc);
     }
   } while (wait);
 
@@ -733,6 +796,15 @@ static inline short shortmean(short a, short b) {
   return r;
 }
 
+// the mean absolute sample value of a block of interleaved stereo frames
+static int32_t mean_amplitude(short *buf, int frames) {
+  int64_t sum = 0;
+  int i;
+  for (i = 0; i < frames * 2; i++)
+    sum += abs(buf[i]);
+  return sum / (frames * 2);
+}
+
 // stuff: 1 means add 1; 0 means do nothing; -1 means remove 1
 static int stuff_buffer_basic(short *inptr, short *outptr, int stuff) {
   if ((stuff > 1) || (stuff < -1)) {
@@ -746,30 +818,28 @@ static int stuff_buffer_basic(short *inptr, short *outptr, int stuff) {
     stuffsamp =
         (rand() % (frame_size - 2)) + 1; // ensure there's always a sample before and after the item
 
-  pthread_mutex_lock(&vol_mutex);
+  short *op = outptr;
   for (i = 0; i < stuffsamp; i++) { // the whole frame, if no stuffing
-    *outptr++ = dithered_vol(*inptr++);
-    *outptr++ = dithered_vol(*inptr++);
+    *outptr++ = *inptr++;
+    *outptr++ = *inptr++;
   };
   if (stuff) {
     if (stuff == 1) {
       debug(3, "+++++++++");
       // interpolate one sample
-      //*outptr++ = dithered_vol(((long)inptr[-2] + (long)inptr[0]) >> 1);
-      //*outptr++ = dithered_vol(((long)inptr[-1] + (long)inptr[1]) >> 1);
-      *outptr++ = dithered_vol(shortmean(inptr[-2], inptr[0]));
-      *outptr++ = dithered_vol(shortmean(inptr[-1], inptr[1]));
+      *outptr++ = shortmean(inptr[-2], inptr[0]);
+      *outptr++ = shortmean(inptr[-1], inptr[1]);
     } else if (stuff == -1) {
       debug(3, "---------");
       inptr++;
       inptr++;
     }
     for (i = stuffsamp; i < frame_size + stuff; i++) {
-      *outptr++ = dithered_vol(*inptr++);
-      *outptr++ = dithered_vol(*inptr++);
+      *outptr++ = *inptr++;
+      *outptr++ = *inptr++;
     }
   }
-  pthread_mutex_unlock(&vol_mutex);
+  apply_volume(op, frame_size + stuff);
 
   return frame_size + stuff;
 }
@@ -825,28 +895,10 @@ static int stuff_buffer_soxr(short *inptr, short *outptr, int stuff) {
       *op++ = *ip++;
     }
 
-    // finally, adjust the volume, if necessary
-    if (software_mixer_volume != 1.0) {
-      // pthread_mutex_lock(&vol_mutex);
-      op = outptr;
-      for (i = 0; i < frame_size + stuff; i++) {
-        *op = dithered_vol(*op);
-        op++;
-        *op = dithered_vol(*op);
-        op++;
-      };
-      // pthread_mutex_unlock(&vol_mutex);
-    }
-
   } else { // the whole frame, if no stuffing
-
-    // pthread_mutex_lock(&vol_mutex);
-    for (i = 0; i < frame_size; i++) {
-      *op++ = dithered_vol(*ip++);
-      *op++ = dithered_vol(*ip++);
-    };
-    // pthread_mutex_unlock(&vol_mutex);
+    memcpy(outptr, inptr, frame_size * 4);
   }
+  apply_volume(outptr, frame_size + stuff);
   return frame_size + stuff;
 }
 #endif
@@ -856,8 +908,8 @@ typedef struct stats { // statistics for running averages
 } stats_t;
 
 static void *player_thread_func(void *arg) {
+  thread_policy_apply(thread_role_player);
 		session_corrections = 0;
-		play_segment_reference_frame = 0; // zero signals that we are not in a play segment
 	// check that there are enough buffers to accommodate the desired latency and the latency offset
 	
 	int maximum_latency = config.latency+config.audio_backend_latency_offset;
@@ -876,7 +928,6 @@ static void *player_thread_func(void *arg) {
   int32_t minimum_buffer_occupancy = BUFFER_FRAMES;
   int32_t maximum_buffer_occupancy = 0;
 
-  audio_information.valid = 0;
   buffer_occupancy = 0;
 
   int play_samples;
@@ -892,7 +943,7 @@ static void *player_thread_func(void *arg) {
   // other process.
 
   char rnstate[256];
-  initstate(time(NULL), rnstate, 256);
+  initstate(random_seed ? random_seed : time(NULL), rnstate, 256);
 
   signed short *inbuf, *outbuf, *silence;
   outbuf = malloc(OUTFRAME_BYTES(frame_size));
@@ -900,9 +951,14 @@ static void *player_thread_func(void *arg) {
   memset(silence, 0, OUTFRAME_BYTES(frame_size));
   late_packet_message_sent = 0;
   missing_packets = late_packets = too_late_packets = resend_requests = 0;
+  catch_up_frames_dropped = catch_up_frames_inserted = 0;
   flush_rtp_timestamp = 0; // it seems this number has a special significance -- it seems to be used
                            // as a null operand, so we'll use it like that too
   int sync_error_out_of_bounds = 0; // number of times in a row that there's been a serious sync error
+// a packet this quiet or quieter can be dropped or preceded by silence without being noticed much
+#define CATCH_UP_QUIET_LEVEL 128
+  int catching_up = 0; // set when recovering from a loss of sync without flushing
+  int32_t catch_up_quiet_level = CATCH_UP_QUIET_LEVEL;
 
   uint64_t tens_of_seconds = 0;
   while (!please_stop) {
@@ -927,6 +983,12 @@ static void *player_thread_func(void *arg) {
 
           at_least_one_frame_seen = 1;
 
+          // the volume thread may change the software volume at any time, so decide once, for
+          // the whole of this frame, whether it can go straight to the output
+          pthread_mutex_lock(&vol_mutex);
+          int volume_is_unity = (fix_volume == 0x10000) && (ramp_volume == 0x10000);
+          pthread_mutex_unlock(&vol_mutex);
+
           uint32_t reference_timestamp;
           uint64_t reference_timestamp_time,remote_reference_timestamp_time;
           get_reference_timestamp_stuff(&reference_timestamp, &reference_timestamp_time, &remote_reference_timestamp_time);
@@ -941,19 +1003,11 @@ static void *player_thread_func(void *arg) {
           // uint64_t
           // local_time_now=((uint64_t)tn.tv_sec<<32)+((uint64_t)tn.tv_nsec<<32)/1000000000;
 
-          int64_t td_in_frames;
-          int64_t td = local_time_now - reference_timestamp_time;
-          // debug(1,"td is %lld.",td);
-          if (td >= 0) {
-            td_in_frames = (td * 44100) >> 32;
-          } else {
-            td_in_frames = -((-td * 44100) >> 32);
-          }
-
           // This is the timing error for the next audio frame in the DAC, if applicable
           int64_t sync_error = 0;
 
           int amount_to_stuff = 0;
+          int catch_up = 0; // +ve: frames dropped; -ve: frames of silence inserted
 
           // check sequencing
           if (last_seqno_read == -1)
@@ -978,7 +1032,18 @@ static void *player_thread_func(void *arg) {
 						maximum_buffer_occupancy = buffer_occupancy;
 
           if (config.output->delay) {
-            current_delay = config.output->delay();
+            // if the backend can tell us when its delay was measured, use that time rather than
+            // now to work out how far we are from the reference timestamp
+            uint64_t time_of_delay = local_time_now;
+            if (config.output->timed_delay) {
+              int32_t dac_delay;
+              if (config.output->timed_delay(&dac_delay, &time_of_delay) == 0)
+                current_delay = dac_delay;
+              else
+                current_delay = -1;
+            } else {
+              current_delay = (int32_t)config.output->delay();
+            }
             if (current_delay == -1) {
               debug(1, "Delay error when checking running latency.");
               current_delay = 0;
@@ -986,6 +1051,15 @@ static void *player_thread_func(void *arg) {
             if (current_delay < minimum_dac_queue_size)
               minimum_dac_queue_size = current_delay;
 
+            int64_t td_in_frames;
+            int64_t td = time_of_delay - reference_timestamp_time;
+            // debug(1,"td is %lld.",td);
+            if (td >= 0) {
+              td_in_frames = (td * 44100) >> 32;
+            } else {
+              td_in_frames = -((-td * 44100) >> 32);
+            }
+
             // this is the actual delay, including the latency we actually want, which will
             // fluctuate a good bit about a potentially rising or falling trend.
             int64_t delay = td_in_frames + rt - (nt - current_delay);
@@ -1027,44 +1101,71 @@ static void *player_thread_func(void *arg) {
               }
             }
                         
-            if ((amount_to_stuff == 0) && (fix_volume == 0x10000)) {
-              // if no stuffing needed and no volume adjustment, then
-              // don't send to stuff_buffer_* and don't copy to outbuf; just send directly to the
-              // output device...
-              config.output->play(inbuf, frame_size);
+            // when catching up after a loss of sync, drop a packet or put a packet of silence in
+            // front of it, waiting for a quiet packet to do it in. The quietness needed halves
+            // with every packet passed over, so it's never put off for long.
+            if (catching_up) {
+              if (llabs(sync_error) < frame_size) {
+                debug(1, "Caught up with source. Error: %lld.", sync_error);
+                catching_up = 0;
+              } else if (mean_amplitude(inbuf, frame_size) <= catch_up_quiet_level) {
+                catch_up = (sync_error > 0) ? frame_size : -frame_size;
+                catch_up_quiet_level = CATCH_UP_QUIET_LEVEL;
+                amount_to_stuff = 0;
+              } else if (catch_up_quiet_level < 32768) {
+                catch_up_quiet_level *= 2;
+              }
+            }
+
+            if (catch_up > 0) {
+              // late, so drop this packet
+              catch_up_frames_dropped += catch_up;
             } else {
-#ifdef HAVE_LIBSOXR
-              switch (config.packet_stuffing) {
-              case ST_basic:
-                //                if (amount_to_stuff) debug(1,"Basic stuff...");
-                play_samples = stuff_buffer_basic(inbuf, outbuf, amount_to_stuff);
-                break;
-              case ST_soxr:
-                //                if (amount_to_stuff) debug(1,"Soxr stuff...");
-                play_samples = stuff_buffer_soxr(inbuf, outbuf, amount_to_stuff);
-                break;
+              if (catch_up < 0) {
+                // early, so play a packet of silence first
+                config.output->play(silence, frame_size);
+                catch_up_frames_inserted -= catch_up;
               }
+              if ((amount_to_stuff == 0) && volume_is_unity) {
+                // if no stuffing needed and no volume adjustment, then
+                // don't send to stuff_buffer_* and don't copy to outbuf; just send directly to the
+                // output device...
+                config.output->play(inbuf, frame_size);
+              } else {
+#ifdef HAVE_LIBSOXR
+                switch (config.packet_stuffing) {
+                case ST_basic:
+                  //                if (amount_to_stuff) debug(1,"Basic stuff...");
+                  play_samples = stuff_buffer_basic(inbuf, outbuf, amount_to_stuff);
+                  break;
+                case ST_soxr:
+                  //                if (amount_to_stuff) debug(1,"Soxr stuff...");
+                  play_samples = stuff_buffer_soxr(inbuf, outbuf, amount_to_stuff);
+                  break;
+                }
 #else
-              //          if (amount_to_stuff) debug(1,"Standard stuff...");
-              play_samples = stuff_buffer_basic(inbuf, outbuf, amount_to_stuff);
+                //          if (amount_to_stuff) debug(1,"Standard stuff...");
+                play_samples = stuff_buffer_basic(inbuf, outbuf, amount_to_stuff);
 #endif
 
-              /*
-              {
-                int co;
-                int is_silent=1;
-                short *p = outbuf;
-                for (co=0;co<play_samples;co++) {
-                  if (*p!=0)
-                    is_silent=0;
-                  p++;
+                /*
+                {
+                  int co;
+                  int is_silent=1;
+                  short *p = outbuf;
+                  for (co=0;co<play_samples;co++) {
+                    if (*p!=0)
+                      is_silent=0;
+                    p++;
+                  }
+                  if (is_silent)
+                    debug(1,"Silence!");
                 }
-                if (is_silent)
-                  debug(1,"Silence!");
+                */
+
+                config.output->play(outbuf, play_samples);
               }
-              */
 
-              config.output->play(outbuf, play_samples);
             }
 
             // check for loss of sync
@@ -1076,18 +1177,30 @@ static void *player_thread_func(void *arg) {
               // timestamp: %llx, time now
               // %llx",sync_error,previous_sync_error,current_delay,inframe->timestamp,local_time_now);
               if (sync_error_out_of_bounds > 3) {
-                debug(1, "Lost sync with source for %d consecutive packets -- flushing and "
-                         "resyncing. Error: %lld.",
-                      sync_error_out_of_bounds, sync_error);
-                sync_error_out_of_bounds = 0;
-                player_flush(nt);
+                if ((config.flushthreshold > config.resyncthreshold) &&
+                    (llabs(sync_error) <= config.flushthreshold)) {
+                  if (catching_up == 0) {
+                    debug(1, "Lost sync with source for %d consecutive packets -- catching up. "
+                             "Error: %lld.",
+                          sync_error_out_of_bounds, sync_error);
+                    catching_up = 1;
+                    catch_up_quiet_level = CATCH_UP_QUIET_LEVEL;
+                  }
+                } else {
+                  debug(1, "Lost sync with source for %d consecutive packets -- flushing and "
+                           "resyncing. Error: %lld.",
+                        sync_error_out_of_bounds, sync_error);
+                  sync_error_out_of_bounds = 0;
+                  catching_up = 0;
+                  player_flush(nt);
+                }
               }
             } else {
               sync_error_out_of_bounds = 0;
             }
           } else {
             // if there is no delay procedure, there can be no synchronising
-            if (fix_volume == 0x10000)
+            if (volume_is_unity)
               config.output->play(inbuf, frame_size);
             else {
               play_samples = stuff_buffer_basic(inbuf, outbuf, 0);
@@ -1127,7 +1240,7 @@ static void *player_thread_func(void *arg) {
                 sync_error - previous_sync_error - previous_correction;
 
           previous_sync_error = sync_error;
-          previous_correction = amount_to_stuff;
+          previous_correction = amount_to_stuff - catch_up; // dropping frames reduces the error
 
           tsum_of_sync_errors += sync_error;
           tsum_of_drifts += statistics[newest_statistic].drift;
@@ -1158,11 +1271,14 @@ static void *player_thread_func(void *arg) {
 								inform("Sync error: %.1f (frames); net correction: %.1f (ppm); corrections: %.1f "
 											 "(ppm); missing packets %llu; late packets %llu; too late packets %llu; "
 											 "resend requests %llu; min DAC queue size %lli, min and max buffer occupancy "
-											 "%u and %u.",
+											 "%u and %u; source drift %.1f (ppm); catch-up frames dropped %llu and "
+											 "inserted %llu; missed deadlines %llu.",
 											 moving_average_sync_error, moving_average_correction * 1000000 / 352,
 											 moving_average_insertions_plus_deletions * 1000000 / 352, missing_packets,
 											 late_packets, too_late_packets, resend_requests, minimum_dac_queue_size,
-											 minimum_buffer_occupancy, maximum_buffer_occupancy);
+											 minimum_buffer_occupancy, maximum_buffer_occupancy, get_source_drift_ppm(),
+											 catch_up_frames_dropped, catch_up_frames_inserted,
+											 thread_policy_missed_deadlines(thread_role_player));
               else
 								inform("Synchronisation disabled. Missing packets %llu; late packets %llu; too late packets %llu; "
 											 "resend requests %llu; min and max buffer occupancy "
@@ -1187,8 +1303,19 @@ static void *player_thread_func(void *arg) {
   return 0;
 }
 
+void player_get_statistics(player_statistics *statistics) {
+  statistics->missing_packets = missing_packets;
+  statistics->late_packets = late_packets;
+  statistics->too_late_packets = too_late_packets;
+  statistics->resend_requests = resend_requests;
+  statistics->ab_mutex_waits = ab_mutex_waits;
+  statistics->ab_mutex_wait_ns = ab_mutex_wait_ns;
+  statistics->flush_mutex_waits = flush_mutex_waits;
+  statistics->flush_mutex_wait_ns = flush_mutex_wait_ns;
+}
+
 // takes the volume as specified by the airplay protocol
-void player_volume(double f) {
+static void set_volume(double f) {
 
   // The volume ranges -144.0 (mute) or -30 -- 0. See
   // http://git.zx2c4.com/Airtunes2/about/#setting-volume
@@ -1214,18 +1341,21 @@ void player_volume(double f) {
         1.0; // no attenuation needed -- this value is used as a flag to avoid calculations
   }
 
+  audio_parameters parameters;
+  memset(&parameters, 0, sizeof(parameters));
   if (config.output->parameters)
-    config.output->parameters(&audio_information);
+    config.output->parameters(&parameters);
   else {
-    audio_information.airplay_volume = f;
-    audio_information.minimum_volume_dB = -4810;
-    audio_information.maximum_volume_dB = 0;
-    audio_information.current_volume_dB = scaled_volume;
-    audio_information.has_true_mute = 0;
-    audio_information.is_muted = 0;
+    parameters.airplay_volume = f;
+    parameters.minimum_volume_dB = -4810;
+    parameters.maximum_volume_dB = 0;
+    parameters.current_volume_dB = scaled_volume;
+    parameters.has_true_mute = 0;
+    parameters.is_muted = 0;
   }
-  audio_information.valid = 1;
+  parameters.valid = 1;
   pthread_mutex_lock(&vol_mutex);
+  audio_information = parameters;
   software_mixer_volume = linear_volume;
   fix_volume = 65536.0 * software_mixer_volume;
   pthread_mutex_unlock(&vol_mutex);
@@ -1233,25 +1363,86 @@ void player_volume(double f) {
   char *dv = malloc(64); // will be freed in the metadata thread
   if (dv) {
     memset(dv, 0, 64);
-    snprintf(dv, 63, "%.2f,%.2f,%.2f,%.2f", audio_information.airplay_volume,
-             audio_information.current_volume_dB / 100.0,
-             audio_information.minimum_volume_dB / 100.0,
-             audio_information.maximum_volume_dB / 100.0);
-    send_ssnc_metadata('pvol', dv, strlen(dv), 1);
+    snprintf(dv, 63, "%.2f,%.2f,%.2f,%.2f", parameters.airplay_volume,
+             parameters.current_volume_dB / 100.0, parameters.minimum_volume_dB / 100.0,
+             parameters.maximum_volume_dB / 100.0);
+    send_ssnc_metadata('pvol', dv, strlen(dv), metadata_coalesce);
   }
 #endif
 }
 
+// Setting a hardware mixer can be slow, and a source sends a stream of volume requests while the
+// slider is being dragged, so requests are handed to this thread. It only applies the most
+// recent one, dropping any that were overtaken while it was busy. When asked to stop, it still
+// applies a request that is waiting, so the last one made during the session isn't lost.
+static void *volume_thread_func(void *arg) {
+  pthread_mutex_lock(&volume_request_lock);
+  while (1) {
+    while ((volume_request_pending == 0) && (volume_thread_stop == 0))
+      pthread_cond_wait(&volume_requested, &volume_request_lock);
+    if (volume_request_pending == 0) {
+      volume_thread_started = 0; // asked to stop, with nothing left to do
+      break;
+    }
+    double f = requested_volume;
+    volume_request_pending = 0;
+    pthread_mutex_unlock(&volume_request_lock);
+    set_volume(f);
+    pthread_mutex_lock(&volume_request_lock);
+  }
+  pthread_mutex_unlock(&volume_request_lock);
+  return NULL;
+}
+
+static void volume_thread_start(void) {
+  pthread_mutex_lock(&volume_request_lock);
+  volume_thread_stop = 0;
+  volume_request_pending = 0;
+  if (pthread_create(&volume_thread, NULL, volume_thread_func, NULL) == 0)
+    volume_thread_started = 1;
+  else
+    warn("could not create the volume thread -- volume will be set directly.");
+  pthread_mutex_unlock(&volume_request_lock);
+}
+
+static void volume_thread_join(void) {
+  pthread_mutex_lock(&volume_request_lock);
+  int started = volume_thread_started;
+  volume_thread_stop = 1;
+  pthread_cond_signal(&volume_requested);
+  pthread_mutex_unlock(&volume_request_lock);
+  if (started)
+    pthread_join(volume_thread, NULL);
+}
+
+// ask for the volume to be set. During a session this doesn't wait for it to happen; otherwise
+// it is set here and now
+void player_volume(double f) {
+  pthread_mutex_lock(&volume_request_lock);
+  if (volume_thread_started) {
+    if (volume_request_pending)
+      debug(2, "volume request overtaken by a newer one.");
+    requested_volume = f;
+    volume_request_pending = 1;
+    pthread_cond_signal(&volume_requested);
+    pthread_mutex_unlock(&volume_request_lock);
+  } else {
+    pthread_mutex_unlock(&volume_request_lock);
+    set_volume(f);
+  }
+}
+
+void player_set_random_seed(unsigned int seed) { random_seed = seed; }
+
 void player_flush(uint32_t timestamp) {
   // debug(1,"Flush requested up to %u. It seems as if 0 is special.",timestamp);
-  pthread_mutex_lock(&flush_mutex);
+  lock_flush_mutex();
   flush_requested = 1;
   // if (timestamp!=0)
   flush_rtp_timestamp = timestamp; // flush all packets up to (and including?) this
   pthread_mutex_unlock(&flush_mutex);
-  play_segment_reference_frame = 0;
 #ifdef CONFIG_METADATA
-  send_ssnc_metadata('pfls', NULL, 0, 1);
+  send_ssnc_metadata('pfls', NULL, 0, metadata_block);
 #endif
 }
 
@@ -1275,10 +1466,14 @@ int player_play(stream_cfg *stream) {
   init_decoder(stream->fmtp);
   // must be after decoder init
   init_buffer();
+  ab_mutex_waits = ab_mutex_wait_ns = flush_mutex_waits = flush_mutex_wait_ns = 0;
   please_stop = 0;
+  pthread_mutex_lock(&vol_mutex);
+  audio_information.valid = 0;
+  pthread_mutex_unlock(&vol_mutex);
   command_start();
 #ifdef CONFIG_METADATA
-  send_ssnc_metadata('pbeg', NULL, 0, 1);
+  send_ssnc_metadata('pbeg', NULL, 0, metadata_block);
 #endif
 
 // set the flowcontrol condition variable to wait on a monotonic clock
@@ -1294,7 +1489,9 @@ int player_play(stream_cfg *stream) {
   if (rc)
     debug(1, "Error initialising condition variable.");
   config.output->start(sampling_rate);
-  size_t size = (PTHREAD_STACK_MIN + 256 * 1024);
+  volume_thread_start();
+  size_t size = (PTHREAD_STACK_MIN + 256 * 1024 +
+                 config.thread_settings[thread_role_player].stack_prefault);
   pthread_attr_t tattr;
   pthread_attr_init(&tattr);
   rc = pthread_attr_setstacksize(&tattr, size);
@@ -1309,8 +1506,9 @@ void player_stop(void) {
   please_stop = 1;
   pthread_cond_signal(&flowcontrol); // tell it to give up
   pthread_join(player_thread, NULL);
+  volume_thread_join(); // applies any request still waiting
 #ifdef CONFIG_METADATA
-  send_ssnc_metadata('pend', NULL, 0, 1);
+  send_ssnc_metadata('pend', NULL, 0, metadata_block);
 #endif
   config.output->stop();
   command_stop();
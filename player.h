@@ -20,6 +20,29 @@ void player_stop(void);
 void player_volume(double f);
 void player_flush(uint32_t timestamp);
 
+// the player seeds random() with the time of day when a session starts. A simulator can give it a
+// seed of its own instead, so that a run can be repeated; 0 goes back to the time of day.
+void player_set_random_seed(unsigned int seed);
+
 void player_put_packet(seq_t seqno, uint32_t timestamp, uint8_t *data, int len);
 
+typedef struct {
+  seq_t seqno;
+  uint32_t timestamp;
+  uint8_t *data;
+  int len;
+} rtp_audio_packet;
+
+// put a batch of packets into the buffer in one go
+void player_put_packets(rtp_audio_packet *packets, int count);
+
+typedef struct {
+  uint64_t missing_packets, late_packets, too_late_packets, resend_requests;
+  // how often, and for how long in all, the buffer's locks had to be waited for
+  uint64_t ab_mutex_waits, ab_mutex_wait_ns, flush_mutex_waits, flush_mutex_wait_ns;
+} player_statistics;
+
+// the packet and lock counts for the current or most recent session
+void player_get_statistics(player_statistics *statistics);
+
 #endif //_PLAYER_H
@@ -0,0 +1,764 @@
+/*
+ * A RAOP load generator for benchmarking. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libdaemon/dlog.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBPOLARSSL
+#include <polarssl/aes.h>
+#endif
+
+#ifdef HAVE_LIBSSL
+#include <openssl/aes.h>
+#endif
+
+#include "common.h"
+#include "alac_encode.h"
+
+// This plays the part of one or more AirPlay sources. Each session does what iTunes would --
+// OPTIONS with an Apple-Challenge, ANNOUNCE with an RSA-wrapped AES key, SETUP, RECORD and
+// SET_PARAMETER -- then streams encrypted ALAC in real time, sending sync packets, answering
+// timing and resend requests and, if asked, dropping packets. At the end it sends FLUSH and
+// TEARDOWN.
+// Shairport Sync plays one session at a time, so to run several sessions at once, run several
+// instances on different ports and list them all with -a.
+
+#define frames_per_packet 352
+#define sample_rate 44100
+#define history_size 1024 // packets kept for resending
+#define source_latency 88200
+
+typedef struct {
+  uint16_t seqno;
+  int length; // zero if nothing has been sent with this seqno
+  uint8_t data[12 + alac_encoded_size(frames_per_packet) + 16];
+} sent_packet;
+
+typedef struct {
+  int index;
+  char *host, *port;
+  pthread_t thread;
+  uint64_t rng_state;
+
+  int rtsp_fd;
+  int cseq;
+  int control_socket, timing_socket; // ours -- audio is sent from the control socket
+  int control_port, timing_port;
+  struct sockaddr_storage server_address;
+  socklen_t server_address_length;
+  int server_audio_port, server_control_port, server_timing_port;
+
+  uint8_t aes_key[16], aes_iv[16];
+#ifdef HAVE_LIBSSL
+  AES_KEY aes;
+#endif
+#ifdef HAVE_LIBPOLARSSL
+  aes_context aes;
+#endif
+
+  uint16_t seqno;
+  uint32_t rtp_base;
+  sent_packet *history;
+
+  // results
+  int failed;
+  int interrupted; // the instance closed the connection, e.g. when another session took over
+  double setup_latency; // seconds from sending OPTIONS to the response to RECORD
+  unsigned long long packets_sent, packets_dropped, resend_requests, packets_resent,
+      packets_not_resent, timing_requests;
+  double cpu_seconds; // used by this session's thread
+} session;
+
+static int16_t *audio;       // interleaved stereo samples
+static int64_t audio_frames; // how many frames there are
+static double duration = 30.0;
+static double loss_percent = 0.0;
+
+// die() calls this
+void shairport_shutdown() {}
+
+static double uniform(session *s) {
+  s->rng_state ^= s->rng_state >> 12;
+  s->rng_state ^= s->rng_state << 25;
+  s->rng_state ^= s->rng_state >> 27;
+  return ((s->rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void random_bytes(session *s, uint8_t *buffer, int length) {
+  int i;
+  for (i = 0; i < length; i++)
+    buffer[i] = uniform(s) * 256;
+}
+
+static double seconds_of_fp(uint64_t fp) { return (fp * 1.0) / ((uint64_t)1 << 32); }
+
+// the source's clock -- ours, but looking like an NTP time
+static uint64_t source_time(void) { return get_absolute_time_in_fp() + ((uint64_t)0x83aa7e80 << 32); }
+
+static uint16_t get16(uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v >> 16);
+  put16(p + 2, v);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+  put32(p, v >> 32);
+  put32(p + 4, v);
+}
+
+// base64 without the padding, as Apple does it
+static char *base64_unpadded(uint8_t *input, int length) {
+  char *encoded = base64_enc(input, length);
+  if (encoded == NULL)
+    die("Can't base64-encode.");
+  char *p = strchr(encoded, '=');
+  if (p)
+    *p = 0;
+  return encoded;
+}
+
+// WAV files
+
+static void load_wav(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    die("Can't open \"%s\": %s.", path, strerror(errno));
+  uint8_t header[12];
+  if ((fread(header, 12, 1, f) != 1) || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+    die("\"%s\" is not a WAV file.", path);
+  int format_ok = 0;
+  uint8_t chunk[8];
+  while (fread(chunk, 8, 1, f) == 1) {
+    uint32_t size = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | ((uint32_t)chunk[7] << 24);
+    if (memcmp(chunk, "fmt ", 4) == 0) {
+      uint8_t fmt[16];
+      if ((size < 16) || (fread(fmt, 16, 1, f) != 1))
+        die("\"%s\" has a bad format chunk.", path);
+      int format = fmt[0] | (fmt[1] << 8), channels = fmt[2] | (fmt[3] << 8),
+          rate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16), bits = fmt[14] | (fmt[15] << 8);
+      if ((format != 1) || (channels != 2) || (rate != sample_rate) || (bits != 16))
+        die("\"%s\" must be 16-bit stereo PCM at 44,100 frames per second.", path);
+      format_ok = 1;
+      fseek(f, size - 16 + (size & 1), SEEK_CUR);
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      if (!format_ok)
+        die("\"%s\" has no format chunk before its data.", path);
+      audio_frames = size / 4;
+      audio = malloc(audio_frames * 4);
+      if ((audio == NULL) || (fread(audio, 4, audio_frames, f) != (size_t)audio_frames))
+        die("Can't read the audio in \"%s\".", path);
+      int64_t i;
+      for (i = 0; i < audio_frames * 2; i++) { // WAV files are little-endian
+        uint8_t *b = (uint8_t *)&audio[i];
+        audio[i] = (int16_t)(b[0] | (b[1] << 8));
+      }
+      break;
+    } else {
+      fseek(f, size + (size & 1), SEEK_CUR);
+    }
+  }
+  fclose(f);
+  if (audio_frames < frames_per_packet)
+    die("\"%s\" has too little audio in it.", path);
+}
+
+// ten seconds of a 440 Hz tone
+static void make_tone(void) {
+  audio_frames = 10 * sample_rate;
+  audio = malloc(audio_frames * 4);
+  if (audio == NULL)
+    die("Out of memory.");
+  int64_t i;
+  for (i = 0; i < audio_frames; i++)
+    audio[2 * i] = audio[2 * i + 1] = 8000 * sin(2 * M_PI * 440 * i / sample_rate);
+}
+
+// UDP
+
+static int bind_udp(int family, int *port) {
+  struct sockaddr_storage local;
+  socklen_t local_length;
+  memset(&local, 0, sizeof(local));
+  if (family == AF_INET6) {
+    ((struct sockaddr_in6 *)&local)->sin6_family = AF_INET6;
+    ((struct sockaddr_in6 *)&local)->sin6_addr = in6addr_any;
+    local_length = sizeof(struct sockaddr_in6);
+  } else {
+    ((struct sockaddr_in *)&local)->sin_family = AF_INET;
+    ((struct sockaddr_in *)&local)->sin_addr.s_addr = htonl(INADDR_ANY);
+    local_length = sizeof(struct sockaddr_in);
+  }
+  int s = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+  if ((s < 0) || (bind(s, (struct sockaddr *)&local, local_length) != 0))
+    die("Can't bind a UDP socket: %s.", strerror(errno));
+  local_length = sizeof(local);
+  getsockname(s, (struct sockaddr *)&local, &local_length);
+  if (family == AF_INET6)
+    *port = ntohs(((struct sockaddr_in6 *)&local)->sin6_port);
+  else
+    *port = ntohs(((struct sockaddr_in *)&local)->sin_port);
+  return s;
+}
+
+static void send_udp(session *s, int port, const void *data, size_t length) {
+  struct sockaddr_storage to = s->server_address;
+  if (to.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)&to)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in *)&to)->sin_port = htons(port);
+  if (sendto(s->control_socket, data, length, 0, (struct sockaddr *)&to, s->server_address_length) <
+      0)
+    debug(1, "Session %d: error sending to port %d: %s.", s->index, port, strerror(errno));
+}
+
+static void answer_timing_request(session *s, uint8_t *request, ssize_t length) {
+  if ((length < 32) || ((request[1] & ~0x80) != 0x52))
+    return;
+  uint8_t reply[32];
+  memcpy(reply, request, 32);
+  reply[1] = 0xd3;
+  memcpy(reply + 8, request + 24, 8); // the originate time is the request's transmit time
+  uint64_t time_now = source_time();
+  put64(reply + 16, time_now); // receive time
+  put64(reply + 24, time_now); // transmit time
+  struct sockaddr_storage to = s->server_address;
+  if (to.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)&to)->sin6_port = htons(s->server_timing_port);
+  else
+    ((struct sockaddr_in *)&to)->sin_port = htons(s->server_timing_port);
+  sendto(s->timing_socket, reply, sizeof(reply), 0, (struct sockaddr *)&to,
+         s->server_address_length);
+  s->timing_requests++;
+}
+
+static void resend_packets(session *s, uint16_t first, uint16_t count) {
+  s->resend_requests++;
+  uint16_t i;
+  for (i = 0; i < count; i++) {
+    uint16_t seqno = first + i;
+    sent_packet *p = &s->history[seqno % history_size];
+    if ((p->length == 0) || (p->seqno != seqno)) {
+      s->packets_not_resent++;
+      continue;
+    }
+    uint8_t packet[4 + sizeof(p->data)];
+    packet[0] = 0x80;
+    packet[1] = 0xd6; // retransmitted audio, in the control path
+    put16(packet + 2, 1);
+    memcpy(packet + 4, p->data, p->length);
+    send_udp(s, s->server_control_port, packet, 4 + p->length);
+    s->packets_resent++;
+  }
+}
+
+// deal with anything the instance has sent to our UDP ports, and notice if it has closed the
+// RTSP connection
+static void service_udp(session *s, int timeout_ms) {
+  struct pollfd fds[3];
+  fds[0].fd = s->timing_socket;
+  fds[1].fd = s->control_socket;
+  fds[2].fd = s->rtsp_fd;
+  fds[0].events = fds[1].events = fds[2].events = POLLIN;
+  if (poll(fds, 3, timeout_ms) <= 0)
+    return;
+  uint8_t packet[2048];
+  ssize_t nread;
+  if ((fds[2].revents & (POLLIN | POLLHUP)) &&
+      (recv(s->rtsp_fd, packet, 1, MSG_PEEK | MSG_DONTWAIT) == 0))
+    s->interrupted = 1;
+  if (fds[0].revents & POLLIN)
+    while ((nread = recv(s->timing_socket, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+      answer_timing_request(s, packet, nread);
+  if (fds[1].revents & POLLIN)
+    while ((nread = recv(s->control_socket, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+      if ((nread >= 8) && (packet[1] == (0x55 | 0x80)))
+        resend_packets(s, get16(packet + 4), get16(packet + 6));
+}
+
+// RTSP
+
+// send a request and wait for its response, which is returned in a malloced string, or NULL if
+// the connection fails
+static char *rtsp_request(session *s, const char *method, const char *extra_headers,
+                          const char *content_type, const char *content) {
+  char *request = malloc(1024 + (content ? strlen(content) : 0));
+  if (request == NULL)
+    die("Out of memory.");
+  int n = sprintf(request, "%s rtsp://%s/%u RTSP/1.0\r\nCSeq: %d\r\nUser-Agent: raop-bench\r\n%s",
+                  method, s->host, 1000 + s->index, ++s->cseq, extra_headers ? extra_headers : "");
+  if (content)
+    n += sprintf(request + n, "Content-Type: %s\r\nContent-Length: %zu\r\n\r\n%s", content_type,
+                 strlen(content), content);
+  else
+    n += sprintf(request + n, "\r\n");
+  ssize_t written = write(s->rtsp_fd, request, n);
+  free(request);
+  if (written != n)
+    return NULL;
+
+  size_t size = 4096, received = 0;
+  char *response = malloc(size + 1);
+  char *end_of_headers = NULL;
+  size_t content_length = 0;
+  while ((end_of_headers == NULL) || (received < (end_of_headers + 4 - response) + content_length)) {
+    if (received == size) {
+      size *= 2;
+      response = realloc(response, size + 1);
+    }
+    if (response == NULL)
+      die("Out of memory.");
+    struct pollfd pfd;
+    pfd.fd = s->rtsp_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 10) == 0) { // keep answering timing requests while we wait
+      service_udp(s, 0);
+      continue;
+    }
+    ssize_t nread = read(s->rtsp_fd, response + received, size - received);
+    if (nread <= 0) {
+      free(response);
+      return NULL;
+    }
+    received += nread;
+    response[received] = 0;
+    if ((end_of_headers == NULL) && ((end_of_headers = strstr(response, "\r\n\r\n")) != NULL)) {
+      char *cl = strstr(response, "Content-Length: ");
+      if (cl && (cl < end_of_headers))
+        content_length = atoi(cl + strlen("Content-Length: "));
+    }
+  }
+  if (strncmp(response, "RTSP/1.0 200", 12) != 0) {
+    warn("Session %d: %s got the response \"%.*s\".", s->index, method,
+         (int)strcspn(response, "\r"), response);
+    free(response);
+    return NULL;
+  }
+  return response;
+}
+
+static int get_port(const char *transport, const char *name) {
+  const char *p = strstr(transport, name);
+  if (p == NULL)
+    return 0;
+  return atoi(p + strlen(name));
+}
+
+static int start_session(session *s) {
+  char *response, headers[512], content[1024];
+
+  uint8_t challenge[16];
+  random_bytes(s, challenge, sizeof(challenge));
+  char *challenge64 = base64_unpadded(challenge, sizeof(challenge));
+  snprintf(headers, sizeof(headers), "Apple-Challenge: %s\r\n", challenge64);
+  free(challenge64);
+  if ((response = rtsp_request(s, "OPTIONS", headers, NULL, NULL)) == NULL)
+    return -1;
+  if (strstr(response, "Apple-Response: ") == NULL)
+    warn("Session %d: no Apple-Response to the Apple-Challenge.", s->index);
+  free(response);
+
+  random_bytes(s, s->aes_key, sizeof(s->aes_key));
+  random_bytes(s, s->aes_iv, sizeof(s->aes_iv));
+#ifdef HAVE_LIBSSL
+  AES_set_encrypt_key(s->aes_key, 128, &s->aes);
+#endif
+#ifdef HAVE_LIBPOLARSSL
+  memset(&s->aes, 0, sizeof(aes_context));
+  aes_setkey_enc(&s->aes, s->aes_key, 128);
+#endif
+  int wrapped_length;
+  uint8_t *wrapped = rsa_apply(s->aes_key, sizeof(s->aes_key), &wrapped_length, RSA_MODE_WRAP_KEY);
+  char *key64 = base64_unpadded(wrapped, wrapped_length);
+  char *iv64 = base64_unpadded(s->aes_iv, sizeof(s->aes_iv));
+  free(wrapped);
+  snprintf(content, sizeof(content),
+           "v=0\r\n"
+           "o=iTunes %u 0 IN IP4 127.0.0.1\r\n"
+           "s=iTunes\r\n"
+           "c=IN IP4 %s\r\n"
+           "t=0 0\r\n"
+           "m=audio 0 RTP/AVP 96\r\n"
+           "a=rtpmap:96 AppleLossless\r\n"
+           "a=fmtp:96 %d 0 16 40 10 14 2 255 0 0 %d\r\n"
+           "a=rsaaeskey:%s\r\n"
+           "a=aesiv:%s\r\n",
+           1000 + s->index, s->host, frames_per_packet, sample_rate, key64, iv64);
+  free(key64);
+  free(iv64);
+  if ((response = rtsp_request(s, "ANNOUNCE", NULL, "application/sdp", content)) == NULL)
+    return -1;
+  free(response);
+
+  snprintf(headers, sizeof(headers),
+           "Transport: RTP/AVP/UDP;unicast;interleaved=0-1;mode=record;control_port=%d;"
+           "timing_port=%d\r\n",
+           s->control_port, s->timing_port);
+  if ((response = rtsp_request(s, "SETUP", headers, NULL, NULL)) == NULL)
+    return -1;
+  char *transport = strstr(response, "Transport: ");
+  if (transport) {
+    s->server_audio_port = get_port(transport, "server_port=");
+    s->server_control_port = get_port(transport, "control_port=");
+    s->server_timing_port = get_port(transport, "timing_port=");
+  }
+  free(response);
+  if ((s->server_audio_port == 0) || (s->server_control_port == 0) ||
+      (s->server_timing_port == 0)) {
+    warn("Session %d: no ports in the response to SETUP.", s->index);
+    return -1;
+  }
+
+  snprintf(headers, sizeof(headers), "Session: 1\r\nRTP-Info: seq=%u;rtptime=%u\r\n", s->seqno,
+           s->rtp_base);
+  if ((response = rtsp_request(s, "RECORD", headers, NULL, NULL)) == NULL)
+    return -1;
+  free(response);
+  return 0;
+}
+
+static void send_sync(session *s, uint32_t rtp_now, int first) {
+  uint8_t packet[20];
+  packet[0] = first ? 0x90 : 0x80;
+  packet[1] = 0xd4;
+  put16(packet + 2, 7);
+  put32(packet + 4, rtp_now - source_latency);
+  put64(packet + 8, source_time());
+  put32(packet + 16, rtp_now);
+  send_udp(s, s->server_control_port, packet, sizeof(packet));
+}
+
+static void send_audio_packet(session *s, int64_t packet_number) {
+  sent_packet *p = &s->history[s->seqno % history_size];
+  int16_t samples[frames_per_packet * 2];
+  int64_t frame = (packet_number * frames_per_packet) % audio_frames;
+  int i;
+  for (i = 0; i < frames_per_packet; i++) {
+    samples[2 * i] = audio[2 * frame];
+    samples[2 * i + 1] = audio[2 * frame + 1];
+    frame = (frame + 1) % audio_frames;
+  }
+  uint8_t encoded[alac_encoded_size(frames_per_packet)];
+  int length = alac_encode_uncompressed(samples, frames_per_packet, encoded);
+
+  p->data[0] = 0x80;
+  p->data[1] = (packet_number == 0) ? 0xe0 : 0x60; // the first has the marker bit set
+  put16(p->data + 2, s->seqno);
+  put32(p->data + 4, s->rtp_base + packet_number * frames_per_packet);
+  put32(p->data + 8, 0x12345678 + s->index); // SSRC
+  // only whole AES blocks are encrypted, with the IV fresh for every packet
+  int aes_length = length & ~0xf;
+  uint8_t iv[16];
+  memcpy(iv, s->aes_iv, sizeof(iv));
+#ifdef HAVE_LIBSSL
+  AES_cbc_encrypt(encoded, p->data + 12, aes_length, &s->aes, iv, AES_ENCRYPT);
+#endif
+#ifdef HAVE_LIBPOLARSSL
+  aes_crypt_cbc(&s->aes, AES_ENCRYPT, aes_length, iv, encoded, p->data + 12);
+#endif
+  memcpy(p->data + 12 + aes_length, encoded + aes_length, length - aes_length);
+  p->length = 12 + length;
+  p->seqno = s->seqno;
+
+  if (uniform(s) * 100 < loss_percent)
+    s->packets_dropped++;
+  else
+    send_udp(s, s->server_audio_port, p->data, p->length);
+  s->packets_sent++;
+  s->seqno++;
+}
+
+static void *session_thread(void *arg) {
+  session *s = arg;
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int ret = getaddrinfo(s->host, s->port, &hints, &info);
+  if (ret != 0) {
+    warn("Session %d: can't find \"%s\": %s.", s->index, s->host, gai_strerror(ret));
+    s->failed = 1;
+    return NULL;
+  }
+  s->rtsp_fd = socket(info->ai_family, SOCK_STREAM, IPPROTO_TCP);
+  uint64_t setup_start = get_absolute_time_in_fp();
+  if ((s->rtsp_fd < 0) || (connect(s->rtsp_fd, info->ai_addr, info->ai_addrlen) != 0)) {
+    warn("Session %d: can't connect to %s port %s: %s.", s->index, s->host, s->port,
+         strerror(errno));
+    freeaddrinfo(info);
+    s->failed = 1;
+    return NULL;
+  }
+  memcpy(&s->server_address, info->ai_addr, info->ai_addrlen);
+  s->server_address_length = info->ai_addrlen;
+  s->control_socket = bind_udp(info->ai_family, &s->control_port);
+  s->timing_socket = bind_udp(info->ai_family, &s->timing_port);
+  freeaddrinfo(info);
+
+  s->history = calloc(history_size, sizeof(sent_packet));
+  if (s->history == NULL)
+    die("Out of memory.");
+  s->seqno = uniform(s) * 65536;
+  s->rtp_base = uniform(s) * 4294967296.0;
+
+  if (start_session(s) != 0) {
+    s->failed = 1;
+  } else {
+    uint64_t stream_start = get_absolute_time_in_fp();
+    s->setup_latency = seconds_of_fp(stream_start - setup_start);
+    int64_t packets = duration * sample_rate / frames_per_packet, packet_number;
+    for (packet_number = 0; (packet_number < packets) && (!s->interrupted); packet_number++) {
+      uint64_t due = stream_start + ((packet_number * frames_per_packet) << 32) / sample_rate;
+      uint64_t time_now;
+      while (((time_now = get_absolute_time_in_fp()) < due) && (!s->interrupted))
+        service_udp(s, (((due - time_now) * 1000) >> 32) + 1);
+      if (s->interrupted) {
+        warn("Session %d: the instance closed the connection.", s->index);
+        break;
+      }
+      if (packet_number % (sample_rate / frames_per_packet) == 0) // about once a second
+        send_sync(s, s->rtp_base + packet_number * frames_per_packet, packet_number == 0);
+      send_audio_packet(s, packet_number);
+    }
+    if (!s->interrupted) {
+      char headers[128];
+      snprintf(headers, sizeof(headers), "Session: 1\r\nRTP-Info: seq=%u;rtptime=%u\r\n",
+               s->seqno, s->rtp_base + (uint32_t)(packets * frames_per_packet));
+      char *response = rtsp_request(s, "FLUSH", headers, NULL, NULL);
+      free(response);
+      response = rtsp_request(s, "TEARDOWN", "Session: 1\r\n", NULL, NULL);
+      free(response);
+    }
+  }
+  close(s->rtsp_fd);
+  close(s->control_socket);
+  close(s->timing_socket);
+  free(s->history);
+
+  struct timespec cpu;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0)
+    s->cpu_seconds = cpu.tv_sec + cpu.tv_nsec * 1e-9;
+  return NULL;
+}
+
+// the CPU time, in seconds, used so far by a process, from /proc
+static double process_cpu_seconds(int pid) {
+  char path[64], buffer[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  size_t n = fread(buffer, 1, sizeof(buffer) - 1, f);
+  fclose(f);
+  buffer[n] = 0;
+  char *p = strrchr(buffer, ')'); // the command name can contain spaces
+  if (p == NULL)
+    return -1;
+  unsigned long utime, stime;
+  // after the name: state, then 10 fields, then utime and stime
+  if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1;
+  return (utime + stime) * 1.0 / sysconf(_SC_CLK_TCK);
+}
+
+static void usage(char *name) {
+  printf("Usage: %s [options]\n"
+         "Streams audio to one or more instances of Shairport Sync, as an AirPlay source would.\n"
+         "    -a host:port,...  the instances to stream to, used in turn [127.0.0.1:5000*]\n"
+         "    -n sessions       how many sessions to run at once [1*]\n"
+         "    -f file.wav       the audio to send, 16-bit stereo at 44,100 frames per second; it "
+         "repeats\n"
+         "                      as needed [a 440 Hz tone*]\n"
+         "    -d seconds        how long to stream for [30*]\n"
+         "    -l percent        drop this percentage of audio packets [0*]\n"
+         "    -P pid,...        the processes of the instances, to report the CPU they use (Linux "
+         "only)\n"
+         "    -v                more debug messages; repeat for more\n"
+         "    *) default option\n"
+         "Shairport Sync plays one session at a time, so each session needs its own instance.\n",
+         name);
+}
+
+int main(int argc, char **argv) {
+  char *instances = "127.0.0.1:5000", *wav = NULL, *pid_list = NULL;
+  int number_of_sessions = 1, opt;
+  daemon_log_ident = "raop-bench";
+  while ((opt = getopt(argc, argv, "a:n:f:d:l:P:vh")) > 0) {
+    switch (opt) {
+    case 'a':
+      instances = optarg;
+      break;
+    case 'n':
+      number_of_sessions = atoi(optarg);
+      break;
+    case 'f':
+      wav = optarg;
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'l':
+      loss_percent = atof(optarg);
+      break;
+    case 'P':
+      pid_list = optarg;
+      break;
+    case 'v':
+      debuglev++;
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if ((optind != argc) || (number_of_sessions < 1) || (duration <= 0)) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  if (wav)
+    load_wav(wav);
+  else
+    make_tone();
+
+  // the instances to stream to
+  char *hosts[64], *ports[64];
+  int number_of_instances = 0;
+  char *list = strdup(instances), *saveptr, *item;
+  for (item = strtok_r(list, ",", &saveptr); item && (number_of_instances < 64);
+       item = strtok_r(NULL, ",", &saveptr)) {
+    char *colon = strrchr(item, ':');
+    if (colon) {
+      *colon = 0;
+      ports[number_of_instances] = colon + 1;
+    } else {
+      ports[number_of_instances] = "5000";
+    }
+    hosts[number_of_instances++] = item;
+  }
+  if (number_of_instances == 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  int pids[64], number_of_pids = 0, i;
+  double cpu_at_start[64];
+  if (pid_list) {
+    char *pids_copy = strdup(pid_list);
+    for (item = strtok_r(pids_copy, ",", &saveptr); item && (number_of_pids < 64);
+         item = strtok_r(NULL, ",", &saveptr))
+      pids[number_of_pids++] = atoi(item);
+    free(pids_copy);
+  }
+  for (i = 0; i < number_of_pids; i++)
+    cpu_at_start[i] = process_cpu_seconds(pids[i]);
+
+  session *sessions = calloc(number_of_sessions, sizeof(session));
+  if (sessions == NULL)
+    die("Out of memory.");
+  uint64_t seed = get_absolute_time_in_fp();
+  uint64_t start = get_absolute_time_in_fp();
+  for (i = 0; i < number_of_sessions; i++) {
+    session *s = &sessions[i];
+    s->index = i;
+    s->host = hosts[i % number_of_instances];
+    s->port = ports[i % number_of_instances];
+    s->rng_state = (seed + i * 0x9e3779b97f4a7c15ULL) | 1;
+    pthread_create(&s->thread, NULL, session_thread, s);
+  }
+  for (i = 0; i < number_of_sessions; i++)
+    pthread_join(sessions[i].thread, NULL);
+  double elapsed = seconds_of_fp(get_absolute_time_in_fp() - start);
+
+  printf("session  instance               setup (ms)  sent    dropped  resend requests  resent  "
+         "not resent  resend rate (%%)  CPU (ms)\n");
+  int succeeded = 0;
+  double total_setup = 0, maximum_setup = 0;
+  unsigned long long total_sent = 0, total_resent = 0;
+  for (i = 0; i < number_of_sessions; i++) {
+    session *s = &sessions[i];
+    char instance[64];
+    snprintf(instance, sizeof(instance), "%s:%s", s->host, s->port);
+    if (s->failed) {
+      printf("%-8d %-22s failed\n", i, instance);
+      continue;
+    }
+    succeeded++;
+    total_setup += s->setup_latency;
+    if (s->setup_latency > maximum_setup)
+      maximum_setup = s->setup_latency;
+    total_sent += s->packets_sent;
+    total_resent += s->packets_resent;
+    printf("%-8d %-22s %-11.1f %-7llu %-8llu %-16llu %-7llu %-11llu %-16.2f %.1f%s\n", i,
+           instance, s->setup_latency * 1000, s->packets_sent, s->packets_dropped,
+           s->resend_requests, s->packets_resent, s->packets_not_resent,
+           s->packets_sent ? (100.0 * s->packets_resent) / s->packets_sent : 0.0,
+           s->cpu_seconds * 1000, s->interrupted ? " (interrupted)" : "");
+  }
+  printf("%d of %d sessions ran for %.1f seconds.", succeeded, number_of_sessions, elapsed);
+  if (succeeded)
+    printf(" Setup: mean %.1f ms, maximum %.1f ms. Resend rate %.2f%%.",
+           total_setup * 1000 / succeeded, maximum_setup * 1000,
+           total_sent ? (100.0 * total_resent) / total_sent : 0.0);
+  printf("\n");
+  if (number_of_pids && succeeded) {
+    double receiver_cpu = 0;
+    for (i = 0; i < number_of_pids; i++) {
+      double cpu_at_end = process_cpu_seconds(pids[i]);
+      if ((cpu_at_start[i] < 0) || (cpu_at_end < 0))
+        warn("Can't get the CPU time used by process %d.", pids[i]);
+      else
+        receiver_cpu += cpu_at_end - cpu_at_start[i];
+    }
+    printf("The instances used %.2f CPU seconds: %.2f%% of a CPU per stream.\n", receiver_cpu,
+           100.0 * receiver_cpu / elapsed / succeeded);
+  }
+  free(sessions);
+  free(list);
+  free(audio);
+  return succeeded == number_of_sessions ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+/*
+ * Replays a capture file into a running instance. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <libdaemon/dlog.h>
+
+#include "common.h"
+#include "capture.h"
+
+// This plays a capture file, as written by Shairport Sync's capture mode, back into a running
+// instance of Shairport Sync over the loopback interface or the network. RTSP requests are sent
+// on a TCP connection and their responses awaited; audio and control packets are sent to the
+// ports given in the response to the SETUP request, at the times they were originally received,
+// scaled by the speed requested.
+// The timing replies in the capture are not replayed as they are, because they answered requests
+// that this instance didn't make. Instead, the instance's timing requests are answered as they
+// come in, using the source's clock as seen in the captured replies.
+
+// the UDP ports of the instance being replayed into, from its response to SETUP
+static int server_audio_port, server_control_port, server_timing_port;
+static struct sockaddr_storage server_address;
+static socklen_t server_address_length;
+
+// our UDP sockets -- the instance sends its resend and timing requests to these
+static int control_socket, timing_socket;
+static int control_port, timing_port;
+
+// the difference between the source's clock and the capture's timestamps, from the latest timing
+// reply in the capture, and whether it's known yet
+static uint64_t source_clock_offset;
+static int source_clock_offset_valid;
+
+// to map between the times in the capture and the time now
+static uint64_t capture_start_time, replay_start_time;
+static double speed = 1.0;
+
+static uint64_t rtsp_requests, audio_packets, control_packets, timing_requests_answered,
+    resend_requests, packets_skipped;
+static uint64_t maximum_lateness;
+
+// die() calls this
+void shairport_shutdown() {}
+
+static uint64_t capture_time_now(void) {
+  return capture_start_time + (uint64_t)((get_absolute_time_in_fp() - replay_start_time) * speed);
+}
+
+static int bind_udp(int family, int *port) {
+  struct sockaddr_storage local;
+  socklen_t local_length;
+  memset(&local, 0, sizeof(local));
+  if (family == AF_INET6) {
+    ((struct sockaddr_in6 *)&local)->sin6_family = AF_INET6;
+    ((struct sockaddr_in6 *)&local)->sin6_addr = in6addr_any;
+    local_length = sizeof(struct sockaddr_in6);
+  } else {
+    ((struct sockaddr_in *)&local)->sin_family = AF_INET;
+    ((struct sockaddr_in *)&local)->sin_addr.s_addr = htonl(INADDR_ANY);
+    local_length = sizeof(struct sockaddr_in);
+  }
+  int s = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+  if ((s < 0) || (bind(s, (struct sockaddr *)&local, local_length) != 0))
+    die("Can't bind a UDP socket: %s.", strerror(errno));
+  local_length = sizeof(local);
+  getsockname(s, (struct sockaddr *)&local, &local_length);
+  if (family == AF_INET6)
+    *port = ntohs(((struct sockaddr_in6 *)&local)->sin6_port);
+  else
+    *port = ntohs(((struct sockaddr_in *)&local)->sin_port);
+  return s;
+}
+
+static void send_udp(int sock, int port, const void *data, size_t length) {
+  struct sockaddr_storage to = server_address;
+  if (to.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)&to)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in *)&to)->sin_port = htons(port);
+  if (sendto(sock, data, length, 0, (struct sockaddr *)&to, server_address_length) < 0)
+    debug(1, "Error sending to port %d: %s.", port, strerror(errno));
+}
+
+// answer a timing request from the instance, giving the source's clock as it would be now
+static void answer_timing_request(uint8_t *request, ssize_t length) {
+  if ((length < 32) || ((request[1] & ~0x80) != 0x52) || (source_clock_offset_valid == 0))
+    return;
+  uint8_t reply[32];
+  memcpy(reply, request, 32);
+  reply[1] = 0xd3;
+  memcpy(reply + 8, request + 24, 8); // the originate time is the request's transmit time
+  uint64_t source_time = capture_time_now() + source_clock_offset;
+  uint32_t seconds = htonl(source_time >> 32), fraction = htonl(source_time & 0xffffffff);
+  memcpy(reply + 16, &seconds, 4); // receive time
+  memcpy(reply + 20, &fraction, 4);
+  memcpy(reply + 24, &seconds, 4); // transmit time
+  memcpy(reply + 28, &fraction, 4);
+  send_udp(timing_socket, server_timing_port, reply, sizeof(reply));
+  timing_requests_answered++;
+}
+
+// deal with anything the instance has sent to our UDP ports
+static void service_udp(int timeout_ms) {
+  struct pollfd fds[2];
+  fds[0].fd = timing_socket;
+  fds[1].fd = control_socket;
+  fds[0].events = fds[1].events = POLLIN;
+  if (poll(fds, 2, timeout_ms) <= 0)
+    return;
+  uint8_t packet[2048];
+  ssize_t nread;
+  if (fds[0].revents & POLLIN)
+    while ((nread = recv(timing_socket, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+      answer_timing_request(packet, nread);
+  if (fds[1].revents & POLLIN)
+    while ((nread = recv(control_socket, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+      resend_requests++; // the audio isn't available to resend, so just count them
+}
+
+// wait until the time in the capture given comes around
+static void wait_until(uint64_t capture_time) {
+  uint64_t time_now;
+  while ((time_now = capture_time_now()) < capture_time) {
+    uint64_t wait = ((capture_time - time_now) * 1000) >> 32; // milliseconds, at full speed
+    service_udp((int)(wait / speed) + 1);
+  }
+  if (time_now - capture_time > maximum_lateness)
+    maximum_lateness = time_now - capture_time;
+}
+
+static int get_port(const char *transport, const char *name) {
+  const char *p = strstr(transport, name);
+  if (p == NULL)
+    return 0;
+  return atoi(p + strlen(name));
+}
+
+// replace the number after name in the text with the port given
+static void replace_port(char **text, uint32_t *length, const char *name, int port) {
+  char *p = strstr(*text, name);
+  if (p == NULL)
+    return;
+  p += strlen(name);
+  char *q = p;
+  while ((*q >= '0') && (*q <= '9'))
+    q++;
+  char number[16];
+  int n = snprintf(number, sizeof(number), "%d", port);
+  size_t before = p - *text, after = *length - (q - *text);
+  char *new_text = malloc(before + n + after + 1);
+  if (new_text == NULL)
+    die("Out of memory.");
+  memcpy(new_text, *text, before);
+  memcpy(new_text + before, number, n);
+  memcpy(new_text + before + n, q, after + 1);
+  free(*text);
+  *text = new_text;
+  *length = before + n + after;
+}
+
+// send an RTSP request and wait for the response, which is returned in a malloced string
+static char *rtsp_transact(int fd, char *request, uint32_t length) {
+  if (write(fd, request, length) != length)
+    die("Error sending an RTSP request: %s.", strerror(errno));
+  size_t size = 4096, received = 0;
+  char *response = malloc(size + 1);
+  char *end_of_headers = NULL;
+  size_t content_length = 0;
+  while ((end_of_headers == NULL) || (received < (end_of_headers + 4 - response) + content_length)) {
+    if (received == size) {
+      size *= 2;
+      response = realloc(response, size + 1);
+    }
+    if (response == NULL)
+      die("Out of memory.");
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 10) == 0) { // keep answering timing requests while we wait
+      service_udp(0);
+      continue;
+    }
+    ssize_t nread = read(fd, response + received, size - received);
+    if (nread <= 0)
+      die("The RTSP connection was closed.");
+    received += nread;
+    response[received] = 0;
+    if ((end_of_headers == NULL) && ((end_of_headers = strstr(response, "\r\n\r\n")) != NULL)) {
+      char *cl = strstr(response, "Content-Length: ");
+      if (cl && (cl < end_of_headers))
+        content_length = atoi(cl + strlen("Content-Length: "));
+    }
+  }
+  return response;
+}
+
+static void usage(char *name) {
+  printf("Usage: %s [options] capture-file\n"
+         "Plays a capture file back into a running instance of Shairport Sync.\n"
+         "    -a address      the address of the instance [127.0.0.1*]\n"
+         "    -p port         its RTSP port [5000*]\n"
+         "    -s speed        play back this many times faster than real time [1.0*]\n"
+         "    -v              more debug messages; repeat for more\n"
+         "    *) default option\n"
+         "Sync is only meaningful at a speed of 1.0.\n",
+         name);
+}
+
+int main(int argc, char **argv) {
+  char *address = "127.0.0.1", *port = "5000";
+  int opt;
+  daemon_log_ident = "shairport-sync-replay";
+  while ((opt = getopt(argc, argv, "a:p:s:vh")) > 0) {
+    switch (opt) {
+    case 'a':
+      address = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 's':
+      speed = atof(optarg);
+      break;
+    case 'v':
+      debuglev++;
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if ((optind != argc - 1) || (speed <= 0)) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  if (f == NULL)
+    die("Can't open \"%s\": %s.", argv[optind], strerror(errno));
+  char magic[8];
+  if ((fread(magic, 8, 1, f) != 1) || (memcmp(magic, capture_magic, 8) != 0))
+    die("\"%s\" is not a capture file.", argv[optind]);
+
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int ret = getaddrinfo(address, port, &hints, &info);
+  if (ret != 0)
+    die("Can't find \"%s\": %s.", address, gai_strerror(ret));
+  int rtsp_fd = socket(info->ai_family, SOCK_STREAM, IPPROTO_TCP);
+  if ((rtsp_fd < 0) || (connect(rtsp_fd, info->ai_addr, info->ai_addrlen) != 0))
+    die("Can't connect to %s port %s: %s.", address, port, strerror(errno));
+  memcpy(&server_address, info->ai_addr, info->ai_addrlen);
+  server_address_length = info->ai_addrlen;
+  control_socket = bind_udp(info->ai_family, &control_port);
+  timing_socket = bind_udp(info->ai_family, &timing_port);
+  freeaddrinfo(info);
+
+  capture_kind kind;
+  uint64_t time;
+  uint8_t *data = NULL;
+  uint32_t length;
+  int first = 1;
+  while (capture_read_record(f, &kind, &time, &data, &length) == 0) {
+    if (first) {
+      capture_start_time = time;
+      replay_start_time = get_absolute_time_in_fp();
+      first = 0;
+    }
+    wait_until(time);
+    switch (kind) {
+    case capture_rtsp_request: {
+      char *request = strdup((char *)data);
+      uint32_t request_length = length;
+      int is_setup = (strncmp(request, "SETUP ", 6) == 0);
+      if (is_setup) {
+        replace_port(&request, &request_length, "control_port=", control_port);
+        replace_port(&request, &request_length, "timing_port=", timing_port);
+      }
+      debug(1, "Sending %.*s request.", (int)strcspn(request, " "), request);
+      char *response = rtsp_transact(rtsp_fd, request, request_length);
+      if (strncmp(response, "RTSP/1.0 200", 12) != 0)
+        warn("Request \"%.*s\" got the response \"%.*s\".", (int)strcspn(request, "\r"), request,
+             (int)strcspn(response, "\r"), response);
+      if (is_setup) {
+        char *transport = strstr(response, "Transport: ");
+        if (transport) {
+          server_audio_port = get_port(transport, "server_port=");
+          server_control_port = get_port(transport, "control_port=");
+          server_timing_port = get_port(transport, "timing_port=");
+          debug(1, "Sending audio, control and timing to ports %d, %d and %d.", server_audio_port,
+                server_control_port, server_timing_port);
+        }
+      }
+      free(response);
+      free(request);
+      rtsp_requests++;
+    } break;
+    case capture_rtp_audio:
+      if (server_audio_port) {
+        send_udp(control_socket, server_audio_port, data, length);
+        audio_packets++;
+      } else {
+        packets_skipped++;
+      }
+      break;
+    case capture_rtp_control:
+      if (server_control_port) {
+        send_udp(control_socket, server_control_port, data, length);
+        control_packets++;
+      } else {
+        packets_skipped++;
+      }
+      break;
+    case capture_rtp_timing:
+      if ((length >= 32) && (data[1] == 0xd3)) {
+        uint64_t source_time = ((uint64_t)ntohl(*(uint32_t *)(data + 24)) << 32) +
+                               ntohl(*(uint32_t *)(data + 28));
+        source_clock_offset = source_time - time;
+        source_clock_offset_valid = 1;
+      }
+      break;
+    default:
+      debug(1, "Unknown record of kind %d skipped.", kind);
+      break;
+    }
+  }
+  fclose(f);
+  free(data);
+  close(rtsp_fd);
+
+  double duration = ((get_absolute_time_in_fp() - replay_start_time) * 1.0) / ((uint64_t)1 << 32);
+  printf("Replayed %" PRIu64 " RTSP requests, %" PRIu64 " audio packets and %" PRIu64
+         " control packets in %.1f seconds; %" PRIu64 " packets skipped.\n",
+         rtsp_requests, audio_packets, control_packets, duration, packets_skipped);
+  printf("Answered %" PRIu64 " timing requests; ignored %" PRIu64
+         " resend requests. Maximum lateness %.1f ms.\n",
+         timing_requests_answered, resend_requests, (maximum_lateness * 1000.0) / ((uint64_t)1 << 32));
+  return 0;
+}
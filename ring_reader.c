@@ -0,0 +1,137 @@
+/*
+ * A reader for the shared memory ring of metadata. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libdaemon/dlog.h>
+
+#include "common.h"
+#include "metadata_ring.h"
+
+// die() calls this
+void shairport_shutdown() {}
+
+static void usage(char *name) {
+  printf("Usage: %s [options] ring-name\n"
+         "Follows the metadata that a running instance of Shairport Sync publishes to a shared "
+         "memory ring.\n"
+         "    -o              start from the oldest item in the ring, rather than the next one\n"
+         "    -d delay        pause for this many milliseconds after each item, to act as a slow "
+         "reader\n"
+         "    -q              don't print the items, just the items lost and a summary\n"
+         "    -v              more debug messages; repeat for more\n"
+         "The ring name is the metadata shm_name setting, e.g. /shairport-sync-metadata.\n",
+         name);
+}
+
+static void print_code(uint32_t code) {
+  int i;
+  for (i = 3; i >= 0; i--) {
+    char c = (code >> (i * 8)) & 0xff;
+    putchar(isprint((unsigned char)c) ? c : '.');
+  }
+}
+
+int main(int argc, char **argv) {
+  int from_oldest = 0, delay = 0, quiet = 0;
+  int opt;
+  daemon_log_ident = "shairport-sync-ring-reader";
+  while ((opt = getopt(argc, argv, "od:qvh")) > 0) {
+    switch (opt) {
+    case 'o':
+      from_oldest = 1;
+      break;
+    case 'd':
+      delay = atoi(optarg);
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    case 'v':
+      debuglev++;
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if ((optind != argc - 1) || (delay < 0)) {
+    usage(argv[0]);
+    exit(1);
+  }
+  char *name = argv[optind];
+
+  metadata_ring_reader reader;
+  if (metadata_ring_attach(&reader, name, from_oldest) != 0)
+    die("Can't attach to the metadata ring \"%s\": %s.", name, strerror(errno));
+
+  metadata_ring_record record;
+  char *data = NULL;
+  size_t data_size = 0;
+  uint64_t items = 0, bytes = 0, lost_items = 0;
+  while (1) {
+    uint32_t lost;
+    if (metadata_ring_read(&reader, &record, &data, &data_size, 1000, &lost) == 0) {
+      if (quiet)
+        printf("%" PRIu64 " items, %" PRIu64 " bytes read; %" PRIu64 " items lost.\n", items,
+               bytes, lost_items);
+      fflush(stdout);
+      continue;
+    }
+    if (lost) {
+      lost_items += lost;
+      printf("%" PRIu32 " items lost before item %" PRIu32 ".\n", lost, record.sequence);
+      fflush(stdout);
+    }
+    items++;
+    bytes += record.length;
+    if (quiet == 0) {
+      printf("%" PRIu32 " ", record.sequence);
+      print_code(record.type);
+      putchar(' ');
+      print_code(record.code);
+      printf(" %" PRIu32, record.length);
+      // show short text items, such as titles
+      uint32_t i;
+      int text = (record.length > 0) && (record.length <= 64);
+      for (i = 0; text && (i < record.length); i++)
+        if (!isprint((unsigned char)data[i]))
+          text = 0;
+      if (text)
+        printf(" \"%.*s\"", (int)record.length, data);
+      putchar('\n');
+      fflush(stdout);
+    }
+    if (delay)
+      usleep(delay * 1000);
+  }
+}
@@ -24,6 +24,11 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include "config.h"
+#ifdef HAVE_RECVMMSG
+#define _GNU_SOURCE // for recvmmsg()
+#endif
+
 #include <time.h>
 #include <pthread.h>
 #include <signal.h>
@@ -35,11 +40,16 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <poll.h>
 
 #include "common.h"
 #include "player.h"
 #include "rtp.h"
+#include "timeline.h"
+#include "capture.h"
 
 typedef struct {
   uint32_t seconds;
@@ -66,11 +76,13 @@ static SOCKADDR rtp_client_timing_socket;  // a socket pointing to the timing po
 static int audio_socket;                   // our local [server] audio socket
 static int control_socket;                 // our local [server] control socket
 static int timing_socket;                  // local timing socket
-static pthread_t rtp_audio_thread, rtp_control_thread, rtp_timing_thread;
+static pthread_t rtp_thread;
+static notifier shutdown_notifier;         // used to wake up rtp_thread when it's time to stop
 
 static uint32_t reference_timestamp;
 static uint64_t reference_timestamp_time;
 static uint64_t remote_reference_timestamp_time;
+static rtp_timeline timeline; // a fit of the source's clock against the sync packets' timestamps
 
 // debug variables
 static int request_sent;
@@ -90,162 +102,219 @@ static pthread_mutex_t reference_time_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 uint64_t static local_to_remote_time_difference; // used to switch between local and remote clocks
 
-static void *rtp_audio_receiver(void *arg) {
-  // we inherit the signal mask (SIGUSR1)
+// if the packet is audio, fill in the details and return 1, otherwise return 0
+static int parse_audio_packet(uint8_t *packet, ssize_t nread, rtp_audio_packet *audio_packet,
+                              int32_t *last_seqno) {
+  uint8_t *pktp;
+  ssize_t plen = nread;
+  uint8_t type = packet[1] & ~0x80;
+  if (type == 0x60 || type == 0x56) { // audio data / resend
+    pktp = packet;
+    if (type == 0x56) {
+      pktp += 4;
+      plen -= 4;
+    }
+    seq_t seqno = ntohs(*(unsigned short *)(pktp + 2));
+    // increment last_seqno and see if it's the same as the incoming seqno
+
+    if (*last_seqno == -1)
+      *last_seqno = seqno;
+    else {
+      *last_seqno = (*last_seqno + 1) & 0xffff;
+      if (seqno != *last_seqno)
+        debug(2, "RTP: Packets out of sequence: expected: %d, got %d.", *last_seqno, seqno);
+      *last_seqno = seqno; // reset warning...
+    }
+    uint32_t timestamp = ntohl(*(unsigned long *)(pktp + 4));
 
-  int32_t last_seqno = -1;
-  uint8_t packet[2048], *pktp;
+    // if (packet[1]&0x10)
+    //	debug(1,"Audio packet Extension bit set.");
 
-  ssize_t nread;
-  while (1) {
-    if (please_shutdown)
-      break;
-    nread = recv(audio_socket, packet, sizeof(packet), 0);
-    if (nread < 0)
-      break;
+    pktp += 12;
+    plen -= 12;
 
-    ssize_t plen = nread;
-    uint8_t type = packet[1] & ~0x80;
-    if (type == 0x60 || type == 0x56) { // audio data / resend
-      pktp = packet;
-      if (type == 0x56) {
-        pktp += 4;
-        plen -= 4;
-      }
-      seq_t seqno = ntohs(*(unsigned short *)(pktp + 2));
-      // increment last_seqno and see if it's the same as the incoming seqno
-
-      if (last_seqno == -1)
-        last_seqno = seqno;
-      else {
-        last_seqno = (last_seqno + 1) & 0xffff;
-        if (seqno != last_seqno)
-          debug(2, "RTP: Packets out of sequence: expected: %d, got %d.", last_seqno, seqno);
-        last_seqno = seqno; // reset warning...
-      }
-      uint32_t timestamp = ntohl(*(unsigned long *)(pktp + 4));
+    // check if packet contains enough content to be reasonable
+    if (plen >= 16) {
+      audio_packet->seqno = seqno;
+      audio_packet->timestamp = timestamp;
+      audio_packet->data = pktp;
+      audio_packet->len = plen;
+      return 1;
+    }
+    if (type == 0x56 && seqno == 0) {
+      debug(2, "resend-related request packet received, ignoring.");
+      return 0;
+    }
+    debug(1, "Audio receiver -- Unknown RTP packet of type 0x%02X length %d seqno %d", type, nread,
+          seqno);
+  }
+  warn("Audio receiver -- Unknown RTP packet of type 0x%02X length %d.", type, nread);
+  return 0;
+}
 
-      // if (packet[1]&0x10)
-      //	debug(1,"Audio packet Extension bit set.");
+// the number of packets the audio receiver can take in at a time
+#ifdef HAVE_RECVMMSG
+#define audio_batch_size 32
+#else
+#define audio_batch_size 1
+#endif
 
-      pktp += 12;
-      plen -= 12;
+// packets are received straight into a pool and are passed on to the player from there
+static uint8_t *audio_packet_pool;
+static rtp_audio_packet *audio_packets;
+static int32_t last_seqno;
+#ifdef HAVE_RECVMMSG
+static struct mmsghdr audio_messages[audio_batch_size];
+static struct iovec audio_iovecs[audio_batch_size];
+#endif
 
-      // check if packet contains enough content to be reasonable
-      if (plen >= 16) {
-        player_put_packet(seqno, timestamp, pktp, plen);
-        continue;
-      }
-      if (type == 0x56 && seqno == 0) {
-        debug(2, "resend-related request packet received, ignoring.");
-        continue;
-      }
-      debug(1, "Audio receiver -- Unknown RTP packet of type 0x%02X length %d seqno %d", type,
-            nread, seqno);
-    }
-    warn("Audio receiver -- Unknown RTP packet of type 0x%02X length %d.", type, nread);
+static void audio_receiver_init(void) {
+  audio_packet_pool = malloc(audio_batch_size * 2048);
+  audio_packets = malloc(audio_batch_size * sizeof(rtp_audio_packet));
+  if ((audio_packet_pool == NULL) || (audio_packets == NULL))
+    die("Can't allocate the audio receiver's packet pool.");
+#ifdef HAVE_RECVMMSG
+  int i;
+  memset(audio_messages, 0, sizeof(audio_messages));
+  for (i = 0; i < audio_batch_size; i++) {
+    audio_iovecs[i].iov_base = audio_packet_pool + i * 2048;
+    audio_iovecs[i].iov_len = 2048;
+    audio_messages[i].msg_hdr.msg_iov = &audio_iovecs[i];
+    audio_messages[i].msg_hdr.msg_iovlen = 1;
   }
+#endif
+  last_seqno = -1;
+}
 
-  debug(1, "Audio receiver -- Server RTP thread interrupted. terminating.");
-  close(audio_socket);
+static void audio_receiver_free(void) {
+  free(audio_packets);
+  free(audio_packet_pool);
+}
 
-  return NULL;
+// take in whatever audio packets are waiting, up to a batch's worth
+static void receive_audio_packets(void) {
+  int i, received, count;
+#ifdef HAVE_RECVMMSG
+  received = recvmmsg(audio_socket, audio_messages, audio_batch_size, MSG_DONTWAIT, NULL);
+#else
+  ssize_t nread = recv(audio_socket, audio_packet_pool, 2048, MSG_DONTWAIT);
+  received = nread < 0 ? -1 : 1;
+#endif
+  if (received < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+      debug(1, "Audio receiver -- error receiving: %s.", strerror(errno));
+    return;
+  }
+
+  uint64_t time_of_receipt = capturing() ? get_absolute_time_in_fp() : 0;
+  count = 0;
+  for (i = 0; i < received; i++) {
+#ifdef HAVE_RECVMMSG
+    ssize_t nread = audio_messages[i].msg_len;
+#endif
+    if (time_of_receipt)
+      capture_record(capture_rtp_audio, time_of_receipt, audio_packet_pool + i * 2048, nread);
+    if (parse_audio_packet(audio_packet_pool + i * 2048, nread, &audio_packets[count],
+                           &last_seqno))
+      count++;
+  }
+  if (count == 1)
+    player_put_packet(audio_packets[0].seqno, audio_packets[0].timestamp, audio_packets[0].data,
+                      audio_packets[0].len);
+  else if (count > 1)
+    player_put_packets(audio_packets, count);
 }
 
-static void *rtp_control_receiver(void *arg) {
-  // we inherit the signal mask (SIGUSR1)
-  reference_timestamp = 0; // nothing valid received yet
+static void receive_control_packet(void) {
   uint8_t packet[2048], *pktp;
-  struct timespec tn;
   uint64_t remote_time_of_sync, local_time_now, remote_time_now;
   uint32_t sync_rtp_timestamp, rtp_timestamp_less_latency;
   ssize_t nread;
-  while (1) {
-    if (please_shutdown)
-      break;
-    nread = recv(control_socket, packet, sizeof(packet), 0);
-    local_time_now = get_absolute_time_in_fp();
-    //        clock_gettime(CLOCK_MONOTONIC,&tn);
-    //        local_time_now=((uint64_t)tn.tv_sec<<32)+((uint64_t)tn.tv_nsec<<32)/1000000000;
-
-    if (nread < 0)
-      break;
-
-    ssize_t plen = nread;
-    if (packet[1] == 0xd4) { // sync data
-      /*
-      char obf[4096];
-      char *obfp = obf;
-      int obfc;
-      for (obfc=0;obfc<plen;obfc++) {
-        sprintf(obfp,"%02X",packet[obfc]);
-        obfp+=2;
-      };
-      *obfp=0;
-      debug(1,"Sync Packet Received: \"%s\"",obf);
-      */
-      if (local_to_remote_time_difference) { // need a time packet to be interchanged first...
-
-        remote_time_of_sync = (uint64_t)ntohl(*((uint32_t *)&packet[8])) << 32;
-        remote_time_of_sync += ntohl(*((uint32_t *)&packet[12]));
-
-        // debug(1,"Remote Sync Time: %0llx.",remote_time_of_sync);
-
-        rtp_timestamp_less_latency = ntohl(*((uint32_t *)&packet[4]));
-        sync_rtp_timestamp = ntohl(*((uint32_t *)&packet[16]));
-
-        if (packet[0] & 0x10) {
-          // if it's a packet right after a flush or resume
-          sync_rtp_timestamp += 352; // add frame_size -- can't see a reference to this anywhere,
-                                     // but it seems to get everything into sync.
-          // it's as if the first sync after a flush or resume is the timing of the next packet
-          // after the one whose RTP is given. Weird.
-        }
-        pthread_mutex_lock(&reference_time_mutex);
-        remote_reference_timestamp_time = remote_time_of_sync;
-        reference_timestamp_time = remote_time_of_sync - local_to_remote_time_difference;
-        reference_timestamp = sync_rtp_timestamp;
-        pthread_mutex_unlock(&reference_time_mutex);
-        // debug(1,"New Reference timestamp and timestamp time...");
-        // get estimated remote time now
-        // remote_time_now = local_time_now + local_to_remote_time_difference;
-
-        // debug(1,"Sync Time is %lld us late (remote
-        // times).",((remote_time_now-remote_time_of_sync)*1000000)>>32);
-        // debug(1,"Sync Time is %lld us late (local
-        // times).",((local_time_now-reference_timestamp_time)*1000000)>>32);
-      } else {
-        debug(1, "Sync packet received before we got a timing packet back.");
+  nread = recv(control_socket, packet, sizeof(packet), MSG_DONTWAIT);
+  local_time_now = get_absolute_time_in_fp();
+  //        clock_gettime(CLOCK_MONOTONIC,&tn);
+  //        local_time_now=((uint64_t)tn.tv_sec<<32)+((uint64_t)tn.tv_nsec<<32)/1000000000;
+
+  if (nread < 0)
+    return;
+  if (capturing())
+    capture_record(capture_rtp_control, local_time_now, packet, nread);
+
+  ssize_t plen = nread;
+  if (packet[1] == 0xd4) { // sync data
+    /*
+    char obf[4096];
+    char *obfp = obf;
+    int obfc;
+    for (obfc=0;obfc<plen;obfc++) {
+      sprintf(obfp,"%02X",packet[obfc]);
+      obfp+=2;
+    };
+    *obfp=0;
+    debug(1,"Sync Packet Received: \"%s\"",obf);
+    */
+    if (local_to_remote_time_difference) { // need a time packet to be interchanged first...
+
+      remote_time_of_sync = (uint64_t)ntohl(*((uint32_t *)&packet[8])) << 32;
+      remote_time_of_sync += ntohl(*((uint32_t *)&packet[12]));
+
+      // debug(1,"Remote Sync Time: %0llx.",remote_time_of_sync);
+
+      rtp_timestamp_less_latency = ntohl(*((uint32_t *)&packet[4]));
+      sync_rtp_timestamp = ntohl(*((uint32_t *)&packet[16]));
+
+      if (packet[0] & 0x10) {
+        // if it's a packet right after a flush or resume
+        sync_rtp_timestamp += 352; // add frame_size -- can't see a reference to this anywhere,
+                                   // but it seems to get everything into sync.
+        // it's as if the first sync after a flush or resume is the timing of the next packet
+        // after the one whose RTP is given. Weird.
       }
-    } else if (packet[1] == 0xd6) { // resent audio data in the control path -- whaale only?
-      // debug(1, "Control Port -- Retransmitted Audio Data Packet received.");
-      pktp = packet+4;
-      plen -= 4;
-      seq_t seqno = ntohs(*(unsigned short *)(pktp + 2));
+      pthread_mutex_lock(&reference_time_mutex);
+      if (packet[0] & 0x10)
+        timeline_reset(&timeline); // a new play segment means a new timeline
+      timeline_add_sync(&timeline, sync_rtp_timestamp, remote_time_of_sync);
+      // use the fitted time rather than the time in the packet
+      remote_reference_timestamp_time = timeline_remote_time(&timeline, sync_rtp_timestamp);
+      reference_timestamp_time =
+          remote_reference_timestamp_time - local_to_remote_time_difference;
+      reference_timestamp = sync_rtp_timestamp;
+      pthread_mutex_unlock(&reference_time_mutex);
+      // debug(1,"New Reference timestamp and timestamp time...");
+      // get estimated remote time now
+      // remote_time_now = local_time_now + local_to_remote_time_difference;
+
+      // debug(1,"Sync Time is %lld us late (remote
+      // times).",((remote_time_now-remote_time_of_sync)*1000000)>>32);
+      // debug(1,"Sync Time is %lld us late (local
+      // times).",((local_time_now-reference_timestamp_time)*1000000)>>32);
+    } else {
+      debug(1, "Sync packet received before we got a timing packet back.");
+    }
+  } else if (packet[1] == 0xd6) { // resent audio data in the control path -- whaale only?
+    // debug(1, "Control Port -- Retransmitted Audio Data Packet received.");
+    pktp = packet+4;
+    plen -= 4;
+    seq_t seqno = ntohs(*(unsigned short *)(pktp + 2));
 
-      uint32_t timestamp = ntohl(*(unsigned long *)(pktp + 4));
+    uint32_t timestamp = ntohl(*(unsigned long *)(pktp + 4));
 
-      pktp += 12;
-      plen -= 12;
+    pktp += 12;
+    plen -= 12;
 
-      // check if packet contains enough content to be reasonable
-      if (plen >= 16) {
-        player_put_packet(seqno, timestamp, pktp, plen);
-        continue;
-      } else {
-        debug(1, "Too-short retransmitted audio packet received in control port, ignored.");
-      }
-    } else
-      debug(1, "Control Port -- Unknown RTP packet of type 0x%02X length %d.", packet[1], nread);
-  }
-
-  debug(1, "Control RTP thread interrupted. terminating.");
-  close(control_socket);
-
-  return NULL;
+    // check if packet contains enough content to be reasonable
+    if (plen >= 16) {
+      player_put_packet(seqno, timestamp, pktp, plen);
+    } else {
+      debug(1, "Too-short retransmitted audio packet received in control port, ignored.");
+    }
+  } else
+    debug(1, "Control Port -- Unknown RTP packet of type 0x%02X length %d.", packet[1], nread);
 }
 
-static void *rtp_timing_sender(void *arg) {
+static uint64_t timing_requests_sent;
+
+static void send_timing_request(void) {
   struct timing_request {
     char leader;
     char type;
@@ -254,8 +323,6 @@ static void *rtp_timing_sender(void *arg) {
     uint64_t origin, receive, transmit;
   };
 
-  uint64_t request_number = 0;
-
   struct timing_request req; // *not* a standard RTCP NACK
 
   req.leader = 0x80;
@@ -263,275 +330,313 @@ static void *rtp_timing_sender(void *arg) {
   req.filler = 0;
   req.seqno = htons(7);
 
-  time_ping_count = 0;
+  // debug(1, "Requesting ntp timestamp exchange.");
 
-  // we inherit the signal mask (SIGUSR1)
-  while (1) {
-    if (please_shutdown)
-      break;
+  req.origin = req.receive = req.transmit = 0;
 
-    if (!running)
-      die("rtp_timing_sender called without active stream!");
-
-    // debug(1, "Requesting ntp timestamp exchange.");
-
-    req.filler = 0;
-    req.origin = req.receive = req.transmit = 0;
-
-    //    clock_gettime(CLOCK_MONOTONIC,&dtt);
-    departure_time = get_absolute_time_in_fp();
-    socklen_t msgsize = sizeof(struct sockaddr_in);
+  //    clock_gettime(CLOCK_MONOTONIC,&dtt);
+  departure_time = get_absolute_time_in_fp();
+  socklen_t msgsize = sizeof(struct sockaddr_in);
 #ifdef AF_INET6
-    if (rtp_client_timing_socket.SAFAMILY == AF_INET6) {
-      msgsize = sizeof(struct sockaddr_in6);
-    }
+  if (rtp_client_timing_socket.SAFAMILY == AF_INET6) {
+    msgsize = sizeof(struct sockaddr_in6);
+  }
 #endif
-    if (sendto(timing_socket, &req, sizeof(req), 0, (struct sockaddr *)&rtp_client_timing_socket,
-               msgsize) == -1) {
-      perror("Error sendto-ing to timing socket");
-    }
-    request_number++;
-    if (request_number <= 4)
-      usleep(500000);
-    else
-      sleep(3);
+  if (sendto(timing_socket, &req, sizeof(req), 0, (struct sockaddr *)&rtp_client_timing_socket,
+             msgsize) == -1) {
+    perror("Error sendto-ing to timing socket");
   }
-  debug(1, "rtp_timing_sender thread interrupted. terminating.");
-  return NULL;
+  timing_requests_sent++;
+}
+
+// the first few timing requests go out every half second, then every three seconds
+static uint64_t timing_request_interval(void) {
+  if (timing_requests_sent <= 4)
+    return (uint64_t)1 << 31;
+  else
+    return (uint64_t)3 << 32;
+}
+
+static uint64_t first_remote_time, first_local_time;
+static uint64_t first_local_to_remote_time_difference;
+static uint64_t first_local_to_remote_time_difference_time;
+
+static void timing_receiver_init(void) {
+  local_to_remote_time_jitters = 0;
+  local_to_remote_time_jitters_count = 0;
+  first_remote_time = 0;
+  first_local_time = 0;
+  first_local_to_remote_time_difference = 0;
+  time_ping_count = 0;
+  timing_requests_sent = 0;
 }
 
-static void *rtp_timing_receiver(void *arg) {
-  // we inherit the signal mask (SIGUSR1)
+static void receive_timing_packet(void) {
   uint8_t packet[2048], *pktp;
   ssize_t nread;
-  pthread_t timer_requester;
-  pthread_create(&timer_requester, NULL, &rtp_timing_sender, NULL);
   //    struct timespec att;
   uint64_t distant_receive_time, distant_transmit_time, arrival_time, return_time, transit_time,
       processing_time;
-  local_to_remote_time_jitters = 0;
-  local_to_remote_time_jitters_count = 0;
-  uint64_t first_remote_time = 0;
-  uint64_t first_local_time = 0;
-  
-  uint64_t first_local_to_remote_time_difference = 0;
-  uint64_t first_local_to_remote_time_difference_time;
-  uint64_t l2rtd = 0;
-  while (1) {
-    if (please_shutdown)
-      break;
-    nread = recv(timing_socket, packet, sizeof(packet), 0);
-    arrival_time = get_absolute_time_in_fp();
-    //      clock_gettime(CLOCK_MONOTONIC,&att);
-
-    if (nread < 0)
-      break;
-
-    ssize_t plen = nread;
-    // debug(1,"Packet Received on Timing Port.");
-    if (packet[1] == 0xd3) { // timing reply
-      /*
-      char obf[4096];
-      char *obfp = obf;
-      int obfc;
-      for (obfc=0;obfc<plen;obfc++) {
-        sprintf(obfp,"%02X",packet[obfc]);
-        obfp+=2;
-      };
-      *obfp=0;
-      //debug(1,"Timing Packet Received: \"%s\"",obf);
-      */
-
-      // arrival_time = ((uint64_t)att.tv_sec<<32)+((uint64_t)att.tv_nsec<<32)/1000000000;
-      // departure_time = ((uint64_t)dtt.tv_sec<<32)+((uint64_t)dtt.tv_nsec<<32)/1000000000;
-
-      return_time = arrival_time - departure_time;
-
-      // uint64_t rtus = (return_time*1000000)>>32; debug(1,"Time ping turnaround time: %lld
-      // us.",rtus);
-
-      // distant_receive_time =
-      // ((uint64_t)ntohl(*((uint32_t*)&packet[16])))<<32+ntohl(*((uint32_t*)&packet[20]));
-
-      distant_receive_time = (uint64_t)ntohl(*((uint32_t *)&packet[16])) << 32;
-      distant_receive_time += ntohl(*((uint32_t *)&packet[20]));
-
-      // distant_transmit_time =
-      // ((uint64_t)ntohl(*((uint32_t*)&packet[24])))<<32+ntohl(*((uint32_t*)&packet[28]));
-
-      distant_transmit_time = (uint64_t)ntohl(*((uint32_t *)&packet[24])) << 32;
-      distant_transmit_time += ntohl(*((uint32_t *)&packet[28]));
-
-      processing_time = distant_transmit_time - distant_receive_time;
-
-      // debug(1,"Return trip time: %lluuS, remote processing time:
-      // %lluuS.",(return_time*1000000)>>32,(processing_time*1000000)>>32);
-
-      uint64_t local_time_by_remote_clock = distant_transmit_time + return_time / 2;
-
-      unsigned int cc;
-      for (cc = time_ping_history - 1; cc > 0; cc--) {
-        time_pings[cc] = time_pings[cc - 1];
-        time_pings[cc].dispersion = (time_pings[cc].dispersion * 133) /
-                                    100; // make the dispersions 'age' by this rational factor
-      }
-      // these are for diagnostics only -- not used
-      time_pings[0].local_time = arrival_time;
-      time_pings[0].remote_time = distant_transmit_time;
-      
-      time_pings[0].local_to_remote_difference = local_time_by_remote_clock - arrival_time;
-      time_pings[0].dispersion = return_time;
-      if (time_ping_count < time_ping_history)
-        time_ping_count++;
-      
-      uint64_t local_time_chosen = arrival_time;;
-      uint64_t remote_time_chosen = distant_transmit_time;
-      // now pick the timestamp with the lowest dispersion
-      uint64_t l2rtd = time_pings[0].local_to_remote_difference;
-      uint64_t tld = time_pings[0].dispersion;
-      for (cc = 1; cc < time_ping_count; cc++)
-        if (time_pings[cc].dispersion < tld) {
-          l2rtd = time_pings[cc].local_to_remote_difference;
-          tld = time_pings[cc].dispersion;
-          local_time_chosen = time_pings[cc].local_time;
-          remote_time_chosen = time_pings[cc].remote_time;
-        }
-      int64_t ji;
-
-      if (time_ping_count > 1) {
-        if (l2rtd > local_to_remote_time_difference) {
-          local_to_remote_time_jitters =
-              local_to_remote_time_jitters + l2rtd - local_to_remote_time_difference;
-          ji = l2rtd - local_to_remote_time_difference;
-        } else {
-          local_to_remote_time_jitters =
-              local_to_remote_time_jitters + local_to_remote_time_difference - l2rtd;
-          ji = -(local_to_remote_time_difference - l2rtd);
-        }
-        local_to_remote_time_jitters_count += 1;
-      }
-      // uncomment below to print jitter between client's clock and oour clock
-      // int64_t rtus = (tld*1000000)>>32; ji = (ji*1000000)>>32; debug(1,"Choosing time difference
-      // with dispersion of %lld us with delta of %lld us",rtus,ji);
-
-      local_to_remote_time_difference = l2rtd;
-      if (first_local_to_remote_time_difference==0) {
-        first_local_to_remote_time_difference = local_to_remote_time_difference;
-        first_local_to_remote_time_difference_time = get_absolute_time_in_fp();
+  nread = recv(timing_socket, packet, sizeof(packet), MSG_DONTWAIT);
+  arrival_time = get_absolute_time_in_fp();
+  //      clock_gettime(CLOCK_MONOTONIC,&att);
+
+  if (nread < 0)
+    return;
+  if (capturing())
+    capture_record(capture_rtp_timing, arrival_time, packet, nread);
+
+  ssize_t plen = nread;
+  // debug(1,"Packet Received on Timing Port.");
+  if (packet[1] == 0xd3) { // timing reply
+    /*
+    char obf[4096];
+    char *obfp = obf;
+    int obfc;
+    for (obfc=0;obfc<plen;obfc++) {
+      sprintf(obfp,"%02X",packet[obfc]);
+      obfp+=2;
+    };
+    *obfp=0;
+    //debug(1,"Timing Packet Received: \"%s\"",obf);
+    */
+
+    // arrival_time = ((uint64_t)att.tv_sec<<32)+((uint64_t)att.tv_nsec<<32)/1000000000;
+    // departure_time = ((uint64_t)dtt.tv_sec<<32)+((uint64_t)dtt.tv_nsec<<32)/1000000000;
+
+    return_time = arrival_time - departure_time;
+
+    // uint64_t rtus = (return_time*1000000)>>32; debug(1,"Time ping turnaround time: %lld
+    // us.",rtus);
+
+    // distant_receive_time =
+    // ((uint64_t)ntohl(*((uint32_t*)&packet[16])))<<32+ntohl(*((uint32_t*)&packet[20]));
+
+    distant_receive_time = (uint64_t)ntohl(*((uint32_t *)&packet[16])) << 32;
+    distant_receive_time += ntohl(*((uint32_t *)&packet[20]));
+
+    // distant_transmit_time =
+    // ((uint64_t)ntohl(*((uint32_t*)&packet[24])))<<32+ntohl(*((uint32_t*)&packet[28]));
+
+    distant_transmit_time = (uint64_t)ntohl(*((uint32_t *)&packet[24])) << 32;
+    distant_transmit_time += ntohl(*((uint32_t *)&packet[28]));
+
+    processing_time = distant_transmit_time - distant_receive_time;
+
+    // debug(1,"Return trip time: %lluuS, remote processing time:
+    // %lluuS.",(return_time*1000000)>>32,(processing_time*1000000)>>32);
+
+    uint64_t local_time_by_remote_clock = distant_transmit_time + return_time / 2;
+
+    unsigned int cc;
+    for (cc = time_ping_history - 1; cc > 0; cc--) {
+      time_pings[cc] = time_pings[cc - 1];
+      time_pings[cc].dispersion = (time_pings[cc].dispersion * 133) /
+                                  100; // make the dispersions 'age' by this rational factor
+    }
+    // these are for diagnostics only -- not used
+    time_pings[0].local_time = arrival_time;
+    time_pings[0].remote_time = distant_transmit_time;
+    
+    time_pings[0].local_to_remote_difference = local_time_by_remote_clock - arrival_time;
+    time_pings[0].dispersion = return_time;
+    if (time_ping_count < time_ping_history)
+      time_ping_count++;
+    
+    uint64_t local_time_chosen = arrival_time;;
+    uint64_t remote_time_chosen = distant_transmit_time;
+    // now pick the timestamp with the lowest dispersion
+    uint64_t l2rtd = time_pings[0].local_to_remote_difference;
+    uint64_t tld = time_pings[0].dispersion;
+    for (cc = 1; cc < time_ping_count; cc++)
+      if (time_pings[cc].dispersion < tld) {
+        l2rtd = time_pings[cc].local_to_remote_difference;
+        tld = time_pings[cc].dispersion;
+        local_time_chosen = time_pings[cc].local_time;
+        remote_time_chosen = time_pings[cc].remote_time;
       }
-      
-      int64_t clock_drift, clock_drift_in_usec;
-      if (first_local_time==0) {
-        first_local_time = local_time_chosen;
-        first_remote_time = remote_time_chosen;
-        uint64_t clock_drift = 0;
+    int64_t ji;
+
+    if (time_ping_count > 1) {
+      if (l2rtd > local_to_remote_time_difference) {
+        local_to_remote_time_jitters =
+            local_to_remote_time_jitters + l2rtd - local_to_remote_time_difference;
+        ji = l2rtd - local_to_remote_time_difference;
       } else {
-        uint64_t local_time_change = local_time_chosen - first_local_time;
-        uint64_t remote_time_change = remote_time_chosen - first_remote_time;
-        
-
-        if (remote_time_change >= local_time_change)
-          clock_drift = remote_time_change - local_time_change;
-        else
-          clock_drift = -(local_time_change - remote_time_change);
+        local_to_remote_time_jitters =
+            local_to_remote_time_jitters + local_to_remote_time_difference - l2rtd;
+        ji = -(local_to_remote_time_difference - l2rtd);
       }
-      if (clock_drift>=0)
-        clock_drift_in_usec = (clock_drift * 1000000)>>32;
-      else
-        clock_drift_in_usec = -(((-clock_drift) * 1000000)>>32);
-      
+      local_to_remote_time_jitters_count += 1;
+    }
+    // uncomment below to print jitter between client's clock and oour clock
+    // int64_t rtus = (tld*1000000)>>32; ji = (ji*1000000)>>32; debug(1,"Choosing time difference
+    // with dispersion of %lld us with delta of %lld us",rtus,ji);
+
+    local_to_remote_time_difference = l2rtd;
+    if (first_local_to_remote_time_difference==0) {
+      first_local_to_remote_time_difference = local_to_remote_time_difference;
+      first_local_to_remote_time_difference_time = get_absolute_time_in_fp();
+    }
+    
+    int64_t clock_drift, clock_drift_in_usec;
+    if (first_local_time==0) {
+      first_local_time = local_time_chosen;
+      first_remote_time = remote_time_chosen;
+      uint64_t clock_drift = 0;
+    } else {
+      uint64_t local_time_change = local_time_chosen - first_local_time;
+      uint64_t remote_time_change = remote_time_chosen - first_remote_time;
       
-     
-     int64_t source_drift_usec;
-     if (play_segment_reference_frame!=0) {
-      uint32_t reference_timestamp;
-      uint64_t reference_timestamp_time,remote_reference_timestamp_time;
-      get_reference_timestamp_stuff(&reference_timestamp, &reference_timestamp_time, &remote_reference_timestamp_time);
-      uint64_t frame_difference = 0;
-      if (reference_timestamp>=play_segment_reference_frame)
-        frame_difference = (uint64_t)reference_timestamp-(uint64_t)play_segment_reference_frame;
-      else // rollover
-        frame_difference = (uint64_t)reference_timestamp+0x100000000-(uint64_t)play_segment_reference_frame;
-      uint64_t frame_time_difference_calculated = (((uint64_t)frame_difference<<32)/44100);
-      uint64_t frame_time_difference_actual = remote_reference_timestamp_time-play_segment_reference_frame_remote_time; // this is all done by reference to the sources' system clock
-      // debug(1,"%llu frames since play started, %llu usec calculated, %llu usec actual",frame_difference, (frame_time_difference_calculated*1000000)>>32, (frame_time_difference_actual*1000000)>>32);
-      if (frame_time_difference_calculated>=frame_time_difference_actual) // i.e. if the time it should have taken to send the packets is greater than the actual time difference measured on the source clock
-        // then the source DAC's clock is running fast relative to the source system clock
-        source_drift_usec = frame_time_difference_calculated-frame_time_difference_actual;
+
+      if (remote_time_change >= local_time_change)
+        clock_drift = remote_time_change - local_time_change;
       else
-        // otherwise the source DAC's clock is running slow relative to the source system clock
-        source_drift_usec = -(frame_time_difference_actual-frame_time_difference_calculated);
-     } else
-       source_drift_usec = 0;
-     source_drift_usec = (source_drift_usec*1000000)>>32; // turn it to microseconds
-      
-     int64_t current_delay = 0;
-     if (config.output->delay) {
-            current_delay = config.output->delay();
-     }
-     //  Useful for troubleshooting:
-     //    clock_drift between source and local clock -- +ve means source is faster
-     //    session_corrections -- the amount of correction done, in microseconds. +ve means frames added
-     //    current_delay = delay in DAC buffer in frames
-     //    source_drift_usec = how much faster (+ve) or slower the source DAC is running relative to the source clock
-     //    buffer_occupancy = the number of buffers occupied. Crude, but should show no long term trend if source and device are in sync.
-     //    return_time = the time from soliciting a timing packet to getting it back. It should be short ( < 5 ms) and pretty consistent.
-     // debug(1, "%lld\t%lld\t%lld\t%lld\t%u\t%llu", clock_drift_in_usec,(session_corrections*1000000)/44100,current_delay,source_drift_usec,buffer_occupancy,(return_time*1000000)>>32);
-      
-    } else {
-      debug(1, "Timing port -- Unknown RTP packet of type 0x%02X length %d.", packet[1], nread);
+        clock_drift = -(local_time_change - remote_time_change);
     }
+    if (clock_drift>=0)
+      clock_drift_in_usec = (clock_drift * 1000000)>>32;
+    else
+      clock_drift_in_usec = -(((-clock_drift) * 1000000)>>32);
+    
+    
+   
+   //  Useful for troubleshooting (uncomment the DAC delay lookup too -- it's not done otherwise, as it
+   //  needs the backend's lock):
+   //    double source_drift_ppm = get_source_drift_ppm();
+   //    int64_t current_delay = config.output->delay ? config.output->delay() : 0;
+   //    clock_drift between source and local clock -- +ve means source is faster
+   //    session_corrections -- the amount of correction done, in microseconds. +ve means frames added
+   //    current_delay = delay in DAC buffer in frames
+   //    source_drift_ppm = how much faster (+ve) or slower the source DAC is running relative to the source clock
+   //    buffer_occupancy = the number of buffers occupied. Crude, but should show no long term trend if source and device are in sync.
+   //    return_time = the time from soliciting a timing packet to getting it back. It should be short ( < 5 ms) and pretty consistent.
+   // debug(1, "%lld\t%lld\t%lld\t%.1f\t%u\t%llu", clock_drift_in_usec,(session_corrections*1000000)/44100,current_delay,source_drift_ppm,buffer_occupancy,(return_time*1000000)>>32);
+    
+  } else {
+    debug(1, "Timing port -- Unknown RTP packet of type 0x%02X length %d.", packet[1], nread);
   }
+}
 
-  debug(1, "Timing RTP thread interrupted. terminating.");
-  void *retval;
-  pthread_kill(timer_requester, SIGUSR1);
-  pthread_join(timer_requester, &retval);
-  debug(1, "Closed and terminated timer requester thread.");
-  debug(1, "Timing RTP thread terminated.");
-  close(timing_socket);
+// A single thread looks after the audio, control and timing sockets and sends the timing
+// requests. It sleeps in poll() until a packet arrives, a timing request is due or
+// rtp_shutdown() pokes the notifier.
+static void *rtp_event_loop(void *arg) {
+  struct pollfd fds[4];
+  fds[0].fd = timing_socket; // first, so that timing replies are dealt with promptly
+  fds[1].fd = control_socket;
+  fds[2].fd = audio_socket;
+  fds[3].fd = shutdown_notifier.read_fd;
+  int i;
+  for (i = 0; i < 4; i++)
+    fds[i].events = POLLIN;
+
+  thread_policy_apply(thread_role_rtp);
+  reference_timestamp = 0; // nothing valid received yet
+  audio_receiver_init();
+  timing_receiver_init();
+  uint64_t time_of_next_timing_request = get_absolute_time_in_fp();
+
+  while (please_shutdown == 0) {
+    uint64_t time_now = get_absolute_time_in_fp();
+    if (time_now >= time_of_next_timing_request) {
+      if (!running)
+        die("rtp_event_loop sending a timing request without active stream!");
+      send_timing_request();
+      time_of_next_timing_request = time_now + timing_request_interval();
+    }
+    int timeout = (((time_of_next_timing_request - time_now) * 1000) >> 32) + 1; // milliseconds
+    int ret = poll(fds, 4, timeout);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      debug(1, "RTP event loop -- error in poll: %s.", strerror(errno));
+      break;
+    }
+    if (ret == 0) // the timing request is due
+      thread_policy_check_deadline(thread_role_rtp, time_of_next_timing_request);
+    if (fds[3].revents)
+      break;
+    if (fds[0].revents & POLLIN)
+      receive_timing_packet();
+    if (fds[1].revents & POLLIN)
+      receive_control_packet();
+    if (fds[2].revents & POLLIN)
+      receive_audio_packets();
+  }
 
+  debug(1, "RTP event loop terminating.");
+  audio_receiver_free();
   return NULL;
 }
 
-static int bind_port(SOCKADDR *remote, int *sock) {
-  struct addrinfo hints, *info;
+// a wildcard address of the given family with the given port
+static socklen_t make_local_address(int family, int port, SOCKADDR *address) {
+  memset(address, 0, sizeof(SOCKADDR));
+#ifdef AF_INET6
+  if (family == AF_INET6) {
+    struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)address;
+    sa6->sin6_family = AF_INET6;
+    sa6->sin6_addr = in6addr_any;
+    sa6->sin6_port = htons(port);
+    return sizeof(struct sockaddr_in6);
+  }
+#endif
+  struct sockaddr_in *sa = (struct sockaddr_in *)address;
+  sa->sin_family = AF_INET;
+  sa->sin_addr.s_addr = htonl(INADDR_ANY);
+  sa->sin_port = htons(port);
+  return sizeof(struct sockaddr_in);
+}
+
+// the same address as the client's, but with a different port
+static void make_client_address(SOCKADDR *remote, int port, SOCKADDR *address) {
+  memset(address, 0, sizeof(SOCKADDR));
+#ifdef AF_INET6
+  if (remote->SAFAMILY == AF_INET6) {
+    memcpy(address, remote, sizeof(struct sockaddr_in6));
+    ((struct sockaddr_in6 *)address)->sin6_port = htons(port);
+  } else
+#endif
+  {
+    memcpy(address, remote, sizeof(struct sockaddr_in));
+    ((struct sockaddr_in *)address)->sin_port = htons(port);
+  }
+}
+
+// bind a UDP socket of the given family to a port in the range given in the configuration.
+// Returns the port, or -1 if it can't be done.
+static int bind_port(int family, int receive_buffer_size, int *sock) {
+  SOCKADDR local;
+  socklen_t local_len;
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = remote->SAFAMILY;
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_flags = AI_PASSIVE;
+  *sock = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+  if (*sock < 0)
+    return -1;
+
+  if (receive_buffer_size &&
+      setsockopt(*sock, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, sizeof(receive_buffer_size)))
+    debug(1, "Can't set the receive buffer size of a UDP socket: %s.", strerror(errno));
 
-  char buffer[10];
-  
   // look for a port in the range, if any was specified.
   int desired_port = config.udp_port_base;
   int ret;
   do {
-    snprintf(buffer, 10, "%d", desired_port);
-
-    ret = getaddrinfo(NULL, buffer, &hints, &info);
-
-    if (ret < 0)
-      die("failed to get usable addrinfo?! %s.", gai_strerror(ret));
-
-    *sock = socket(remote->SAFAMILY, SOCK_DGRAM, IPPROTO_UDP);
-    ret = bind(*sock, info->ai_addr, info->ai_addrlen);
-
-    freeaddrinfo(info);
-
+    local_len = make_local_address(family, desired_port, &local);
+    ret = bind(*sock, (struct sockaddr *)&local, local_len);
   } while ((ret<0) && (errno==EADDRINUSE) && (desired_port!=0) && (desired_port++ < config.udp_port_base+config.udp_port_range));
   
   // debug(1,"UDP port chosen: %d.",desired_port);
   
   if (ret < 0) {
-     die("error: could not bind a UDP port!");
+    close(*sock);
+    *sock = -1;
+    return -1;
   }
  
   
   int sport;
-  SOCKADDR local;
-  socklen_t local_len = sizeof(local);
+  local_len = sizeof(local);
   getsockname(*sock, (struct sockaddr *)&local, &local_len);
 #ifdef AF_INET6
   if (local.SAFAMILY == AF_INET6) {
@@ -547,6 +652,72 @@ static int bind_port(SOCKADDR *remote, int *sock) {
   return sport;
 }
 
+// The audio, control and timing sockets are bound once for each address family -- at startup if
+// possible -- and are kept from one session to the next, so that a SETUP doesn't have to wait for
+// them to be found and bound.
+
+// big enough for a second or so of audio arriving in a burst, e.g. after a network stall
+#define audio_receive_buffer_size (256 * 1024)
+
+typedef struct {
+  int family;
+  int audio_socket, control_socket, timing_socket; // -1 if not bound
+  int audio_port, control_port, timing_port;
+} rtp_socket_set;
+
+#ifdef AF_INET6
+#define number_of_socket_sets 2
+static rtp_socket_set socket_pool[number_of_socket_sets] = {{AF_INET, -1, -1, -1, 0, 0, 0},
+                                                            {AF_INET6, -1, -1, -1, 0, 0, 0}};
+#else
+#define number_of_socket_sets 1
+static rtp_socket_set socket_pool[number_of_socket_sets] = {{AF_INET, -1, -1, -1, 0, 0, 0}};
+#endif
+
+static void close_socket_set(rtp_socket_set *set) {
+  if (set->audio_socket >= 0)
+    close(set->audio_socket);
+  if (set->control_socket >= 0)
+    close(set->control_socket);
+  if (set->timing_socket >= 0)
+    close(set->timing_socket);
+  set->audio_socket = set->control_socket = set->timing_socket = -1;
+}
+
+// returns 0 if all three sockets are bound
+static int bind_socket_set(rtp_socket_set *set) {
+  if (set->audio_socket >= 0)
+    return 0;
+  set->audio_port = bind_port(set->family, audio_receive_buffer_size, &set->audio_socket);
+  set->control_port = bind_port(set->family, 0, &set->control_socket);
+  set->timing_port = bind_port(set->family, 0, &set->timing_socket);
+  if ((set->audio_port < 0) || (set->control_port < 0) || (set->timing_port < 0)) {
+    close_socket_set(set);
+    return -1;
+  }
+  debug(2, "bound UDP ports %d, %d and %d for %s.", set->audio_port, set->control_port,
+        set->timing_port, set->family == AF_INET ? "IPv4" : "IPv6");
+  return 0;
+}
+
+// get rid of anything left over from the previous session
+static void drain_socket(int sock) {
+  uint8_t packet[2048];
+  int count = 0;
+  while (recv(sock, packet, sizeof(packet), MSG_DONTWAIT) >= 0)
+    count++;
+  if (count)
+    debug(2, "discarded %d stale packets.", count);
+}
+
+void rtp_initialise(void) {
+  int i;
+  for (i = 0; i < number_of_socket_sets; i++)
+    if (bind_socket_set(&socket_pool[i]) != 0)
+      debug(1, "Can't bind UDP ports for %s in advance -- will try again at SETUP.",
+            socket_pool[i].family == AF_INET ? "IPv4" : "IPv6");
+}
+
 void rtp_setup(SOCKADDR *remote, int cport, int tport, uint32_t active_remote, int *lsport,
                int *lcport, int *ltport) {
   if (running)
@@ -560,7 +731,6 @@ void rtp_setup(SOCKADDR *remote, int cport, int tport, uint32_t active_remote, i
   void *addr;
   char *ipver;
   int port;
-  char portstr[20];
   client_ip_family = remote->SAFAMILY; // keep information about the kind of ip of the client
 #ifdef AF_INET6
   if (remote->SAFAMILY == AF_INET6) {
@@ -580,59 +750,48 @@ void rtp_setup(SOCKADDR *remote, int cport, int tport, uint32_t active_remote, i
             sizeof(client_ip_string)); // keep the client's ip number
   debug(1, "Connection from %s: %s:%d", ipver, client_ip_string, port);
 
-  // set up a the record of the remote's control socket
-  struct addrinfo hints;
-  struct addrinfo *servinfo;
-
-  memset(&rtp_client_control_socket, 0, sizeof(rtp_client_control_socket));
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = remote->SAFAMILY;
-  hints.ai_socktype = SOCK_DGRAM;
-  snprintf(portstr, 20, "%d", cport);
-  if (getaddrinfo(client_ip_string, portstr, &hints, &servinfo) != 0)
-    die("Can't get address of client's control port");
+  // set up the records of the remote's control and timing sockets
+  make_client_address(remote, cport, &rtp_client_control_socket);
+  make_client_address(remote, tport, &rtp_client_timing_socket);
 
+  // now, we get three sockets -- one for the audio stream, one for the timing and one for the
+  // control -- from the pool
+  rtp_socket_set *set = &socket_pool[0];
 #ifdef AF_INET6
-  if (servinfo->ai_family == AF_INET6)
-    memcpy(&rtp_client_control_socket, servinfo->ai_addr, sizeof(struct sockaddr_in6));
-  else
+  if (remote->SAFAMILY == AF_INET6)
+    set = &socket_pool[1];
 #endif
-    memcpy(&rtp_client_control_socket, servinfo->ai_addr, sizeof(struct sockaddr_in));
-  freeaddrinfo(servinfo);
-
-  // set up a the record of the remote's timing socket
-  memset(&rtp_client_timing_socket, 0, sizeof(rtp_client_timing_socket));
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = remote->SAFAMILY;
-  hints.ai_socktype = SOCK_DGRAM;
-  snprintf(portstr, 20, "%d", tport);
-  if (getaddrinfo(client_ip_string, portstr, &hints, &servinfo) != 0)
-    die("Can't get address of client's timing port");
-#ifdef AF_INET6
-  if (servinfo->ai_family == AF_INET6)
-    memcpy(&rtp_client_timing_socket, servinfo->ai_addr, sizeof(struct sockaddr_in6));
-  else
-#endif
-    memcpy(&rtp_client_timing_socket, servinfo->ai_addr, sizeof(struct sockaddr_in));
-  freeaddrinfo(servinfo);
-
-  // now, we open three sockets -- one for the audio stream, one for the timing and one for the
-  // control
+  if (bind_socket_set(set) != 0) {
+    // the other family's sockets might be holding all the ports in the range, so let them go
+    int i;
+    for (i = 0; i < number_of_socket_sets; i++)
+      if (&socket_pool[i] != set)
+        close_socket_set(&socket_pool[i]);
+    if (bind_socket_set(set) != 0)
+      die("error: could not bind a UDP port!");
+  }
 
-  *lsport = bind_port(remote, &audio_socket);
-  *lcport = bind_port(remote, &control_socket);
-  *ltport = bind_port(remote, &timing_socket);
+  audio_socket = set->audio_socket;
+  control_socket = set->control_socket;
+  timing_socket = set->timing_socket;
+  drain_socket(audio_socket);
+  drain_socket(control_socket);
+  drain_socket(timing_socket);
+  *lsport = set->audio_port;
+  *lcport = set->control_port;
+  *ltport = set->timing_port;
 
   debug(2, "listening for audio, control and timing on ports %d, %d, %d.", *lsport, *lcport,
         *ltport);
 
   please_shutdown = 0;
   reference_timestamp = 0;
-  pthread_create(&rtp_audio_thread, NULL, &rtp_audio_receiver, NULL);
-  pthread_create(&rtp_control_thread, NULL, &rtp_control_receiver, NULL);
-  pthread_create(&rtp_timing_thread, NULL, &rtp_timing_receiver, NULL);
+  timeline_reset(&timeline);
+  if (notifier_init(&shutdown_notifier) != 0)
+    die("Can't create the RTP shutdown notifier: %s.", strerror(errno));
 
   running = 1;
+  pthread_create(&rtp_thread, NULL, &rtp_event_loop, NULL);
   request_sent = 0;
 }
 
@@ -644,10 +803,18 @@ void get_reference_timestamp_stuff(uint32_t *timestamp, uint64_t *timestamp_time
   pthread_mutex_unlock(&reference_time_mutex);
 }
 
+double get_source_drift_ppm(void) {
+  pthread_mutex_lock(&reference_time_mutex);
+  double drift = timeline_drift_ppm(&timeline);
+  pthread_mutex_unlock(&reference_time_mutex);
+  return drift;
+}
+
 void clear_reference_timestamp(void) {
   pthread_mutex_lock(&reference_time_mutex);
   reference_timestamp = 0;
   reference_timestamp_time = 0;
+  timeline_reset(&timeline);
   pthread_mutex_unlock(&reference_time_mutex);
 }
 
@@ -659,12 +826,10 @@ void rtp_shutdown(void) {
   please_shutdown = 1;
   void *retval;
   reference_timestamp = 0;
-  pthread_kill(rtp_audio_thread, SIGUSR1);
-  pthread_join(rtp_audio_thread, &retval);
-  pthread_kill(rtp_control_thread, SIGUSR1);
-  pthread_join(rtp_control_thread, &retval);
-  pthread_kill(rtp_timing_thread, SIGUSR1);
-  pthread_join(rtp_timing_thread, &retval);
+  notifier_notify(&shutdown_notifier);
+  pthread_join(rtp_thread, &retval);
+  notifier_close(&shutdown_notifier); // the sockets are kept for the next session
+  capture_flush();
   running = 0;
 }
 
@@ -5,6 +5,9 @@
 
 #include "player.h"
 
+// bind the UDP ports in advance, so that they're ready for the first SETUP
+void rtp_initialise(void);
+
 void rtp_setup(SOCKADDR *remote, int controlport, int timingport, uint32_t active_remote,
                int *local_server_port, int *local_control_port, int *local_timing_port);
 void rtp_shutdown(void);
@@ -14,6 +17,9 @@ void rtp_request_client_pause(void); // ask the client to pause
 void get_reference_timestamp_stuff(uint32_t *timestamp, uint64_t *timestamp_time, uint64_t *remote_timestamp_time);
 void clear_reference_timestamp(void);
 
+// how much faster (+ve) or slower the source's DAC is running relative to the source's clock
+double get_source_drift_ppm(void);
+
 uint64_t static local_to_remote_time_jitters;
 uint64_t static local_to_remote_time_jitters_count;
 
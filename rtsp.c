@@ -33,7 +33,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/select.h>
-#include <signal.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -59,6 +59,10 @@
 #include "player.h"
 #include "rtp.h"
 #include "mdns.h"
+#include "capture.h"
+#include "metadata_ring.h"
+#include "picture_cache.h"
+#include "rtsp.h"
 
 #ifdef AF_INET6
 #define INETx_ADDRSTRLEN INET6_ADDRSTRLEN
@@ -81,151 +85,318 @@ static pthread_mutex_t play_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t reference_counter_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // only one thread is allowed to use the player at once.
-// it monitors the request variable (at least when interrupted)
 static pthread_mutex_t playing_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int please_shutdown = 0;
 static pthread_t playing_thread = 0;
 
 typedef struct {
   int fd;
+  notifier stop; // the conversation ends when this is notified
   stream_cfg stream;
   SOCKADDR remote;
   int running;
+  int has_thread; // it has its own conversation thread; otherwise the listener looks after it
+  char *auth_nonce;
+  // a request being read, a piece at a time
+  struct rtsp_message *partial;
+  size_t partial_parsed;     // its header lines up to here have been parsed
+  int partial_size;          // the length of its content, or -1 until its headers are all in
+  uint64_t request_deadline; // when the listener gives up on it
   pthread_t thread;
 } rtsp_conn_info;
 
+// Connections are looked after by the listener until they send something other than OPTIONS or
+// GET_PARAMETER -- the start of a session -- when they get their own conversation thread. So
+// the devices that only ever probe with OPTIONS don't each hold a thread.
+static pthread_mutex_t connection_statistics_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t connections_accepted;
+static int connections_open, connections_with_threads;
+static notifier listener_wakeup; // notified when a conversation thread finishes
+
+// The listener only ever reads what's waiting on a connection, and holds on to a request until
+// it's all in, so a slow client can't hold it up. It gives up on a request that isn't all in
+// this long after it started, and won't take more content than this with a request it answers.
+#define LISTENER_REQUEST_TIMEOUT 1000
+#define LISTENER_MAXIMUM_CONTENT 4096
+
+// the conversation that has the player, so that it can be asked to stop
+static pthread_mutex_t playing_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static rtsp_conn_info *playing_conn = NULL;
+
+// how long it has taken to get the player from another conversation
+static pthread_mutex_t takeover_statistics_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t takeovers, last_takeover_time, longest_takeover_time;
+
 #ifdef CONFIG_METADATA
+// A bounded queue that any number of threads can add to without taking a lock. Each slot has a
+// sequence number saying whether it's ready to be filled or to be taken for a given position, so
+// a producer only contends with another producer for the tail, and the taker for the head. As
+// well as the consumer, a producer that finds the queue full may take the oldest item to make
+// room, so taking from the head is also done with a compare-and-swap. The lock and condition
+// variables are only used when the consumer has nothing to do or a producer is waiting for room.
 typedef struct {
-  pthread_mutex_t pc_queue_lock;
-  pthread_cond_t pc_queue_item_added_signal;
-  pthread_cond_t pc_queue_item_removed_signal;
-  size_t item_size;  // number of bytes in each item
-  uint32_t count;    // number of items in the queue
-  uint32_t capacity; // maximum number of items
-  uint32_t toq;      // first item to take
-  uint32_t eoq;      // free space at end of queue
-  void *items;       // a pointer to where the items are actually stored
-} pc_queue;          // producer-consumer queue
+  uint32_t head;            // the position of the next item to take
+  uint32_t tail;            // the position of the next item to add
+  uint32_t capacity;        // a power of two
+  size_t item_size;         // number of bytes in each item
+  uint32_t *sequence;       // for each slot, the position it's free for, or one more when filled
+  unsigned char *droppable; // for each slot, whether the item may be taken to make room
+  void *items;              // a pointer to where the items are actually stored
+  pthread_mutex_t wait_lock;
+  pthread_cond_t item_added;
+  pthread_cond_t item_removed;
+  int consumer_waiting;
+  int producers_waiting;
+  int stalled; // set when a producer has waited in vain, cleared when the consumer takes an item
+} pc_queue; // producer-consumer queue
 #endif
 
-typedef struct {
+// the headers we look at or look up, interned so that finding one is an array index
+enum rtsp_header {
+  hdr_cseq,
+  hdr_content_length,
+  hdr_content_type,
+  hdr_transport,
+  hdr_session,
+  hdr_rtp_info,
+  hdr_active_remote,
+  hdr_dacp_id,
+  hdr_user_agent,
+  hdr_x_apple_client_name,
+  hdr_apple_challenge,
+  hdr_authorization,
+  number_of_known_headers
+};
+
+static const char *known_header_names[number_of_known_headers] = {
+    "CSeq",          "Content-Length",      "Content-Type",    "Transport",
+    "Session",       "RTP-Info",            "Active-Remote",   "DACP-ID",
+    "User-Agent",    "X-Apple-Client-Name", "Apple-Challenge", "Authorization"};
+
+// A message lives in a single allocation. A request is read straight into its arena and parsed
+// in place -- the line endings and the colons after the header names become NULs -- so that
+// freeing the message frees everything. A response's headers and content are put in its arena.
+typedef struct rtsp_message {
   uint32_t referenceCount; // we might start using this...
   int nheaders;
-  char *name[16];
-  char *value[16];
+  uint32_t name[16];  // offsets of the headers' names in the arena
+  uint32_t value[16]; // and of their values
+  uint8_t known[number_of_known_headers]; // 1 + the index of each interned header present, or 0
 
   int contentlength;
-  char *content;
+  char *content;         // in the arena
+  int content_streamed; // the content went to the metadata thread as it arrived, and isn't here
 
   // for requests
   char method[16];
 
   // for responses
   int respcode;
+
+  size_t arena_size, arena_used;
+  struct msg_overflow *overflow; // blocks for content that didn't fit in the arena
+  char arena[];
 } rtsp_message;
 
+typedef struct msg_overflow {
+  struct msg_overflow *next;
+  char data[];
+} msg_overflow;
+
+// enough for the whole of most requests -- volume and progress updates in particular -- and for
+// any response
+#define MSG_ARENA_SIZE 2048
+// a request's header block mustn't be any longer than this
+#define MSG_MAXIMUM_HEADER_SIZE 16384
+
 #ifdef CONFIG_METADATA
+// An item of metadata is usually sent in one package. A large one -- a picture -- can be sent as
+// it arrives instead: a start package giving the item's length, data packages, and an end package.
+// An item that's coalesced is held outside the queue, and the queue just carries a marker for it.
+enum metadata_part {
+  metadata_whole,
+  metadata_start,
+  metadata_data,
+  metadata_end,
+  metadata_coalesced
+};
+
 typedef struct {
   uint32_t type;
   uint32_t code;
+  enum metadata_part part;
+  uint32_t item; // for the parts of an item, which one they belong to
   char *data;
   uint32_t length;
   rtsp_message *carrier;
 } metadata_package;
 
+// the items must have room for number_of_items, which must be a power of two
 void pc_queue_init(pc_queue *the_queue, char *items, size_t item_size, uint32_t number_of_items) {
+  uint32_t i;
   the_queue->item_size = item_size;
   the_queue->items = items;
-  the_queue->count = 0;
   the_queue->capacity = number_of_items;
-  the_queue->toq = 0;
-  the_queue->eoq = 0;
+  the_queue->head = 0;
+  the_queue->tail = 0;
+  the_queue->sequence = malloc(number_of_items * sizeof(uint32_t));
+  the_queue->droppable = malloc(number_of_items);
+  if ((the_queue->sequence == NULL) || (the_queue->droppable == NULL))
+    die("could not allocate a queue of %u items", number_of_items);
+  for (i = 0; i < number_of_items; i++)
+    the_queue->sequence[i] = i;
+  pthread_mutex_init(&the_queue->wait_lock, NULL);
+  pthread_cond_init(&the_queue->item_added, NULL);
+  pthread_cond_init(&the_queue->item_removed, NULL);
+  the_queue->consumer_waiting = 0;
+  the_queue->producers_waiting = 0;
+  the_queue->stalled = 0;
 }
 
-int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
-                  int block);
+// add an item if there's room, returning EAGAIN if there isn't
+static int pc_queue_try_add(pc_queue *the_queue, const void *the_stuff, int droppable) {
+  uint32_t position = __atomic_load_n(&the_queue->tail, __ATOMIC_RELAXED);
+  while (1) {
+    uint32_t slot = position & (the_queue->capacity - 1);
+    uint32_t sequence = __atomic_load_n(&the_queue->sequence[slot], __ATOMIC_ACQUIRE);
+    int32_t difference = (int32_t)(sequence - position);
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&the_queue->tail, &position, position + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        memcpy((char *)the_queue->items + the_queue->item_size * slot, the_stuff,
+               the_queue->item_size);
+        the_queue->droppable[slot] = droppable;
+        __atomic_store_n(&the_queue->sequence[slot], position + 1, __ATOMIC_RELEASE);
+        return 0;
+      } // otherwise another producer got there first, and position is now the new tail
+    } else if (difference < 0) {
+      return EAGAIN; // the slot still holds the item from the last time round
+    } else {
+      position = __atomic_load_n(&the_queue->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// take the oldest item if there is one -- and if it's droppable, if only_droppable is set --
+// returning EAGAIN if the queue is empty and EPERM if the oldest item mustn't be dropped
+static int pc_queue_try_take(pc_queue *the_queue, void *the_stuff, int only_droppable) {
+  uint32_t position = __atomic_load_n(&the_queue->head, __ATOMIC_RELAXED);
+  while (1) {
+    uint32_t slot = position & (the_queue->capacity - 1);
+    uint32_t sequence = __atomic_load_n(&the_queue->sequence[slot], __ATOMIC_ACQUIRE);
+    int32_t difference = (int32_t)(sequence - (position + 1));
+    if (difference == 0) {
+      // if the slot is taken and refilled meanwhile, the compare-and-swap below will fail
+      if ((only_droppable) && (the_queue->droppable[slot] == 0))
+        return EPERM;
+      if (__atomic_compare_exchange_n(&the_queue->head, &position, position + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        memcpy(the_stuff, (char *)the_queue->items + the_queue->item_size * slot,
+               the_queue->item_size);
+        __atomic_store_n(&the_queue->sequence[slot], position + the_queue->capacity,
+                         __ATOMIC_RELEASE);
+        return 0;
+      }
+    } else if (difference < 0) {
+      return EAGAIN;
+    } else {
+      position = __atomic_load_n(&the_queue->head, __ATOMIC_RELAXED);
+    }
+  }
+}
 
-int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, int block) {
-  return send_metadata('ssnc', code, data, length, NULL, block);
+// only a hint, as items may be being added or taken
+static int pc_queue_is_empty(pc_queue *the_queue) {
+  return (__atomic_load_n(&the_queue->head, __ATOMIC_RELAXED) ==
+          __atomic_load_n(&the_queue->tail, __ATOMIC_RELAXED));
 }
 
-int pc_queue_add_item(pc_queue *the_queue, const void *the_stuff, int block) {
-  int rc;
-  if (the_queue) {
-    if (block == 0) {
-      rc = pthread_mutex_trylock(&the_queue->pc_queue_lock);
-      if (rc == EBUSY)
-        return EBUSY;
-    } else
-      rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error locking for pc_queue_add_item");
-    while (the_queue->count == the_queue->capacity) {
-      rc = pthread_cond_wait(&the_queue->pc_queue_item_removed_signal, &the_queue->pc_queue_lock);
-      if (rc)
-        debug(1, "Error waiting for item to be removed");
+static void pc_queue_wake_consumer(pc_queue *the_queue) {
+  pthread_mutex_lock(&the_queue->wait_lock);
+  pthread_cond_signal(&the_queue->item_added);
+  pthread_mutex_unlock(&the_queue->wait_lock);
+}
+
+// add an item, waiting up to timeout_ms milliseconds for room -- unless the last wait was in vain
+// and the consumer hasn't taken anything since. Returns 0 if it was added, otherwise EAGAIN, and
+// the caller still owns the item.
+int pc_queue_add_item(pc_queue *the_queue, const void *the_stuff, int droppable, int timeout_ms) {
+  int rc = pc_queue_try_add(the_queue, the_stuff, droppable);
+  if ((rc == EAGAIN) && (timeout_ms > 0) &&
+      (__atomic_load_n(&the_queue->stalled, __ATOMIC_RELAXED) == 0)) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
     }
-    uint32_t i = the_queue->eoq;
-    void *p = the_queue->items + the_queue->item_size * i;
-    //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->eoq;
-    memcpy(p, the_stuff, the_queue->item_size);
-
-    // update the pointer
-    i++;
-    if (i == the_queue->capacity)
-      // fold pointer if necessary
-      i = 0;
-    the_queue->eoq = i;
-    the_queue->count++;
-    if (the_queue->count == the_queue->capacity)
-      debug(1, "pc_queue is full!");
-    rc = pthread_cond_signal(&the_queue->pc_queue_item_added_signal);
-    if (rc)
-      debug(1, "Error signalling after pc_queue_add_item");
-    rc = pthread_mutex_unlock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error unlocking for pc_queue_add_item");
-  } else {
-    debug(1, "Adding an item to a NULL queue");
+    pthread_mutex_lock(&the_queue->wait_lock);
+    __atomic_add_fetch(&the_queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    while ((rc = pc_queue_try_add(the_queue, the_stuff, droppable)) == EAGAIN) {
+      if (pthread_cond_timedwait(&the_queue->item_removed, &the_queue->wait_lock, &deadline) ==
+          ETIMEDOUT) {
+        rc = pc_queue_try_add(the_queue, the_stuff, droppable);
+        if (rc == EAGAIN)
+          __atomic_store_n(&the_queue->stalled, 1, __ATOMIC_RELAXED);
+        break;
+      }
+    }
+    __atomic_sub_fetch(&the_queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&the_queue->wait_lock);
   }
-  return 0;
+  if (rc == 0) {
+    // pairs with the consumer setting consumer_waiting and then looking again
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&the_queue->consumer_waiting, __ATOMIC_SEQ_CST))
+      pc_queue_wake_consumer(the_queue);
+  }
+  return rc;
 }
 
+// take the oldest item, waiting for one if necessary. Returns EAGAIN if the consumer was woken
+// by pc_queue_wake_consumer() with nothing to take.
 int pc_queue_get_item(pc_queue *the_queue, void *the_stuff) {
-  int rc;
-  if (the_queue) {
-    rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error locking for pc_queue_get_item");
-    while (the_queue->count == 0) {
-      rc = pthread_cond_wait(&the_queue->pc_queue_item_added_signal, &the_queue->pc_queue_lock);
-      if (rc)
-        debug(1, "Error waiting for item to be added");
+  int rc = pc_queue_try_take(the_queue, the_stuff, 0);
+  if (rc == EAGAIN) {
+    pthread_mutex_lock(&the_queue->wait_lock);
+    __atomic_store_n(&the_queue->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    rc = pc_queue_try_take(the_queue, the_stuff, 0);
+    if (rc == EAGAIN) {
+      pthread_cond_wait(&the_queue->item_added, &the_queue->wait_lock);
+      rc = pc_queue_try_take(the_queue, the_stuff, 0);
     }
-    uint32_t i = the_queue->toq;
-    //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->toq;
-    void *p = the_queue->items + the_queue->item_size * i;
-    memcpy(the_stuff, p, the_queue->item_size);
-
-    // update the pointer
-    i++;
-    if (i == the_queue->capacity)
-      // fold pointer if necessary
-      i = 0;
-    the_queue->toq = i;
-    the_queue->count--;
-    rc = pthread_cond_signal(&the_queue->pc_queue_item_removed_signal);
-    if (rc)
-      debug(1, "Error signalling after pc_queue_removed_item");
-    rc = pthread_mutex_unlock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error unlocking for pc_queue_get_item");
-  } else {
-    debug(1, "Removing an item from a NULL queue");
+    __atomic_store_n(&the_queue->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&the_queue->wait_lock);
   }
-  return 0;
+  if (rc == 0) {
+    if (__atomic_load_n(&the_queue->stalled, __ATOMIC_RELAXED))
+      __atomic_store_n(&the_queue->stalled, 0, __ATOMIC_RELAXED);
+    // pairs with a producer counting itself in and then trying again
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&the_queue->producers_waiting, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&the_queue->wait_lock);
+      pthread_cond_broadcast(&the_queue->item_removed);
+      pthread_mutex_unlock(&the_queue->wait_lock);
+    }
+  }
+  return rc;
+}
+
+int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
+                  enum metadata_policy policy);
+static int send_metadata_part(uint32_t type, uint32_t code, enum metadata_part part, uint32_t item,
+                              char *data, uint32_t length, rtsp_message *carrier);
+static void metadata_abandon_item(uint32_t item);
+#define number_of_drop_counts 32 // the number of different codes whose drops are counted
+static int metadata_report_drops(char *buf, size_t size);
+
+int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, enum metadata_policy policy) {
+  return send_metadata('ssnc', code, data, length, NULL, policy);
 }
 
+
 #endif
 
 // determine if we are the currently playing thread
@@ -238,47 +409,77 @@ static inline int rtsp_playing(void) {
   }
 }
 
+// ask the conversation that has the player, if any, to end
 void rtsp_request_shutdown_stream(void) {
-  please_shutdown = 1;
-  pthread_kill(playing_thread, SIGUSR1);
+  pthread_mutex_lock(&playing_conn_lock);
+  if (playing_conn)
+    notifier_notify(&playing_conn->stop);
+  pthread_mutex_unlock(&playing_conn_lock);
 }
 
-static void rtsp_take_player(void) {
+// conn is the conversation taking the player, or NULL if none is
+static void rtsp_take_player(rtsp_conn_info *conn) {
   if (rtsp_playing())
     return;
 
   if (pthread_mutex_trylock(&playing_mutex)) {
     debug(1, "shutting down playing thread.");
-    // XXX minor race condition between please_shutdown and signal delivery
-    please_shutdown = 1;
-    pthread_kill(playing_thread, SIGUSR1);
+    uint64_t start = get_absolute_time_in_fp();
+    rtsp_request_shutdown_stream();
     pthread_mutex_lock(&playing_mutex);
+    uint64_t takeover_time = get_absolute_time_in_fp() - start;
+    pthread_mutex_lock(&takeover_statistics_lock);
+    takeovers++;
+    last_takeover_time = takeover_time;
+    if (takeover_time > longest_takeover_time)
+      longest_takeover_time = takeover_time;
+    pthread_mutex_unlock(&takeover_statistics_lock);
+    debug(1, "the playing thread shut down in %.1f ms.", ((takeover_time * 1000) >> 16) / 65536.0);
   }
   playing_thread = pthread_self(); // make us the currently-playing thread (why?)
+  pthread_mutex_lock(&playing_conn_lock);
+  playing_conn = conn;
+  pthread_mutex_unlock(&playing_conn_lock);
 }
 
 void rtsp_shutdown_stream(void) {
-  rtsp_take_player();
+  rtsp_take_player(NULL);
+  pthread_mutex_lock(&playing_conn_lock);
+  playing_conn = NULL;
+  pthread_mutex_unlock(&playing_conn_lock);
   pthread_mutex_unlock(&playing_mutex);
 }
 
-// keep track of the threads we have spawned so we can join() them
+// keep track of the connections, and of the threads we have spawned so we can join() them
 static rtsp_conn_info **conns = NULL;
 static int nconns = 0;
-static void track_thread(rtsp_conn_info *conn) {
+static void track_connection(rtsp_conn_info *conn) {
   conns = realloc(conns, sizeof(rtsp_conn_info *) * (nconns + 1));
   conns[nconns] = conn;
   nconns++;
 }
 
+static void free_connection(rtsp_conn_info *conn) {
+  notifier_close(&conn->stop);
+  if (conn->auth_nonce)
+    free(conn->auth_nonce);
+  free(conn);
+}
+
 static void cleanup_threads(void) {
   void *retval;
   int i;
   debug(2, "culling threads.");
   for (i = 0; i < nconns;) {
     if (conns[i]->running == 0) {
-      pthread_join(conns[i]->thread, &retval);
-      free(conns[i]);
+      if (conns[i]->has_thread)
+        pthread_join(conns[i]->thread, &retval);
+      pthread_mutex_lock(&connection_statistics_lock);
+      connections_open--;
+      if (conns[i]->has_thread)
+        connections_with_threads--;
+      pthread_mutex_unlock(&connection_statistics_lock);
+      free_connection(conns[i]);
       debug(2, "one joined...");
       nconns--;
       if (nconns)
@@ -326,38 +527,87 @@ static void msg_retain(rtsp_message *msg) {
   }
 }
 
-static rtsp_message *msg_init(void) {
-  rtsp_message *msg = malloc(sizeof(rtsp_message));
+static rtsp_message *msg_init(size_t arena_size) {
+  rtsp_message *msg = malloc(sizeof(rtsp_message) + arena_size);
+  if (msg == NULL)
+    die("can not allocate an RTSP message");
   memset(msg, 0, sizeof(rtsp_message));
+  msg->arena_size = arena_size;
   msg->referenceCount = 1; // from now on, any access to this must be protected with the lock
   return msg;
 }
 
-static int msg_add_header(rtsp_message *msg, char *name, char *value) {
-  if (msg->nheaders >= sizeof(msg->name) / sizeof(char *)) {
+// take space from a message's arena, or return NULL if there's not enough
+static char *msg_arena_alloc(rtsp_message *msg, size_t size) {
+  if (msg->arena_size - msg->arena_used < size)
+    return NULL;
+  char *p = msg->arena + msg->arena_used;
+  msg->arena_used += size;
+  return p;
+}
+
+// take space for content from the message's arena if there's room, or from a block that will be
+// freed with the message if there isn't
+static char *msg_content_alloc(rtsp_message *msg, size_t size) {
+  char *p = msg_arena_alloc(msg, size);
+  if (p == NULL) {
+    msg_overflow *block = malloc(sizeof(msg_overflow) + size);
+    if (block == NULL)
+      return NULL;
+    block->next = msg->overflow;
+    msg->overflow = block;
+    p = block->data;
+  }
+  return p;
+}
+
+static char *msg_header_name(rtsp_message *msg, int i) { return msg->arena + msg->name[i]; }
+
+static char *msg_header_value(rtsp_message *msg, int i) { return msg->arena + msg->value[i]; }
+
+// note a header whose name and value are already in the arena
+static int msg_note_header(rtsp_message *msg, char *name, char *value) {
+  if (msg->nheaders >= sizeof(msg->name) / sizeof(msg->name[0])) {
     warn("too many headers?!");
     return 1;
   }
-
-  msg->name[msg->nheaders] = strdup(name);
-  msg->value[msg->nheaders] = strdup(value);
+  int h;
+  for (h = 0; h < number_of_known_headers; h++)
+    if (!strcasecmp(known_header_names[h], name)) {
+      if (msg->known[h] == 0)
+        msg->known[h] = msg->nheaders + 1;
+      break;
+    }
+  msg->name[msg->nheaders] = name - msg->arena;
+  msg->value[msg->nheaders] = value - msg->arena;
   msg->nheaders++;
-
   return 0;
 }
 
-static char *msg_get_header(rtsp_message *msg, char *name) {
-  int i;
-  for (i = 0; i < msg->nheaders; i++)
-    if (!strcasecmp(msg->name[i], name))
-      return msg->value[i];
+static int msg_add_header(rtsp_message *msg, char *name, char *value) {
+  size_t name_size = strlen(name) + 1;
+  size_t value_size = strlen(value) + 1;
+  char *p = msg_arena_alloc(msg, name_size + value_size);
+  if (p == NULL) {
+    warn("no room for the \"%s\" header.", name);
+    return 1;
+  }
+  memcpy(p, name, name_size);
+  memcpy(p + name_size, value, value_size);
+  return msg_note_header(msg, p, p + name_size);
+}
+
+static char *msg_get_header(rtsp_message *msg, enum rtsp_header header) {
+  if (msg->known[header])
+    return msg_header_value(msg, msg->known[header] - 1);
   return NULL;
 }
 
 static void msg_print_debug_headers(rtsp_message *msg) {
   int i;
   for (i = 0; i < msg->nheaders; i++) {
-    debug(1, "  Type: \"%s\", content: \"%s\"", msg->name[i], msg->value[i]);
+    debug(1, "  Type: \"%s\", content: \"%s\"", msg_header_name(msg, i),
+          msg_header_value(msg, i));
   }
 }
 
@@ -367,18 +617,16 @@ static void msg_free(rtsp_message *msg) {
     int rc = pthread_mutex_lock(&reference_counter_lock);
     if (rc)
       debug(1, "Error %d locking reference counter lock during msg_free()", rc);
-    msg->referenceCount--;
+    int references = --msg->referenceCount; // read it here, as others may be releasing it too
     rc = pthread_mutex_unlock(&reference_counter_lock);
     if (rc)
       debug(1, "Error %d unlocking reference counter lock during msg_free()", rc);
-    if (msg->referenceCount == 0) {
-      int i;
-      for (i = 0; i < msg->nheaders; i++) {
-        free(msg->name[i]);
-        free(msg->value[i]);
+    if (references == 0) {
+      while (msg->overflow) {
+        msg_overflow *block = msg->overflow;
+        msg->overflow = block->next;
+        free(block);
       }
-      if (msg->content)
-        free(msg->content);
       free(msg);
     } // else {
       // debug(1,"rtsp_message reference count non-zero: %d!",msg->referenceCount);
@@ -388,12 +636,12 @@ static void msg_free(rtsp_message *msg) {
   }
 }
 
+// parse a line of the request in place. Return -1 if more headers are to come, otherwise the
+// length of the content; a bad line frees the message.
 static int msg_handle_line(rtsp_message **pmsg, char *line) {
   rtsp_message *msg = *pmsg;
 
-  if (!msg) {
-    msg = msg_init();
-    *pmsg = msg;
+  if (msg->method[0] == 0) {
     char *sp, *p;
 
     // debug(1, "received request: %s", line);
@@ -425,15 +673,19 @@ static int msg_handle_line(rtsp_message **pmsg, char *line) {
     }
     *p = 0;
     p += 2;
-    msg_add_header(msg, line, p);
+    msg_note_header(msg, line, p);
     debug(2, "    %s: %s.", line, p);
     return -1;
   } else {
-    char *cl = msg_get_header(msg, "Content-Length");
-    if (cl)
-      return atoi(cl);
-    else
+    char *cl = msg_get_header(msg, hdr_content_length);
+    if (cl == NULL)
       return 0;
+    int length = atoi(cl);
+    if (length < 0) {
+      warn("bad Content-Length: >>%s<<", cl);
+      goto fail;
+    }
+    return length;
   }
 
 fail:
@@ -442,105 +694,273 @@ fail:
   return 0;
 }
 
-static enum rtsp_read_request_response rtsp_read_request(int fd, rtsp_message **the_packet) {
-  enum rtsp_read_request_response reply = rtsp_read_request_response_ok;
-  ssize_t buflen = 512;
-  char *buf = malloc(buflen + 1);
-
-  rtsp_message *msg = NULL;
-
-  ssize_t nread;
-  ssize_t inbuf = 0;
-  int msg_size = -1;
+// put a request into the capture file, reassembled from its parts
+static void capture_request(rtsp_message *msg) {
+  int i;
+  size_t size = strlen(msg->method) + sizeof(" * RTSP/1.0\r\n") + 2 + msg->contentlength;
+  for (i = 0; i < msg->nheaders; i++)
+    size += strlen(msg_header_name(msg, i)) + strlen(msg_header_value(msg, i)) + 4;
+  char *text = malloc(size);
+  if (text == NULL)
+    return;
+  char *p = text;
+  p += sprintf(p, "%s * RTSP/1.0\r\n", msg->method);
+  for (i = 0; i < msg->nheaders; i++)
+    p += sprintf(p, "%s: %s\r\n", msg_header_name(msg, i), msg_header_value(msg, i));
+  p += sprintf(p, "\r\n");
+  if (msg->contentlength) {
+    memcpy(p, msg->content, msg->contentlength);
+    p += msg->contentlength;
+  }
+  capture_record(capture_rtsp_request, get_absolute_time_in_fp(), text, p - text);
+  capture_flush();
+  free(text);
+}
 
-  while (msg_size < 0) {
-    if (please_shutdown) {
-      debug(1, "RTSP shutdown requested.");
-      reply = rtsp_read_request_response_shutdown_requested;
-      goto shutdown;
-    }
-    nread = read(fd, buf + inbuf, buflen - inbuf);
-    if (!nread) {
-      debug(1, "RTSP connection closed.");
-      reply = rtsp_read_request_response_shutdown_requested;
-      goto shutdown;
-    }
-    if (nread < 0) {
+// wait until there is something to read on the connection, or until the conversation is asked to
+// end, in which case return 0
+static int wait_for_request(rtsp_conn_info *conn) {
+  struct pollfd fds[2];
+  fds[0].fd = conn->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = conn->stop.read_fd;
+  fds[1].events = POLLIN;
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
       if (errno == EINTR)
         continue;
-      perror("read failure");
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
-    }
-    inbuf += nread;
-
-    char *next;
-    while (msg_size < 0 && (next = nextline(buf, inbuf))) {
-      msg_size = msg_handle_line(&msg, buf);
-
-      if (!msg) {
-        warn("no RTSP header received");
-        reply = rtsp_read_request_response_bad_packet;
-        goto shutdown;
-      }
-
-      inbuf -= next - buf;
-      if (inbuf)
-        memmove(buf, next, inbuf);
-    }
-  }
-
-  if (msg_size > buflen) {
-    buf = realloc(buf, msg_size);
-    if (!buf) {
-      warn("too much content");
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
+      return 1; // let the read report the problem
     }
-    buflen = msg_size;
+    if (fds[1].revents & POLLIN)
+      return 0;
+    if (fds[0].revents)
+      return 1;
   }
+}
 
-  uint64_t threshold_time =
-      get_absolute_time_in_fp() + ((uint64_t)5 << 32); // i.e. five seconds from now
-  int warning_message_sent = 0;
-
+// read exactly size bytes of content. If it's taking too long -- past threshold_time -- say so,
+// once, in metadata.
+static enum rtsp_read_request_response read_content(rtsp_conn_info *conn, char *buf, size_t size,
+                                                    uint64_t threshold_time,
+                                                    int *warning_message_sent) {
   const size_t max_read_chunk = 50000;
-  while (inbuf < msg_size) {
+  size_t inbuf = 0;
+  while (inbuf < size) {
 
     // we are going to read the stream in chunks and time how long it takes to do so.
     // If it's taking too long, (and we find out about it), we will send an error message as
     // metadata
 
-    if (warning_message_sent == 0) {
+    if (*warning_message_sent == 0) {
       uint64_t time_now = get_absolute_time_in_fp();
       if (time_now > threshold_time) { // it's taking too long
         debug(1, "Error receiving metadata from source -- transmission seems to be stalled.");
 #ifdef CONFIG_METADATA
-        send_ssnc_metadata('stal', NULL, 0, 1);
+        send_ssnc_metadata('stal', NULL, 0, metadata_drop_oldest);
 #endif
-        warning_message_sent = 1;
+        *warning_message_sent = 1;
       }
     }
-    ssize_t read_chunk = msg_size - inbuf;
+    ssize_t read_chunk = size - inbuf;
     if (read_chunk > max_read_chunk)
       read_chunk = max_read_chunk;
-    nread = read(fd, buf + inbuf, read_chunk);
-    if (!nread) {
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
+    if (!wait_for_request(conn)) {
+      debug(1, "RTSP shutdown requested.");
+      return rtsp_read_request_response_shutdown_requested;
     }
-    if (nread == EINTR)
-      continue;
+    ssize_t nread = read(conn->fd, buf + inbuf, read_chunk);
+    if (!nread)
+      return rtsp_read_request_response_error;
     if (nread < 0) {
+      if (errno == EINTR)
+        continue;
       perror("read failure");
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
+      return rtsp_read_request_response_error;
     }
     inbuf += nread;
   }
+  return rtsp_read_request_response_ok;
+}
+
+#ifdef CONFIG_METADATA
+// A picture is passed to the metadata thread as it arrives, rather than being held whole until
+// it's been sent on. The chunks are multiples of 57 bytes, so each encodes to whole lines of
+// base64. The part of the picture read with the headers goes first, straight from the arena.
+#define PICTURE_CHUNK_SIZE (57 * 1024)
+
+static enum rtsp_read_request_response stream_picture(rtsp_conn_info *conn, rtsp_message *msg,
+                                                      size_t parsed, size_t size,
+                                                      uint64_t threshold_time,
+                                                      int *warning_message_sent) {
+  enum rtsp_read_request_response reply = rtsp_read_request_response_ok;
+  static uint32_t pictures = 0;
+  uint32_t item = __atomic_add_fetch(&pictures, 1, __ATOMIC_RELAXED);
+  size_t have = msg->arena_used - parsed;
+  size_t aligned = (have == size) ? have : have - have % 57;
+  size_t carried = have - aligned; // these go at the start of the first chunk
+  // if a part can't be queued, the rest of the picture is still read, but not sent
+  int started = (send_metadata_part('ssnc', 'PICT', metadata_start, item, NULL, size, NULL) == 0);
+  int sending = started;
+  if ((sending) && (aligned))
+    sending = (send_metadata_part('ssnc', 'PICT', metadata_data, item, msg->arena + parsed,
+                                  aligned, msg) == 0);
+  size_t sent = aligned;
+  while ((sent < size) && (reply == rtsp_read_request_response_ok)) {
+    size_t chunk_size = size - sent;
+    if (chunk_size > PICTURE_CHUNK_SIZE)
+      chunk_size = PICTURE_CHUNK_SIZE;
+    char *chunk = malloc(chunk_size); // the metadata thread will free it
+    if (chunk == NULL)
+      die("can not allocate a picture chunk");
+    memcpy(chunk, msg->arena + parsed + aligned, carried);
+    reply = read_content(conn, chunk + carried, chunk_size - carried, threshold_time,
+                         warning_message_sent);
+    carried = 0;
+    if ((reply == rtsp_read_request_response_ok) && (sending))
+      sending = (send_metadata_part('ssnc', 'PICT', metadata_data, item, chunk, chunk_size,
+                                    NULL) == 0); // the chunk is freed if it's dropped
+    else
+      free(chunk);
+    sent += chunk_size;
+  }
+  // the item is closed off even if it's incomplete; the length given will show it's short
+  if ((sending == 0) ||
+      (send_metadata_part('ssnc', 'PICT', metadata_end, item, NULL, 0, NULL) != 0)) {
+    debug(1, "The metadata queue is full -- the rest of a picture has been dropped.");
+    if (started) // the metadata thread needs to be told to close it off
+      metadata_abandon_item(item);
+  }
+  return reply;
+}
+#endif
 
-  msg->contentlength = inbuf;
-  msg->content = buf;
+static void request_discard(rtsp_conn_info *conn) {
+  if (conn->partial)
+    msg_free(conn->partial);
+  conn->partial = NULL;
+}
+
+// A request is read straight into a new message's arena, and each header line is parsed as it
+// arrives. Once the headers are all in, a read takes the content into the arena too, up to its
+// length. Each call does one read, so it won't wait if there's something to read.
+static enum rtsp_read_request_response request_read_part(rtsp_conn_info *conn) {
+  if (conn->partial == NULL) {
+    conn->partial = msg_init(MSG_ARENA_SIZE);
+    conn->partial_parsed = 0;
+    conn->partial_size = -1;
+  }
+  rtsp_message *msg = conn->partial;
+  size_t wanted;
+  if (conn->partial_size < 0) {
+    if (msg->arena_used == msg->arena_size) {
+      if (msg->arena_size >= MSG_MAXIMUM_HEADER_SIZE) {
+        warn("RTSP header too long");
+        return rtsp_read_request_response_bad_packet;
+      }
+      // there are no pointers into the arena yet, just offsets, so it can move
+      msg->arena_size *= 2;
+      msg = realloc(msg, sizeof(rtsp_message) + msg->arena_size);
+      if (msg == NULL)
+        die("can not allocate an RTSP message");
+      conn->partial = msg;
+    }
+    wanted = msg->arena_size - msg->arena_used;
+  } else {
+    size_t size = conn->partial_parsed + conn->partial_size;
+    if (size > msg->arena_size) {
+      msg = realloc(msg, sizeof(rtsp_message) + size);
+      if (msg == NULL)
+        die("can not allocate an RTSP message");
+      msg->arena_size = size;
+      conn->partial = msg;
+    }
+    wanted = size - msg->arena_used;
+  }
+  ssize_t nread = read(conn->fd, msg->arena + msg->arena_used, wanted);
+  if (!nread) {
+    debug(1, "RTSP connection closed.");
+    return rtsp_read_request_response_shutdown_requested;
+  }
+  if (nread < 0) {
+    if (errno == EINTR)
+      return rtsp_read_request_response_ok;
+    perror("read failure");
+    return rtsp_read_request_response_error;
+  }
+  msg->arena_used += nread;
+
+  char *line, *end;
+  while ((conn->partial_size < 0) &&
+         (end = memchr((line = msg->arena + conn->partial_parsed), '\n',
+                       msg->arena_used - conn->partial_parsed))) {
+    conn->partial_parsed = end + 1 - msg->arena;
+    *end = 0;
+    if ((end > line) && (end[-1] == '\r'))
+      end[-1] = 0;
+    conn->partial_size = msg_handle_line(&conn->partial, line);
+    msg = conn->partial;
+    if (!msg) {
+      warn("no RTSP header received");
+      return rtsp_read_request_response_bad_packet;
+    }
+    if (conn->partial_size >= 0) {
+      size_t content_read = msg->arena_used - conn->partial_parsed;
+      if (content_read > (size_t)conn->partial_size) {
+        debug(1, "Ignoring %zu bytes after an RTSP request.",
+              content_read - conn->partial_size);
+        msg->arena_used = conn->partial_parsed + conn->partial_size;
+      }
+    }
+  }
+  return rtsp_read_request_response_ok;
+}
+
+// read the rest of a request whose headers are in, and pass it on
+static enum rtsp_read_request_response request_finish(rtsp_conn_info *conn,
+                                                      rtsp_message **the_packet) {
+  enum rtsp_read_request_response reply = rtsp_read_request_response_ok;
+  rtsp_message *msg = conn->partial;
+  size_t parsed = conn->partial_parsed;
+  int msg_size = conn->partial_size;
+  conn->partial = NULL;
+
+  uint64_t threshold_time =
+      get_absolute_time_in_fp() + ((uint64_t)5 << 32); // i.e. five seconds from now
+  int warning_message_sent = 0;
+
+#ifdef CONFIG_METADATA
+  char *ct = msg_get_header(msg, hdr_content_type);
+  if ((msg_size > 0) && (ct) && (!strncmp(ct, "image", 5)) &&
+      (!strcmp(msg->method, "SET_PARAMETER")) && (!capturing())) {
+    reply = stream_picture(conn, msg, parsed, msg_size, threshold_time, &warning_message_sent);
+    if (reply != rtsp_read_request_response_ok)
+      goto shutdown;
+    msg->content_streamed = 1;
+    *the_packet = msg;
+    return reply;
+  }
+#endif
+
+  if (parsed + msg_size > msg->arena_size) {
+    rtsp_message *bigger = realloc(msg, sizeof(rtsp_message) + parsed + msg_size);
+    if (!bigger) {
+      warn("too much content");
+      reply = rtsp_read_request_response_error;
+      goto shutdown; // msg is still good, and is freed there
+    }
+    msg = bigger;
+    msg->arena_size = parsed + msg_size;
+  }
+  reply = read_content(conn, msg->arena + msg->arena_used, parsed + msg_size - msg->arena_used,
+                       threshold_time, &warning_message_sent);
+  if (reply != rtsp_read_request_response_ok)
+    goto shutdown;
+  msg->arena_used = parsed + msg_size;
+
+  msg->contentlength = msg_size;
+  msg->content = msg->arena + parsed;
+  if (capturing())
+    capture_request(msg);
   *the_packet = msg;
   return reply;
 
@@ -548,39 +968,95 @@ shutdown:
   if (msg) {
     msg_free(msg); // which will free the content and everything else
   }
-  // in case the message wasn't formed or wasn't fully initialised
-  if ((msg && (msg->content == NULL)) || (!msg))
-    free(buf);
   *the_packet = NULL;
   return reply;
 }
 
+// read a request on a connection's own conversation thread, waiting for it as long as it takes
+static enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn,
+                                                         rtsp_message **the_packet) {
+  enum rtsp_read_request_response reply = rtsp_read_request_response_ok;
+  // the listener may have read the headers already
+  while ((conn->partial == NULL) || (conn->partial_size < 0)) {
+    if (!wait_for_request(conn)) {
+      debug(1, "RTSP shutdown requested.");
+      reply = rtsp_read_request_response_shutdown_requested;
+      break;
+    }
+    reply = request_read_part(conn);
+    if (reply != rtsp_read_request_response_ok)
+      break;
+  }
+  if (reply != rtsp_read_request_response_ok) {
+    request_discard(conn);
+    *the_packet = NULL;
+    return reply;
+  }
+  return request_finish(conn, the_packet);
+}
+
+// write all of the iovecs, carrying on after a partial write
+static int writev_fully(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while ((iovcnt) && ((size_t)n >= iov->iov_len)) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+static void add_iov(struct iovec *iov, int *iovcnt, const void *base, size_t len) {
+  iov[*iovcnt].iov_base = (void *)base;
+  iov[*iovcnt].iov_len = len;
+  (*iovcnt)++;
+}
+
+// the status line, the headers straight from the arena and the content go out in one writev()
 static void msg_write_response(int fd, rtsp_message *resp) {
-  char pkt[1024];
-  int pktfree = sizeof(pkt);
-  char *p = pkt;
-  int i, n;
+  // four pieces for each header, and the status line, Content-Length, blank line and content
+  struct iovec iov[4 * (sizeof(resp->name) / sizeof(resp->name[0])) + 4];
+  int iovcnt = 0;
+  char status_line[64], content_length[32];
+  int i;
 
-  n = snprintf(p, pktfree, "RTSP/1.0 %d %s\r\n", resp->respcode,
-               resp->respcode == 200 ? "OK" : "Error");
-  // debug(1, "sending response: %s", pkt);
-  pktfree -= n;
-  p += n;
+  int n = snprintf(status_line, sizeof(status_line), "RTSP/1.0 %d %s\r\n", resp->respcode,
+                   resp->respcode == 200 ? "OK" : "Error");
+  // debug(1, "sending response: %s", status_line);
+  add_iov(iov, &iovcnt, status_line, n);
 
   for (i = 0; i < resp->nheaders; i++) {
-    debug(2, "    %s: %s.", resp->name[i], resp->value[i]);
-    n = snprintf(p, pktfree, "%s: %s\r\n", resp->name[i], resp->value[i]);
-    pktfree -= n;
-    p += n;
-    if (pktfree <= 0)
-      die("Attempted to write overlong RTSP packet");
+    char *name = msg_header_name(resp, i);
+    char *value = msg_header_value(resp, i);
+    debug(2, "    %s: %s.", name, value);
+    add_iov(iov, &iovcnt, name, strlen(name));
+    add_iov(iov, &iovcnt, ": ", 2);
+    add_iov(iov, &iovcnt, value, strlen(value));
+    add_iov(iov, &iovcnt, "\r\n", 2);
   }
 
-  if (pktfree < 3)
-    die("Attempted to write overlong RTSP packet");
+  if (resp->contentlength) {
+    n = snprintf(content_length, sizeof(content_length), "Content-Length: %d\r\n",
+                 resp->contentlength);
+    add_iov(iov, &iovcnt, content_length, n);
+  }
+  add_iov(iov, &iovcnt, "\r\n", 2);
+  if (resp->contentlength)
+    add_iov(iov, &iovcnt, resp->content, resp->contentlength);
 
-  strcpy(p, "\r\n");
-  int ignore = write(fd, pkt, p - pkt + 2);
+  if (writev_fully(fd, iov, iovcnt) < 0)
+    debug(1, "Error %d writing an RTSP response.", errno);
 }
 
 static void handle_record(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
@@ -590,7 +1066,7 @@ static void handle_record(rtsp_conn_info *conn, rtsp_message *req, rtsp_message
   
   char *p;
   uint32_t rtptime = 0;
-  char *hdr = msg_get_header(req, "RTP-Info");
+  char *hdr = msg_get_header(req, hdr_rtp_info);
 
   if (hdr) {
     // debug(1,"FLUSH message received: \"%s\".",hdr);
@@ -619,7 +1095,7 @@ static void handle_teardown(rtsp_conn_info *conn, rtsp_message *req, rtsp_messag
     return;
   resp->respcode = 200;
   msg_add_header(resp, "Connection", "close");
-  please_shutdown = 1;
+  notifier_notify(&conn->stop);
 }
 
 static void handle_flush(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
@@ -627,7 +1103,7 @@ static void handle_flush(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *
     return;
   char *p;
   uint32_t rtptime = 0;
-  char *hdr = msg_get_header(req, "RTP-Info");
+  char *hdr = msg_get_header(req, hdr_rtp_info);
 
   if (hdr) {
     // debug(1,"FLUSH message received: \"%s\".",hdr);
@@ -650,22 +1126,22 @@ static void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *
   int lsport, lcport, ltport;
   uint32_t active_remote = 0;
 
-  char *ar = msg_get_header(req, "Active-Remote");
+  char *ar = msg_get_header(req, hdr_active_remote);
   if (ar) {
     debug(1,"Active-Remote string seen: \"%s\".",ar);
     // get the active remote
     char *p;
     active_remote = strtoul(ar, &p, 10);
 #ifdef CONFIG_METADATA
-    send_metadata('ssnc','acre',ar,strlen(ar),req,1);
+    send_metadata('ssnc', 'acre', ar, strlen(ar), req, metadata_coalesce);
 #endif
   }
 
 #ifdef CONFIG_METADATA
-  ar = msg_get_header(req, "DACP-ID");
+  ar = msg_get_header(req, hdr_dacp_id);
   if (ar) {
     debug(1,"DACP-ID string seen: \"%s\".",ar);
-    send_metadata('ssnc','daid',ar,strlen(ar),req,1);
+    send_metadata('ssnc', 'daid', ar, strlen(ar), req, metadata_coalesce);
   }
 #endif
 
@@ -680,7 +1156,7 @@ static void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *
   if (config.userSuppliedLatency)
     config.latency = config.userSuppliedLatency;
 
-  char *ua = msg_get_header(req, "User-Agent");
+  char *ua = msg_get_header(req, hdr_user_agent);
   if (ua == 0) {
     debug(1, "No User-Agent string found in the SETUP message. Using latency of %d frames.",
           config.latency);
@@ -711,7 +1187,7 @@ static void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *
       debug(2, "Unrecognised User-Agent. Using latency of %d frames.", config.latency);
     }
   }
-  char *hdr = msg_get_header(req, "Transport");
+  char *hdr = msg_get_header(req, hdr_transport);
   if (!hdr)
     goto error;
 
@@ -728,7 +1204,7 @@ static void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *
   p = strchr(p, '=') + 1;
   tport = atoi(p);
 
-  rtsp_take_player();
+  rtsp_take_player(conn);
   rtp_setup(&conn->remote, cport, tport, active_remote, &lsport, &lcport, &ltport);
   if (!lsport)
     goto error;
@@ -770,8 +1246,58 @@ error:
   resp->respcode = 451; // invalid arguments
 }
 
-static void handle_ignore(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
+// a GET_PARAMETER request for "statistics" gets the player's packet counts -- the impairment
+// proxy uses them -- how long taking the player from another session has taken, how many
+// connections there are and how much metadata has been dropped. Anything else is ignored.
+static void handle_get_parameter(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
   resp->respcode = 200;
+  char *cp = req->content;
+  int cp_left = req->contentlength;
+  char *next;
+  while ((cp_left >= 10) && cp) {
+    if (!strncmp(cp, "statistics", 10)) {
+      player_statistics statistics;
+      player_get_statistics(&statistics);
+      pthread_mutex_lock(&takeover_statistics_lock);
+      uint64_t count = takeovers, last = last_takeover_time, longest = longest_takeover_time;
+      pthread_mutex_unlock(&takeover_statistics_lock);
+      pthread_mutex_lock(&connection_statistics_lock);
+      uint64_t accepted = connections_accepted;
+      int open = connections_open, with_threads = connections_with_threads;
+      pthread_mutex_unlock(&connection_statistics_lock);
+      size_t size = 640;
+#ifdef CONFIG_METADATA
+      size += 80 * number_of_drop_counts;
+#endif
+      char *content = msg_content_alloc(resp, size);
+      if (content == NULL)
+        return;
+      resp->contentlength = snprintf(
+          content, size, "missing_packets: %llu\r\nlate_packets: %llu\r\ntoo_late_packets: "
+                        "%llu\r\nresend_requests: %llu\r\ntakeovers: %llu\r\n"
+                        "last_takeover_us: %llu\r\nlongest_takeover_us: %llu\r\n"
+                        "connections_accepted: %llu\r\nconnections_open: %d\r\n"
+                        "connections_idle: %d\r\nconversation_threads: %d\r\n",
+          (unsigned long long)statistics.missing_packets,
+          (unsigned long long)statistics.late_packets,
+          (unsigned long long)statistics.too_late_packets,
+          (unsigned long long)statistics.resend_requests, (unsigned long long)count,
+          (unsigned long long)((last * 1000000) >> 32),
+          (unsigned long long)((longest * 1000000) >> 32), (unsigned long long)accepted, open,
+          open - with_threads, with_threads);
+#ifdef CONFIG_METADATA
+      resp->contentlength +=
+          metadata_report_drops(content + resp->contentlength, size - resp->contentlength);
+#endif
+      resp->content = content;
+      msg_add_header(resp, "Content-Type", "text/parameters");
+      return;
+    }
+    next = nextline(cp, cp_left);
+    if (next)
+      cp_left -= next - cp;
+    cp = next;
+  }
 }
 
 static void handle_set_parameter_parameter(rtsp_conn_info *conn, rtsp_message *req,
@@ -795,7 +1321,7 @@ static void handle_set_parameter_parameter(rtsp_conn_info *conn, rtsp_message *r
       char *progress = cp + 10;
       debug(2, "progress: \"%s\"\n",
             progress); // rtpstampstart/rtpstampnow/rtpstampend 44100 per second
-      send_ssnc_metadata('prgr', strdup(progress), strlen(progress), 1);
+      send_ssnc_metadata('prgr', strdup(progress), strlen(progress), metadata_coalesce);
     } else
 #endif
     {
@@ -827,6 +1353,9 @@ static void handle_set_parameter_parameter(rtsp_conn_info *conn, rtsp_message *r
 // Here are the 'ssnc' codes defined so far:
 //    'PICT' -- the payload is a picture, either a JPEG or a PNG. Check the first few bytes to see
 //    which.
+//    'PICR' -- with a cover art cache, follows each picture received, whether or not it's been
+//    sent again as a 'PICT'. The picture's MD5 hash in hex, a space and the path of its file
+//    in the cache.
 //    'pbeg' -- play stream begin. No arguments
 //    'pend' -- play stream end. No arguments
 //    'pfls' -- play stream flush. No arguments
@@ -906,11 +1435,13 @@ char *base64_encode_so(const unsigned char *data, size_t input_length, char *enc
 //
 
 static int fd = -1;
-static int dirty = 0;
 pc_queue metadata_queue;
-#define metadata_queue_size 500
+#define metadata_queue_size 512 // must be a power of two
 metadata_package metadata_queue_items[metadata_queue_size];
 
+// how long an item sent with metadata_block will wait for room in the queue, in milliseconds
+#define METADATA_QUEUE_TIMEOUT 100
+
 static pthread_t metadata_thread;
 
 void metadata_create(void) {
@@ -928,89 +1459,517 @@ void metadata_create(void) {
   free(path);
 }
 
-void metadata_open(void) {
+// A reader may come and go. While there's none, opening the pipe is only tried again after a
+// while, the wait doubling each time up to METADATA_REOPEN_MAXIMUM_INTERVAL.
+#define METADATA_REOPEN_MINIMUM_INTERVAL 50  // milliseconds
+#define METADATA_REOPEN_MAXIMUM_INTERVAL 1000 // milliseconds
+static uint64_t next_open_time = 0;
+static uint64_t open_interval = 0;
+
+static void metadata_open(void) {
   if (config.metadata_enabled == 0)
     return;
+  uint64_t time_now = get_absolute_time_in_fp();
+  if (time_now < next_open_time)
+    return;
+  fd = open(config.metadata_pipename, O_WRONLY | O_NONBLOCK);
+  if (fd < 0) {
+    if (open_interval == 0)
+      open_interval = ((uint64_t)METADATA_REOPEN_MINIMUM_INTERVAL << 32) / 1000;
+    else if (open_interval < ((uint64_t)METADATA_REOPEN_MAXIMUM_INTERVAL << 32) / 1000)
+      open_interval *= 2;
+    next_open_time = time_now + open_interval;
+  } else {
+    open_interval = 0;
+  }
+}
 
-  size_t pl = strlen(config.metadata_pipename) + 1;
+// Items are formatted into a set of blocks, which are written to the pipe with writev() when
+// they're full or when there's nothing more to write for the moment.
+#define METADATA_BLOCK_SIZE 16384
+#define METADATA_BLOCKS 4
+static char metadata_blocks[METADATA_BLOCKS][METADATA_BLOCK_SIZE];
+static struct iovec metadata_iov[METADATA_BLOCKS];
+static int metadata_blocks_used = 0; // the last one may be partly filled
 
-  char *path = malloc(pl + 1);
-  snprintf(path, pl + 1, "%s", config.metadata_pipename);
+static void metadata_close(void) {
+  close(fd);
+  fd = -1;
+  metadata_blocks_used = 0; // anything not written is lost
+}
 
-  fd = open(path, O_WRONLY | O_NONBLOCK);
-  // if (fd < 0)
-  //    debug(1, "Could not open metadata FIFO %s. Will try again later.", path);
+// write out what's been formatted, followed by length bytes of data, if there are any. Returns 0
+// if the reader has gone.
+static int metadata_flush_with(const char *data, size_t length) {
+  struct iovec iovs[METADATA_BLOCKS + 1];
+  struct iovec *iov = iovs;
+  int iovcnt = metadata_blocks_used;
+  memcpy(iovs, metadata_iov, iovcnt * sizeof(struct iovec));
+  if (length) {
+    iovs[iovcnt].iov_base = (void *)data;
+    iovs[iovcnt].iov_len = length;
+    iovcnt++;
+  }
+  while ((iovcnt) && (fd >= 0)) {
+    ssize_t written = writev(fd, iov, iovcnt);
+    if (written >= 0) {
+      while ((iovcnt) && ((size_t)written >= iov->iov_len)) {
+        written -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt) {
+        iov->iov_base = (char *)iov->iov_base + written;
+        iov->iov_len -= written;
+      }
+    } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      // the reader is behind; wait for it
+      struct pollfd ufds[1];
+      ufds[0].fd = fd;
+      ufds[0].events = POLLOUT;
+      if (poll(ufds, 1, 5000) == 0)
+        debug(1, "timeout waiting for the metadata pipe to unblock");
+    } else if (errno != EINTR) {
+      debug(1, "the metadata pipe's reader has gone.");
+      metadata_close();
+    }
+  }
+  metadata_blocks_used = 0;
+  return (fd >= 0);
+}
 
-  free(path);
+static int metadata_flush(void) { return metadata_flush_with(NULL, 0); }
+
+// make room for at least minimum bytes at the end of the blocks, flushing them if they're full.
+// Returns a pointer to the room and sets *available to how much there is, or NULL if the reader
+// has gone.
+static char *metadata_reserve(size_t minimum, size_t *available) {
+  struct iovec *last = metadata_blocks_used ? &metadata_iov[metadata_blocks_used - 1] : NULL;
+  if ((last == NULL) || (METADATA_BLOCK_SIZE - last->iov_len < minimum)) {
+    if ((metadata_blocks_used == METADATA_BLOCKS) && (metadata_flush() == 0))
+      return NULL;
+    last = &metadata_iov[metadata_blocks_used];
+    last->iov_base = metadata_blocks[metadata_blocks_used];
+    last->iov_len = 0;
+    metadata_blocks_used++;
+  }
+  *available = METADATA_BLOCK_SIZE - last->iov_len;
+  return (char *)last->iov_base + last->iov_len;
 }
 
-static void metadata_close(void) {
-  close(fd);
-  fd = -1;
+static void metadata_commit(size_t length) {
+  metadata_iov[metadata_blocks_used - 1].iov_len += length;
 }
 
-void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length) {
+static int metadata_append_bytes(const void *bytes, size_t length) {
+  size_t available;
+  char *room = metadata_reserve(length, &available);
+  if (room == NULL)
+    return 0;
+  memcpy(room, bytes, length);
+  metadata_commit(length);
+  return 1;
+}
+
+static int metadata_append(const char *string) {
+  return metadata_append_bytes(string, strlen(string));
+}
+
+// With the binary format, an item is its type, code and length as 32-bit big-endian numbers,
+// followed by the data as it is. An item is always given all the data its length promises;
+// if it's cut short, it's made up with zeros.
+static uint32_t item_data_remaining = 0; // of the item being written
+
+// the three parts of an item written to the pipe. Each returns 0 if there's no reader or the
+// write failed, in which case the rest of the item should be skipped.
+static int metadata_write_start(uint32_t type, uint32_t code, uint32_t length, int has_data) {
   debug(2, "Process metadata with type %x, code %x and length %u.", type, code, length);
-  int ret;
   // readers may go away and come back
   if (fd < 0)
     metadata_open();
   if (fd < 0)
-    return;
+    return 0;
+  item_data_remaining = has_data ? length : 0;
+  if (config.metadata_binary) {
+    uint32_t header[3];
+    header[0] = htonl(type);
+    header[1] = htonl(code);
+    header[2] = htonl(item_data_remaining);
+    return metadata_append_bytes(header, sizeof(header));
+  }
   char thestring[1024];
   snprintf(thestring, 1024, "<item><type>%x</type><code>%x</code><length>%u</length>", type, code,
            length);
-  ret = non_blocking_write(fd, thestring, strlen(thestring));
-  if (ret < 1)
+  if (metadata_append(thestring) == 0)
+    return 0;
+  if (has_data)
+    return metadata_append("\n<data encoding=\"base64\">\n");
+  return 1;
+}
+
+// the data is encoded straight into the blocks, in multiples of three bytes, so that only the
+// end of the last piece is padded
+static int metadata_write_data(char *data, uint32_t length) {
+  if (length > item_data_remaining) // the binary format can't have more than was promised
+    length = item_data_remaining;
+  item_data_remaining -= length;
+  if (config.metadata_binary) {
+    // big pieces go from where they are, along with anything already formatted
+    if (length >= METADATA_BLOCK_SIZE)
+      return metadata_flush_with(data, length);
+    return metadata_append_bytes(data, length);
+  }
+  size_t remaining_count = length;
+  unsigned char *remaining_data = (unsigned char *)data;
+  while (remaining_count) {
+    size_t available;
+    char *room = metadata_reserve(4, &available);
+    if (room == NULL)
+      return 0;
+    size_t towrite_count = (available / 4) * 3;
+    if (towrite_count > remaining_count)
+      towrite_count = remaining_count;
+    size_t outbuf_size = available; // size of output buffer on entry, length of result on exit
+    if (base64_encode_so(remaining_data, towrite_count, room, &outbuf_size) == NULL)
+      debug(1, "Error encoding base64 data.");
+    metadata_commit(outbuf_size);
+    remaining_data += towrite_count;
+    remaining_count -= towrite_count;
+  }
+  return 1;
+}
+
+static int metadata_write_end(int has_data) {
+  if (config.metadata_binary) {
+    static const char zeros[256];
+    while (item_data_remaining) {
+      uint32_t length = item_data_remaining > sizeof(zeros) ? sizeof(zeros) : item_data_remaining;
+      if (metadata_append_bytes(zeros, length) == 0)
+        return 0;
+      item_data_remaining -= length;
+    }
+    return 1;
+  }
+  if ((has_data) && (metadata_append("</data>") == 0))
+    return 0;
+  return metadata_append("</item>\n");
+}
+
+// write an item to the pipe and publish it to the ring
+static void metadata_output(uint32_t type, uint32_t code, char *data, uint32_t length) {
+  int has_data = (data != NULL) && (length > 0);
+  if (metadata_write_start(type, code, length, has_data) &&
+      ((!has_data) || metadata_write_data(data, length)))
+    metadata_write_end(has_data);
+  if ((config.metadata_shm_name) &&
+      (metadata_ring_publish(type, code, data, has_data ? length : 0) == 0))
+    debug(1, "An item of metadata of %u bytes could not be published to the metadata ring.",
+          length);
+}
+
+// With a cover art cache, each different picture is sent once, as a 'PICT' item, straight from
+// the cache. Every picture, sent or not, is followed by a 'PICR' item giving its hash and where
+// it's cached.
+static int is_picture(uint32_t type, uint32_t code) {
+  return (type == 'ssnc') && (code == 'PICT') && (config.metadata_cover_art_cache_directory);
+}
+
+static void metadata_output_cached_picture(void) {
+  picture_cache_entry entry;
+  enum picture_cache_result result = picture_cache_end(&entry);
+  if (result == picture_cache_failed)
     return;
-  if ((data != NULL) && (length > 0)) {
-    snprintf(thestring, 1024, "\n<data encoding=\"base64\">\n");
-    ret = non_blocking_write(fd, thestring, strlen(thestring));
-    if (ret < 1) // no reader
+  if (result == picture_cache_new) {
+    int file = open(entry.path, O_RDONLY);
+    if (file < 0) {
+      debug(1, "Could not open the cached picture \"%s\": %s.", entry.path, strerror(errno));
       return;
-    // here, we write the data in base64 form using our nice base64 encoder
-    // but, we break it into lines of 76 output characters, except for the last one.
-    // thus, we send groups of (76/4)*3 =  57 bytes to the encoder at a time
-    size_t remaining_count = length;
-    char *remaining_data = data;
-    size_t towrite_count;
-    char outbuf[76];
-    while ((remaining_count) && (ret >= 0)) {
-      size_t towrite_count = remaining_count;
-      if (towrite_count > 57)
-        towrite_count = 57;
-      size_t outbuf_size = 76; // size of output buffer on entry, length of result on exit
-      if (base64_encode_so((unsigned char *)remaining_data, towrite_count, outbuf, &outbuf_size) == NULL)
-        debug(1, "Error encoding base64 data.");
-      // debug(1,"Remaining count: %d ret: %d, outbuf_size: %d.",remaining_count,ret,outbuf_size);
-      ret = non_blocking_write(fd, outbuf, outbuf_size);
-      if (ret < 0)
-        return;
-      remaining_data += towrite_count;
-      remaining_count -= towrite_count;
     }
-    snprintf(thestring, 1024, "</data>");
-    ret = non_blocking_write(fd, thestring, strlen(thestring));
-    if (ret < 1) // no reader
+    int writing = metadata_write_start('ssnc', 'PICT', entry.size, 1);
+    int publishing = (config.metadata_shm_name) &&
+                     (metadata_ring_start('ssnc', 'PICT', entry.size) != 0);
+    char chunk[57 * 64]; // whole lines of base64
+    ssize_t nread;
+    while ((nread = read(file, chunk, sizeof(chunk))) > 0) {
+      if (writing)
+        writing = metadata_write_data(chunk, nread);
+      if (publishing)
+        metadata_ring_data(chunk, nread);
+    }
+    close(file);
+    if (writing) // any shortfall is made up
+      metadata_write_end(1);
+    metadata_ring_end();
+  } else {
+    debug(2, "The picture \"%s\" has been sent before.", entry.path);
+  }
+  char reference[sizeof(entry.hash) + sizeof(entry.path)];
+  snprintf(reference, sizeof(reference), "%s %s", entry.hash, entry.path);
+  metadata_output('ssnc', 'PICR', reference, strlen(reference));
+}
+
+void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length) {
+  if ((is_picture(type, code)) && (picture_cache_start(length) == 0)) {
+    picture_cache_data(data, length);
+    metadata_output_cached_picture();
+  } else {
+    metadata_output(type, code, data, length);
+  }
+}
+
+static void metadata_release(metadata_package *pack) {
+  if (pack->carrier)
+    msg_free(pack->carrier); // release the message
+  else if (pack->data)
+    free(pack->data);
+}
+
+// Whole items that arrive while another item's parts are being written are held back until it's
+// finished, so that they don't land in the middle of it.
+static int streaming = 0; // set while an item's parts are going to a reader
+static int caching = 0;   // set while a picture's parts are going to the cover art cache
+static uint32_t streaming_item = 0;
+// items whose senders have given up on sending the rest of them, by item number modulo the size
+#define number_of_abandoned_items 64
+static uint32_t abandoned_items[number_of_abandoned_items];
+static metadata_package *deferred_packages = NULL;
+static int deferred_count = 0, deferred_capacity = 0;
+
+static void metadata_defer(metadata_package *pack) {
+  if (deferred_count == deferred_capacity) {
+    int capacity = deferred_capacity ? deferred_capacity * 2 : 16;
+    metadata_package *packages = realloc(deferred_packages, capacity * sizeof(metadata_package));
+    if (packages == NULL) {
+      warn("Dropping metadata of type 0x%08X, code 0x%08X, sent during a picture.", pack->type,
+           pack->code);
+      metadata_release(pack);
       return;
+    }
+    deferred_packages = packages;
+    deferred_capacity = capacity;
   }
-  snprintf(thestring, 1024, "</item>\n");
-  ret = non_blocking_write(fd, thestring, strlen(thestring));
-  if (ret < 1) // no reader
-    return;
+  deferred_packages[deferred_count++] = *pack;
+}
+
+// close off the item being streamed, complete or not, and write what was held back meanwhile
+static void metadata_finish_item(void) {
+  int i;
+  if (caching)
+    metadata_output_cached_picture();
+  if (streaming)
+    metadata_write_end(1);
+  metadata_ring_end();
+  caching = 0;
+  streaming = 0;
+  streaming_item = 0;
+  for (i = 0; i < deferred_count; i++) {
+    metadata_process(deferred_packages[i].type, deferred_packages[i].code,
+                     deferred_packages[i].data, deferred_packages[i].length);
+    metadata_release(&deferred_packages[i]);
+  }
+  deferred_count = 0;
+}
+
+// write a part of an item that's being sent as it arrives. Parts of an item that has already
+// been finished -- because its sender gave up on it -- are ignored.
+static void metadata_process_part(metadata_package *pack) {
+  switch (pack->part) {
+  case metadata_start:
+    if (streaming_item)
+      metadata_finish_item();
+    streaming_item = pack->item;
+    caching = (is_picture(pack->type, pack->code)) && (picture_cache_start(pack->length) == 0);
+    if (caching)
+      break;
+    streaming = metadata_write_start(pack->type, pack->code, pack->length, pack->length > 0);
+    if ((config.metadata_shm_name) &&
+        (metadata_ring_start(pack->type, pack->code, pack->length) == 0))
+      debug(1, "An item of metadata of %u bytes is too big for the metadata ring.", pack->length);
+    break;
+  case metadata_data:
+    if ((caching) && (pack->item == streaming_item))
+      picture_cache_data(pack->data, pack->length);
+    if ((streaming) && (pack->item == streaming_item))
+      streaming = metadata_write_data(pack->data, pack->length);
+    if (pack->item == streaming_item)
+      metadata_ring_data(pack->data, pack->length);
+    break;
+  case metadata_end:
+    if (pack->item == streaming_item)
+      metadata_finish_item();
+    break;
+  default:
+    break;
+  }
+}
+
+static void metadata_abandon_item(uint32_t item) {
+  __atomic_store_n(&abandoned_items[item % number_of_abandoned_items], item, __ATOMIC_RELEASE);
+  pc_queue_wake_consumer(&metadata_queue);
+}
+
+// Items sent with metadata_coalesce whose codes are listed here are kept out of the queue, one per
+// code, and a newer one replaces an older one that hasn't been written yet. The queue carries a
+// marker, which picks up whichever one is there when it's reached.
+static const uint32_t coalesced_codes[] = {'pvol', 'prgr', 'prsm', 'acre', 'daid', 'snam', 'snua'};
+#define number_of_coalesced_codes (sizeof(coalesced_codes) / sizeof(uint32_t))
+static metadata_package *coalesced_packages[number_of_coalesced_codes];
+
+static int coalesced_code_index(uint32_t code) {
+  unsigned int i;
+  for (i = 0; i < number_of_coalesced_codes; i++)
+    if (coalesced_codes[i] == code)
+      return i;
+  return -1;
+}
+
+// how many items of each code have been dropped or replaced because the queue was full
+static struct {
+  uint32_t code;
+  uint32_t dropped, coalesced;
+} drop_counts[number_of_drop_counts];
+
+static void metadata_count_drop(uint32_t code, int coalesced) {
+  int i;
+  for (i = 0; i < number_of_drop_counts; i++) {
+    uint32_t entry_code = __atomic_load_n(&drop_counts[i].code, __ATOMIC_ACQUIRE);
+    if (entry_code == 0) // claim it, unless someone else just has
+      if (__atomic_compare_exchange_n(&drop_counts[i].code, &entry_code, code, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        entry_code = code;
+    if (entry_code == code) {
+      if (coalesced)
+        __atomic_add_fetch(&drop_counts[i].coalesced, 1, __ATOMIC_RELAXED);
+      else
+        __atomic_add_fetch(&drop_counts[i].dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+// report the drop counts as "metadata_dropped_<code>: n" and "metadata_coalesced_<code>: n" lines
+static int metadata_report_drops(char *buf, size_t size) {
+  size_t used = 0;
+  int i;
+  for (i = 0; (i < number_of_drop_counts) && (used < size); i++) {
+    uint32_t code = __atomic_load_n(&drop_counts[i].code, __ATOMIC_ACQUIRE);
+    if (code == 0)
+      break;
+    used += snprintf(buf + used, size - used,
+                     "metadata_dropped_%c%c%c%c: %u\r\nmetadata_coalesced_%c%c%c%c: %u\r\n",
+                     code >> 24, (code >> 16) & 0xff, (code >> 8) & 0xff, code & 0xff,
+                     __atomic_load_n(&drop_counts[i].dropped, __ATOMIC_RELAXED), code >> 24,
+                     (code >> 16) & 0xff, (code >> 8) & 0xff, code & 0xff,
+                     __atomic_load_n(&drop_counts[i].coalesced, __ATOMIC_RELAXED));
+  }
+  if (used > size)
+    used = size;
+  return used;
+}
+
+// get rid of a package that's been dropped
+static void metadata_discard(metadata_package *pack) {
+  if (pack->part == metadata_coalesced) { // drop whatever item the marker stands for
+    int i = coalesced_code_index(pack->code);
+    metadata_package *coalesced =
+        __atomic_exchange_n(&coalesced_packages[i], NULL, __ATOMIC_ACQ_REL);
+    if (coalesced) {
+      metadata_count_drop(coalesced->code, 0);
+      metadata_release(coalesced);
+      free(coalesced);
+    }
+  } else {
+    metadata_count_drop(pack->code, 0);
+    metadata_release(pack);
+  }
+  debug(2, "Metadata queue is full, dropped an item of type 0x%08X, code 0x%08X.", pack->type,
+        pack->code);
+}
+
+// queue a package without waiting. If the queue is full, the oldest item goes to make room for
+// it, if it may be dropped; otherwise this one is dropped.
+static int metadata_add_dropping_oldest(metadata_package *pack) {
+  int rc;
+  while ((rc = pc_queue_add_item(&metadata_queue, pack, 1, 0)) == EAGAIN) {
+    metadata_package oldest;
+    rc = pc_queue_try_take(&metadata_queue, &oldest, 1);
+    if (rc == 0)
+      metadata_discard(&oldest);
+    else if (rc == EPERM)
+      break;
+  }
+  if (rc)
+    metadata_discard(pack);
+  return rc;
+}
+
+// put the package in its code's place, replacing what's there. Only if nothing was there is a
+// marker for it queued.
+static int metadata_add_coalescing(metadata_package *pack, int index) {
+  metadata_package *coalesced = malloc(sizeof(metadata_package));
+  if (coalesced == NULL) {
+    metadata_discard(pack);
+    return ENOMEM;
+  }
+  *coalesced = *pack;
+  metadata_package *previous =
+      __atomic_exchange_n(&coalesced_packages[index], coalesced, __ATOMIC_ACQ_REL);
+  if (previous) {
+    metadata_count_drop(previous->code, 1);
+    metadata_release(previous);
+    free(previous);
+    return 0;
+  }
+  metadata_package marker;
+  memset(&marker, 0, sizeof(marker));
+  marker.type = pack->type;
+  marker.code = pack->code;
+  marker.part = metadata_coalesced;
+  return metadata_add_dropping_oldest(&marker); // if it's dropped, so is the item
 }
 
 void *metadata_thread_function(void *ignore) {
+  thread_policy_apply(thread_role_metadata);
   metadata_create();
+  if ((config.metadata_enabled) && (config.metadata_shm_name))
+    metadata_ring_create(config.metadata_shm_name, config.metadata_shm_size);
+  if ((config.metadata_enabled) && (config.metadata_cover_art_cache_directory) &&
+      (picture_cache_open(config.metadata_cover_art_cache_directory,
+                          config.metadata_cover_art_cache_size) != 0))
+    config.metadata_cover_art_cache_directory = NULL; // send pictures as they are
   metadata_package pack;
   while (1) {
-    pc_queue_get_item(&metadata_queue, &pack);
-    if (config.metadata_enabled)
-      metadata_process(pack.type, pack.code, pack.data, pack.length);
-    if (pack.carrier)
-      msg_free(pack.carrier); // release the message
-    else if (pack.data)
-      free(pack.data);
+    // write out what's been formatted before waiting for more
+    if ((metadata_blocks_used) && (pc_queue_is_empty(&metadata_queue)))
+      metadata_flush();
+    int rc = pc_queue_get_item(&metadata_queue, &pack);
+    if ((streaming_item) &&
+        (__atomic_load_n(&abandoned_items[streaming_item % number_of_abandoned_items],
+                         __ATOMIC_ACQUIRE) == streaming_item)) {
+      debug(1, "Closing off an incomplete item of metadata.");
+      metadata_finish_item();
+    }
+    if (rc)
+      continue;
+    if (pack.part == metadata_coalesced) {
+      metadata_package *coalesced = __atomic_exchange_n(
+          &coalesced_packages[coalesced_code_index(pack.code)], NULL, __ATOMIC_ACQ_REL);
+      if (coalesced == NULL) // it was dropped
+        continue;
+      pack = *coalesced;
+      free(coalesced);
+    }
+    if (config.metadata_enabled) {
+      if (pack.part != metadata_whole) {
+        metadata_process_part(&pack);
+      } else if (streaming_item) {
+        metadata_defer(&pack);
+        continue;
+      } else {
+        metadata_process(pack.type, pack.code, pack.data, pack.length);
+      }
+    }
+    metadata_release(&pack);
   }
   pthread_exit(NULL);
 }
@@ -1025,7 +1984,7 @@ void metadata_init(void) {
 }
 
 int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
-                  int block) {
+                  enum metadata_policy policy) {
 
   // parameters: type, code, pointer to data or NULL, length of data or NULL, the rtsp_message or
   // NULL
@@ -1047,16 +2006,45 @@ int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rts
   metadata_package pack;
   pack.type = type;
   pack.code = code;
+  pack.part = metadata_whole;
+  pack.item = 0;
   pack.data = data;
   pack.length = length;
   if (carrier)
     msg_retain(carrier);
   pack.carrier = carrier;
-  int rc = pc_queue_add_item(&metadata_queue, &pack, block);
-  if ((rc == EBUSY) && (carrier))
-    msg_free(carrier);
-  if (rc == EBUSY)
-    warn("Metadata queue is busy, dropping message of type 0x%08X, code 0x%08X.", type, code);
+  int rc;
+  int index = coalesced_code_index(code);
+  if ((policy == metadata_coalesce) && (index >= 0)) {
+    rc = metadata_add_coalescing(&pack, index);
+  } else if (policy == metadata_block) {
+    rc = pc_queue_add_item(&metadata_queue, &pack, 0, METADATA_QUEUE_TIMEOUT);
+    if (rc)
+      metadata_discard(&pack);
+  } else {
+    rc = metadata_add_dropping_oldest(&pack);
+  }
+  return rc;
+}
+
+// send a part of an item that's being sent as it arrives. The parts of an item mustn't be
+// dropped or interleaved with other items, so this waits a while for room; if there's still
+// none, the part is dropped and the sender should give up on the item.
+static int send_metadata_part(uint32_t type, uint32_t code, enum metadata_part part, uint32_t item,
+                              char *data, uint32_t length, rtsp_message *carrier) {
+  metadata_package pack;
+  pack.type = type;
+  pack.code = code;
+  pack.part = part;
+  pack.item = item;
+  pack.data = data;
+  pack.length = length;
+  if (carrier)
+    msg_retain(carrier);
+  pack.carrier = carrier;
+  int rc = pc_queue_add_item(&metadata_queue, &pack, 0, METADATA_QUEUE_TIMEOUT);
+  if (rc)
+    metadata_discard(&pack);
   return rc;
 }
 
@@ -1070,7 +2058,7 @@ static void handle_set_parameter_metadata(rtsp_conn_info *conn, rtsp_message *re
   // inform the listener that a set of metadata is starting
   // this doesn't include the cover art though...
 
-  send_metadata('ssnc', 'mdst', NULL, 0, NULL, 1);
+  send_metadata('ssnc', 'mdst', NULL, 0, NULL, metadata_block);
 
   while (off < cl) {
     // pick up the metadata tag as an unsigned longint
@@ -1083,16 +2071,16 @@ static void handle_set_parameter_metadata(rtsp_conn_info *conn, rtsp_message *re
 
     // pass the data over
     if (vl == 0)
-      send_metadata('core', itag, NULL, 0, NULL, 1);
+      send_metadata('core', itag, NULL, 0, NULL, metadata_block);
     else
-      send_metadata('core', itag, (char *)(cp + off), vl, req, 1);
+      send_metadata('core', itag, (char *)(cp + off), vl, req, metadata_block);
 
     // move on to the next item
     off += vl;
   }
 
   // inform the listener that a set of metadata is ending
-  send_metadata('ssnc', 'mden', NULL, 0, NULL, 1);
+  send_metadata('ssnc', 'mden', NULL, 0, NULL, metadata_block);
 }
 
 #endif
@@ -1101,7 +2089,7 @@ static void handle_set_parameter(rtsp_conn_info *conn, rtsp_message *req, rtsp_m
   // if (!req->contentlength)
   //    debug(1, "received empty SET_PARAMETER request.");
 
-  char *ct = msg_get_header(req, "Content-Type");
+  char *ct = msg_get_header(req, hdr_content_type);
 
   if (ct) {
     debug(2, "SET_PARAMETER Content-Type:\"%s\".", ct);
@@ -1113,7 +2101,8 @@ static void handle_set_parameter(rtsp_conn_info *conn, rtsp_message *req, rtsp_m
       // debug(1, "received image in SET_PARAMETER request.");
       // note: the image/type tag isn't reliable, so it's not being sent
       // -- best look at the first few bytes of the image
-      send_metadata('ssnc', 'PICT', req->content, req->contentlength, req, 1);
+      if (!req->content_streamed)
+        send_metadata('ssnc', 'PICT', req->content, req->contentlength, req, metadata_block);
     } else
 #endif
         if (!strncmp(ct, "text/parameters", 15)) {
@@ -1204,18 +2193,18 @@ static void handle_announce(rtsp_conn_info *conn, rtsp_message *req, rtsp_messag
     for (i = 0; i < sizeof(conn->stream.fmtp) / sizeof(conn->stream.fmtp[0]); i++)
       conn->stream.fmtp[i] = atoi(strsep(&pfmtp, " \t"));
 
-    char *hdr = msg_get_header(req, "X-Apple-Client-Name");
+    char *hdr = msg_get_header(req, hdr_x_apple_client_name);
     if (hdr) {
       debug(1, "Play connection from device named \"%s\".", hdr);
       #ifdef CONFIG_METADATA
-      send_metadata('ssnc','snam',hdr,strlen(hdr),req,1);
+      send_metadata('ssnc', 'snam', hdr, strlen(hdr), req, metadata_coalesce);
       #endif
     }
-    hdr = msg_get_header(req, "User-Agent");
+    hdr = msg_get_header(req, hdr_user_agent);
     if (hdr) {
       debug(1, "Play connection from user agent \"%s\".", hdr);
       #ifdef CONFIG_METADATA
-      send_metadata('ssnc','snua',hdr,strlen(hdr),req,1);
+      send_metadata('ssnc', 'snua', hdr, strlen(hdr), req, metadata_coalesce);
       #endif
     }
     resp->respcode = 200;
@@ -1238,13 +2227,13 @@ static struct method_handler {
                        {"FLUSH", handle_flush},
                        {"TEARDOWN", handle_teardown},
                        {"SETUP", handle_setup},
-                       {"GET_PARAMETER", handle_ignore},
+                       {"GET_PARAMETER", handle_get_parameter},
                        {"SET_PARAMETER", handle_set_parameter},
                        {"RECORD", handle_record},
                        {NULL, NULL}};
 
 static void apple_challenge(int fd, rtsp_message *req, rtsp_message *resp) {
-  char *hdr = msg_get_header(req, "Apple-Challenge");
+  char *hdr = msg_get_header(req, hdr_apple_challenge);
   if (!hdr)
     return;
 
@@ -1320,7 +2309,7 @@ static int rtsp_auth(char **nonce, rtsp_message *req, rtsp_message *resp) {
     goto authenticate;
   }
 
-  char *hdr = msg_get_header(req, "Authorization");
+  char *hdr = msg_get_header(req, hdr_authorization);
   if (!hdr || strncmp(hdr, "Digest ", 7))
     goto authenticate;
 
@@ -1431,51 +2420,50 @@ authenticate:
   return 1;
 }
 
-static void *rtsp_conversation_thread_func(void *pconn) {
-  // SIGUSR1 is used to interrupt this thread if blocked for read
-  sigset_t set;
-  sigemptyset(&set);
-  sigaddset(&set, SIGUSR1);
-  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+// respond to a request, on whichever thread is looking after the connection
+static void handle_request(rtsp_conn_info *conn, rtsp_message *req) {
+  rtsp_message *resp = msg_init(MSG_ARENA_SIZE);
+  resp->respcode = 400;
+
+  apple_challenge(conn->fd, req, resp);
+  char *hdr = msg_get_header(req, hdr_cseq);
+  if (hdr)
+    msg_add_header(resp, "CSeq", hdr);
+  msg_add_header(resp, "Audio-Jack-Status", "connected; type=analog");
+
+  if (rtsp_auth(&conn->auth_nonce, req, resp))
+    goto respond;
+
+  struct method_handler *mh;
+  for (mh = method_handlers; mh->method; mh++) {
+    if (!strcmp(mh->method, req->method)) {
+      //debug(1,"RTSP Packet received of type \"%s\":",mh->method),
+      //msg_print_debug_headers(req);
+      mh->handler(conn, req, resp);
+      //debug(1,"RTSP Response:");
+      //msg_print_debug_headers(resp);
+      break;
+    }
+  }
+
+respond:
+  msg_write_response(conn->fd, resp);
+  msg_free(req);
+  msg_free(resp);
+}
 
+static void *rtsp_conversation_thread_func(void *pconn) {
+  thread_policy_apply(thread_role_rtsp);
   rtsp_conn_info *conn = pconn;
 
-  rtsp_message *req, *resp;
-  char *hdr, *auth_nonce = NULL;
+  rtsp_message *req;
 
   enum rtsp_read_request_response reply;
 
   do {
-    reply = rtsp_read_request(conn->fd, &req);
+    reply = rtsp_read_request(conn, &req);
     if (reply == rtsp_read_request_response_ok) {
-      resp = msg_init();
-      resp->respcode = 400;
-
-      apple_challenge(conn->fd, req, resp);
-      hdr = msg_get_header(req, "CSeq");
-      if (hdr)
-        msg_add_header(resp, "CSeq", hdr);
-      msg_add_header(resp, "Audio-Jack-Status", "connected; type=analog");
-
-      if (rtsp_auth(&auth_nonce, req, resp))
-        goto respond;
-
-      struct method_handler *mh;
-      for (mh = method_handlers; mh->method; mh++) {
-        if (!strcmp(mh->method, req->method)) {
-          //debug(1,"RTSP Packet received of type \"%s\":",mh->method),
-          //msg_print_debug_headers(req);
-          mh->handler(conn, req, resp);
-          //debug(1,"RTSP Response:");
-          //msg_print_debug_headers(resp);
-          break;
-        }
-      }
-
-    respond:
-      msg_write_response(conn->fd, resp);
-      msg_free(req);
-      msg_free(resp);
+      handle_request(conn, req);
     } else {
       if (reply != rtsp_read_request_response_shutdown_requested)
         debug(1, "rtsp_read_request error %d, packet ignored.", (int)reply);
@@ -1489,16 +2477,70 @@ static void *rtsp_conversation_thread_func(void *pconn) {
     rtp_shutdown();
     player_stop();
     pthread_mutex_unlock(&play_lock);
-    please_shutdown = 0;
+    pthread_mutex_lock(&playing_conn_lock);
+    playing_conn = NULL;
+    pthread_mutex_unlock(&playing_conn_lock);
     pthread_mutex_unlock(&playing_mutex);
   }
-  if (auth_nonce)
-    free(auth_nonce);
   conn->running = 0;
+  notifier_notify(&listener_wakeup); // so that it joins this thread
   debug(2, "terminating RTSP thread.");
   return NULL;
 }
 
+// Read what's waiting on a connection the listener is looking after. OPTIONS and GET_PARAMETER
+// are answered here once they're all in; anything else starts a session, so as soon as its
+// headers are in, the connection gets a conversation thread of its own, which reads the rest of
+// the request and handles it. Return 0 if the connection should be closed.
+static int listener_serve(rtsp_conn_info *conn) {
+  if (conn->partial == NULL)
+    conn->request_deadline =
+        get_absolute_time_in_fp() + ((uint64_t)LISTENER_REQUEST_TIMEOUT << 32) / 1000;
+  enum rtsp_read_request_response reply = request_read_part(conn);
+  if (reply == rtsp_read_request_response_shutdown_requested)
+    return 0;
+  if (reply != rtsp_read_request_response_ok) {
+    debug(1, "rtsp_read_request error %d on an idle connection, closing it.", (int)reply);
+    return 0;
+  }
+  if (conn->partial_size < 0)
+    return 1; // the headers aren't all in yet
+  rtsp_message *req = conn->partial;
+  if ((!strcmp(req->method, "OPTIONS")) || (!strcmp(req->method, "GET_PARAMETER"))) {
+    if (conn->partial_size > LISTENER_MAXIMUM_CONTENT) {
+      debug(1, "A %s request on an idle connection has %d bytes of content -- closing it.",
+            req->method, conn->partial_size);
+      return 0;
+    }
+    if (req->arena_used < conn->partial_parsed + conn->partial_size)
+      return 1; // the content isn't all in yet
+    // it's all here, so this won't wait
+    if (request_finish(conn, &req) != rtsp_read_request_response_ok)
+      return 0;
+    handle_request(conn, req);
+    return 1;
+  }
+  // the conversation thread waits for its responses to be sent
+  struct timeval no_timeout = {0, 0};
+  setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &no_timeout, sizeof(no_timeout));
+  conn->has_thread = 1;
+  int ret = pthread_create(&conn->thread, NULL, rtsp_conversation_thread_func, conn);
+  if (ret)
+    die("Failed to create RTSP receiver thread!");
+  pthread_mutex_lock(&connection_statistics_lock);
+  connections_with_threads++;
+  pthread_mutex_unlock(&connection_statistics_lock);
+  return 1;
+}
+
+// close a connection the listener is looking after
+static void listener_close(rtsp_conn_info *conn) {
+  debug(1, "closing RTSP connection.");
+  request_discard(conn);
+  close(conn->fd);
+  conn->running = 0;
+}
+
 // this function is not thread safe.
 static const char *format_address(struct sockaddr *fsa) {
   static char string[INETx_ADDRSTRLEN];
@@ -1579,67 +2621,105 @@ void rtsp_listen_loop(void) {
   if (!nsock)
     die("could not bind any listen sockets!");
 
-  int maxfd = -1;
-  fd_set fds;
-  FD_ZERO(&fds);
-  for (i = 0; i < nsock; i++) {
-    if (sockfd[i] > maxfd)
-      maxfd = sockfd[i];
-  }
+  if (notifier_init(&listener_wakeup) != 0)
+    die("Can't create a notifier for the RTSP listener: %s.", strerror(errno));
 
   mdns_register();
 
   // printf("Listening for connections.");
   // shairport_startup_complete();
 
-  int acceptfd;
-  struct timeval tv;
+  // the listening sockets, the wakeup notifier and the connections without threads are polled
+  struct pollfd *fds = NULL;
+  rtsp_conn_info **polled = NULL; // the connection for each of the fds after the first nsock + 1
+  int fds_capacity = 0;
   while (1) {
-    tv.tv_sec = 300;
-    tv.tv_usec = 0;
-
-    for (i = 0; i < nsock; i++)
-      FD_SET(sockfd[i], &fds);
+    if (nconns + nsock + 1 > fds_capacity) {
+      fds_capacity = (nconns + nsock + 1) * 2;
+      fds = realloc(fds, fds_capacity * sizeof(struct pollfd));
+      polled = realloc(polled, fds_capacity * sizeof(rtsp_conn_info *));
+      if ((fds == NULL) || (polled == NULL))
+        die("Can't allocate space to poll the RTSP connections.");
+    }
+    int nfds = 0;
+    for (i = 0; i < nsock; i++) {
+      fds[nfds].fd = sockfd[i];
+      fds[nfds++].events = POLLIN;
+    }
+    fds[nfds].fd = listener_wakeup.read_fd;
+    fds[nfds++].events = POLLIN;
+    // wake up for the first of the deadlines of the requests being read
+    uint64_t time_now = get_absolute_time_in_fp();
+    int timeout = -1;
+    for (i = 0; i < nconns; i++)
+      if ((conns[i]->has_thread == 0) && (conns[i]->running)) {
+        polled[nfds] = conns[i];
+        fds[nfds].fd = conns[i]->fd;
+        fds[nfds++].events = POLLIN;
+        if (conns[i]->partial) {
+          int wait = 0;
+          if (conns[i]->request_deadline > time_now)
+            wait = (((conns[i]->request_deadline - time_now) * 1000) >> 32) + 1;
+          if ((timeout < 0) || (wait < timeout))
+            timeout = wait;
+        }
+      }
 
-    ret = select(maxfd + 1, &fds, 0, 0, &tv);
+    ret = poll(fds, nfds, timeout);
     if (ret < 0) {
       if (errno == EINTR)
         continue;
       break;
     }
 
-    cleanup_threads();
+    if (fds[nsock].revents & POLLIN) {
+      notifier_clear(&listener_wakeup);
+      cleanup_threads();
+    }
 
-    acceptfd = -1;
-    for (i = 0; i < nsock; i++) {
-      if (FD_ISSET(sockfd[i], &fds)) {
-        acceptfd = sockfd[i];
-        break;
+    time_now = get_absolute_time_in_fp();
+    for (i = nsock + 1; i < nfds; i++) {
+      rtsp_conn_info *conn = polled[i];
+      if (fds[i].revents) {
+        if (listener_serve(conn) == 0)
+          listener_close(conn);
+      } else if ((conn->partial) && (time_now >= conn->request_deadline)) {
+        debug(1, "An RTSP request on an idle connection took too long to arrive.");
+        listener_close(conn);
       }
     }
-    if (acceptfd < 0) // timeout
-      continue;
-
-    rtsp_conn_info *conn = malloc(sizeof(rtsp_conn_info));
-    memset(conn, 0, sizeof(rtsp_conn_info));
-    socklen_t slen = sizeof(conn->remote);
 
-    debug(1, "new RTSP connection.");
-    conn->fd = accept(acceptfd, (struct sockaddr *)&conn->remote, &slen);
-    if (conn->fd < 0) {
-      perror("failed to accept connection");
-      free(conn);
-    } else {
-      pthread_t rtsp_conversation_thread;
-      ret = pthread_create(&rtsp_conversation_thread, NULL, rtsp_conversation_thread_func, conn);
-      if (ret)
-        die("Failed to create RTSP receiver thread!");
-
-      conn->thread = rtsp_conversation_thread;
-      conn->running = 1;
-      track_thread(conn);
+    for (i = 0; i < nsock; i++) {
+      if ((fds[i].revents & POLLIN) == 0)
+        continue;
+      rtsp_conn_info *conn = malloc(sizeof(rtsp_conn_info));
+      memset(conn, 0, sizeof(rtsp_conn_info));
+      socklen_t slen = sizeof(conn->remote);
+
+      debug(1, "new RTSP connection.");
+      conn->fd = accept(sockfd[i], (struct sockaddr *)&conn->remote, &slen);
+      if (conn->fd < 0) {
+        perror("failed to accept connection");
+        free(conn);
+      } else if (notifier_init(&conn->stop) != 0) {
+        warn("Can't create a notifier for an RTSP connection: %s.", strerror(errno));
+        close(conn->fd);
+        free(conn);
+      } else {
+        // so that the listener can't be held up sending a response to a client that isn't reading
+        struct timeval send_timeout = {1, 0};
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        conn->running = 1;
+        track_connection(conn);
+        pthread_mutex_lock(&connection_statistics_lock);
+        connections_accepted++;
+        connections_open++;
+        pthread_mutex_unlock(&connection_statistics_lock);
+      }
     }
+
+    cleanup_threads(); // including the connections closed here
   }
-  perror("select");
-  die("fell out of the RTSP select loop");
+  perror("poll");
+  die("fell out of the RTSP poll loop");
 }
@@ -10,12 +10,18 @@ void rtsp_request_shutdown_stream(void);
 
 void metadata_init(void);
 
+// what to do with an item of metadata if the queue to the metadata thread is full
+enum metadata_policy {
+  metadata_drop_oldest, // make room by dropping the oldest droppable item, or else drop this one
+  metadata_coalesce,    // replace an item with the same code that's still waiting, if there is one
+  metadata_block        // wait a little while for room, then drop this one
+};
+
 // sends metadata out to the metadata pipe, if enabled.
 // It is sent with the type 'ssnc' the given code, data and length
-// The handler at the other end must kknow what to do with the data
-// e.g. it it's malloced, to free it, etc.
-// nothing is done automatically
+// The data must be malloced or NULL; it's freed once it has been written, or if it is dropped.
+// Returns 0 if the item was queued.
 
-int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, int block);
+int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, enum metadata_policy policy);
 
 #endif // _RTSP_H
@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <popt.h>
 #include <libgen.h>
+#include <sched.h>
 #include <libconfig.h>
 
 #include "config.h"
@@ -52,6 +53,7 @@
 #include "common.h"
 #include "rtsp.h"
 #include "rtp.h"
+#include "capture.h"
 #include "mdns.h"
 
 #include <libdaemon/dfork.h>
@@ -75,7 +77,6 @@ void shairport_shutdown() {
     config.output->deinit();
 }
 
-static void sig_ignore(int foo, siginfo_t *bar, void *baz) {}
 static void sig_shutdown(int foo, siginfo_t *bar, void *baz) {
   debug(1, "shutdown requested...");
   shairport_shutdown();
@@ -377,6 +378,13 @@ int parse_options(int argc, char **argv) {
       if (config_lookup_int(config.cfg, "general.resync_threshold", &value))
         config.resyncthreshold = value;
 
+      /* Get the flush threshold setting. */
+      if (config_lookup_int(config.cfg, "general.flush_threshold", &value)) {
+        if (value < 0)
+          die("Invalid flush threshold \"%d\". It should be 0 or more, default is 44100.", value);
+        config.flushthreshold = value;
+      }
+
       /* Get the verbosity setting. */
       if (config_lookup_int(config.cfg, "general.log_verbosity", &value)) {
         if ((value >= 0) && (value <= 3))
@@ -387,6 +395,10 @@ int parse_options(int argc, char **argv) {
               value);
       }
 
+      /* Get the capture file setting. */
+      if (config_lookup_string(config.cfg, "general.capture_file", &str))
+        config.capture_file = (char *)str;
+
       /* Get the ignore_volume_control setting. */
       if (config_lookup_string(config.cfg, "general.ignore_volume_control", &str)) {
         if (strcasecmp(str, "no") == 0)
@@ -437,6 +449,42 @@ int parse_options(int argc, char **argv) {
       if (config_lookup_string(config.cfg, "metadata.pipe_name", &str)) {
         config.metadata_pipename = (char *)str;
       }
+
+      if (config_lookup_string(config.cfg, "metadata.format", &str)) {
+        if (strcasecmp(str, "xml") == 0)
+          config.metadata_binary = 0;
+        else if (strcasecmp(str, "binary") == 0)
+          config.metadata_binary = 1;
+        else
+          die("Invalid metadata format option choice \"%s\". It should be \"xml\" or \"binary\"",
+              str);
+      }
+
+      if (config_lookup_string(config.cfg, "metadata.shm_name", &str)) {
+        config.metadata_shm_name = (char *)str;
+      }
+
+      if (config_lookup_int(config.cfg, "metadata.shm_size", &value)) {
+        if ((value < 65536) || (value > 1073741824))
+          die("Invalid metadata shm_size option choice \"%d\". It should be between 65536 and "
+              "1073741824",
+              value);
+        else
+          config.metadata_shm_size = value;
+      }
+
+      if (config_lookup_string(config.cfg, "metadata.cover_art_cache_directory", &str)) {
+        config.metadata_cover_art_cache_directory = (char *)str;
+      }
+
+      if (config_lookup_int(config.cfg, "metadata.cover_art_cache_size", &value)) {
+        if ((value < 1048576) || (value > 1073741824))
+          die("Invalid metadata cover_art_cache_size option choice \"%d\". It should be between "
+              "1048576 and 1073741824",
+              value);
+        else
+          config.metadata_cover_art_cache_size = value;
+      }
   #endif
 
       if (config_lookup_string(config.cfg, "sessioncontrol.run_this_before_play_begins", &str)) {
@@ -473,6 +521,70 @@ int parse_options(int argc, char **argv) {
         config.dont_check_timeout = 0; // this is for legacy -- only set by -t 0
       }
 
+      /* Get the memory locking setting. */
+      if (config_lookup_string(config.cfg, "threads.lock_memory", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.lock_memory = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.lock_memory = 1;
+        else
+          die("Invalid threads lock_memory option choice \"%s\". It should be \"yes\" or \"no\"",
+              str);
+      }
+
+      /* Get the scheduling settings for each kind of thread. */
+      thread_role role;
+      for (role = 0; role < thread_role_count; role++) {
+        thread_settings *settings = &config.thread_settings[role];
+        const char *role_name = thread_role_name(role);
+        char path[64];
+
+        snprintf(path, sizeof(path), "threads.%s.scheduling_policy", role_name);
+        if (config_lookup_string(config.cfg, path, &str)) {
+          if (strcasecmp(str, "other") == 0)
+            settings->policy = 0;
+          else if (strcasecmp(str, "fifo") == 0)
+            settings->policy = SCHED_FIFO;
+          else if (strcasecmp(str, "rr") == 0)
+            settings->policy = SCHED_RR;
+          else
+            die("Invalid %s scheduling_policy option choice \"%s\". It should be \"other\", "
+                "\"fifo\" or \"rr\"",
+                role_name, str);
+        }
+
+        snprintf(path, sizeof(path), "threads.%s.priority", role_name);
+        if (config_lookup_int(config.cfg, path, &value)) {
+          if (settings->policy == 0)
+            die("Invalid %s priority %d. A priority can only be given with the \"fifo\" or \"rr\" "
+                "scheduling policies.",
+                role_name, value);
+          if ((value < sched_get_priority_min(settings->policy)) ||
+              (value > sched_get_priority_max(settings->policy)))
+            die("Invalid %s priority %d. It should be between %d and %d.", role_name, value,
+                sched_get_priority_min(settings->policy), sched_get_priority_max(settings->policy));
+          settings->priority = value;
+        } else if (settings->policy) {
+          settings->priority = sched_get_priority_min(settings->policy);
+        }
+
+        snprintf(path, sizeof(path), "threads.%s.cpu_affinity", role_name);
+        if (config_lookup_string(config.cfg, path, &str)) {
+          if (thread_policy_parse_cpu_list(str, &settings->cpu_affinity) != 0)
+            die("Invalid %s cpu_affinity \"%s\". It should be a list of CPUs from 0 to 63, e.g. "
+                "\"0,2-3\".",
+                role_name, str);
+        }
+
+        snprintf(path, sizeof(path), "threads.%s.stack_prefault", role_name);
+        if (config_lookup_int(config.cfg, path, &value)) {
+          if ((value < 0) || (value > 1024))
+            die("Invalid %s stack_prefault %d. It should be between 0 and 1024 (kilobytes).",
+                role_name, value);
+          settings->stack_prefault = value * 1024;
+        }
+      }
+
     } else {
       if (config_error_type(&config_file_stuff) == CONFIG_ERR_FILE_IO)
         debug(1, "Error reading configuration file \"%s\": \"%s\".",
@@ -565,13 +677,8 @@ void signal_setup(void) {
   sigdelset(&set, SIGUSR2);
   pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-  // setting this to SIG_IGN would prevent signalling any threads.
   struct sigaction sa;
   memset(&sa, 0, sizeof(sa));
-  sa.sa_flags = SA_SIGINFO;
-  sa.sa_sigaction = &sig_ignore;
-  sigaction(SIGUSR1, &sa, NULL);
-
   sa.sa_flags = SA_SIGINFO | SA_RESTART;
   sa.sa_sigaction = &sig_shutdown;
   sigaction(SIGINT, &sa, NULL);
@@ -645,6 +752,7 @@ int main(int argc, char **argv) {
                                    // vision on AppleTV, but also used for iPhone/iPod/iPad sources
   config.ForkedDaapdLatency = 99400; // Seems to be right
   config.resyncthreshold = 441 * 5;  // this number of frames is 50 ms
+  config.flushthreshold = 44100;     // this number of frames is one second
   config.timeout = 120; // this number of seconds to wait for [more] audio before switching to idle.
   config.tolerance = 88; // this number of frames of error before attempting to correct it.
   config.buffer_start_fill = 220;
@@ -658,6 +766,10 @@ int main(int argc, char **argv) {
   config.audio_backend_buffer_desired_length = 6615; // 0.15 seconds.
   config.udp_port_base = 6001;
   config.udp_port_range = 100;
+#ifdef CONFIG_METADATA
+  config.metadata_shm_size = 4 * 1024 * 1024; // room for a few pictures
+  config.metadata_cover_art_cache_size = 16 * 1024 * 1024;
+#endif
 
   /* Check if we are called with -V or --version parameter */
   if (argc >= 2 && ((strcmp(argv[1], "-V") == 0) || (strcmp(argv[1], "--version") == 0))) {
@@ -840,6 +952,7 @@ int main(int argc, char **argv) {
   debug(2, "forkedDaapdLatency is %d.", config.ForkedDaapdLatency);
   debug(2, "stuffing option is \"%d\".", config.packet_stuffing);
   debug(2, "resync time is %d.", config.resyncthreshold);
+  debug(2, "flush threshold is %d.", config.flushthreshold);
   debug(2, "allow a session to be interrupted: %d.", config.allow_session_interruption);
   debug(2, "busy timeout time is %d.", config.timeout);
   debug(2, "tolerance is %d frames.", config.tolerance);
@@ -848,6 +961,14 @@ int main(int argc, char **argv) {
   debug(2, "audio backend desired buffer length is %d.",
         config.audio_backend_buffer_desired_length);
   debug(2, "audio backend latency offset is %d.", config.audio_backend_latency_offset);
+  debug(2, "lock memory is %d.", config.lock_memory);
+  debug(2, "capture file is \"%s\".", config.capture_file);
+  thread_role role;
+  for (role = 0; role < thread_role_count; role++)
+    debug(2, "%s thread: scheduling policy %d, priority %d, cpu affinity 0x%llx, stack prefault %d.",
+          thread_role_name(role), config.thread_settings[role].policy,
+          config.thread_settings[role].priority, config.thread_settings[role].cpu_affinity,
+          config.thread_settings[role].stack_prefault);
   
   char *realConfigPath = realpath(config.configfile,NULL);
   if (realConfigPath) {
@@ -881,6 +1002,11 @@ int main(int argc, char **argv) {
 #ifdef CONFIG_METADATA
   metadata_init(); // create the metadata pipe if necessary
 #endif
+  if (config.lock_memory)
+    thread_policy_lock_memory();
+  if (config.capture_file)
+    capture_open(config.capture_file);
+  rtp_initialise();
   rtsp_listen_loop();
 
   // should not reach this...
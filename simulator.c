@@ -0,0 +1,616 @@
+/*
+ * Synchronisation simulator. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libdaemon/dlog.h>
+
+#include "common.h"
+#include "alac_encode.h"
+#include "player.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "timeline.h"
+
+// This runs the real player -- buffer_get_frame(), player_thread_func() and all -- against a
+// modelled source, network and DAC, on a virtual clock. The virtual clock only moves on when the
+// player waits for its next packet to become due, and everything the source and network do in the
+// meantime -- packets, resends, sync points, timing exchanges -- is done then, on the player's
+// thread. So a scenario runs deterministically and much faster than real time.
+
+// To measure the true sync error, the right channel of every frame carries the low 16 bits of the
+// frame's number in the stream. The left channel is a tone, so that the player sees some audio.
+
+typedef struct {
+  char *name;
+  double duration;         // seconds
+  double clock_ppm;        // how much faster the source's clock runs than ours
+  double source_ppm;       // how much faster the source's DAC runs than the source's clock
+  double dac_ppm;          // how much faster our DAC runs than our clock
+  double jitter_ms;        // the network delay varies uniformly over this range
+  double loss_percent;     // the chance of losing a packet, resent ones included
+  double net_stall_at;     // if non-zero, nothing gets through the network from this time...
+  double net_stall_length; // ...for this many seconds
+  double dac_stall_at;     // if non-zero, the DAC stops playing at this time...
+  double dac_stall_length; // ...for this many seconds
+} scenario;
+
+static scenario scenarios[] = {
+    {"ideal", 60, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    {"clock-drift", 120, 50, 0, 0, 1, 0, 0, 0, 0, 0},
+    {"source-drift", 120, 0, -80, 0, 1, 0, 0, 0, 0, 0},
+    {"dac-drift", 120, 0, 0, 120, 1, 0, 0, 0, 0, 0},
+    {"jitter", 120, 20, 0, -30, 20, 0, 0, 0, 0, 0},
+    {"loss", 120, 20, 0, -30, 5, 2, 0, 0, 0, 0},
+    {"network-stall", 90, 20, 0, -30, 5, 0, 40, 2.5, 0, 0},
+    {"dac-stall", 90, 20, 0, -30, 5, 0, 0, 0, 40, 0.2},
+};
+
+#define number_of_scenarios (sizeof(scenarios) / sizeof(scenario))
+
+static scenario sc; // the one being run
+
+// Times are kept as seconds in doubles. The source's clock reads remote_start when ours reads
+// local_start, and its DAC starts playing frame 0 then.
+static const double local_start = 1000.0;
+static const double remote_start = 5000.0;
+static const uint32_t rtp_base = 0x7ff00000;
+static const seq_t seq_base = 0xfff0;
+
+static double sim_time;
+static double end_time;
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static uint64_t fp_of(double t) { return (uint64_t)(t * 4294967296.0); }
+
+static double seconds_of(uint64_t fp) { return fp / 4294967296.0; }
+
+// xorshift64*
+static double uniform(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// the source
+
+static double source_frame_rate(void) { return 44100.0 * (1.0 + sc.source_ppm * 1e-6); }
+
+static double remote_time_at(double local_time) {
+  return remote_start + (local_time - local_start) * (1.0 + sc.clock_ppm * 1e-6);
+}
+
+static double remote_time_of_frame(double frame) {
+  return remote_start + frame / source_frame_rate();
+}
+
+static double local_time_of_frame(double frame) {
+  return local_start + frame / source_frame_rate() / (1.0 + sc.clock_ppm * 1e-6);
+}
+
+static void sample_of_frame(int64_t frame, short *sample) {
+  sample[0] = 8000 * sin(2 * M_PI * 440 * (frame % 44100) / 44100.0);
+  sample[1] = frame & 0xffff;
+}
+
+// an uncompressed ALAC frame
+static int alac_frame_of_packet(int64_t packet, uint8_t *out) {
+  int16_t samples[352 * 2];
+  int i;
+  for (i = 0; i < 352; i++)
+    sample_of_frame(packet * 352 + i, &samples[i * 2]);
+  return alac_encode_uncompressed(samples, 352, out);
+}
+
+// the network
+
+typedef struct {
+  double time;
+  int is_sync;   // if not, it's an audio packet
+  int64_t value; // the packet number, or the frame number of the sync point
+} event;
+
+static event *events;
+static int event_count, event_space;
+
+static int64_t packets_in_scenario, next_packet; // next_packet is the next one for the source to send
+static char *packet_lost;  // if set, the packet has been sent but not received
+static double next_sync_time, next_timing_time;
+
+static uint64_t packets_lost, packets_resent;
+
+static void schedule(double time, int is_sync, int64_t value) {
+  if (event_count == event_space) {
+    event_space = event_space ? event_space * 2 : 256;
+    events = realloc(events, event_space * sizeof(event));
+    if (events == NULL)
+      die("Can't allocate simulator events.");
+  }
+  events[event_count].time = time;
+  events[event_count].is_sync = is_sync;
+  events[event_count].value = value;
+  event_count++;
+}
+
+static int in_net_stall(double t) {
+  return (sc.net_stall_at != 0) && (t >= local_start + sc.net_stall_at) &&
+         (t < local_start + sc.net_stall_at + sc.net_stall_length);
+}
+
+static double arrival_time(double sent) {
+  double t = sent + 0.002 + sc.jitter_ms * 0.001 * uniform();
+  if (in_net_stall(t))
+    t = local_start + sc.net_stall_at + sc.net_stall_length + sc.jitter_ms * 0.001 * uniform();
+  return t;
+}
+
+static void send_packet(int64_t packet, double sent) {
+  if (uniform() * 100 < sc.loss_percent) {
+    packet_lost[packet] = 1;
+    packets_lost++;
+  } else {
+    packet_lost[packet] = 0;
+    schedule(arrival_time(sent), 0, packet);
+  }
+}
+
+// timing and sync, as in rtp.c
+
+static rtp_timeline timeline;
+static uint64_t local_to_remote_time_difference;
+static uint32_t reference_timestamp;
+static uint64_t reference_timestamp_time, remote_reference_timestamp_time;
+
+void get_reference_timestamp_stuff(uint32_t *timestamp, uint64_t *timestamp_time,
+                                   uint64_t *remote_timestamp_time) {
+  *timestamp = reference_timestamp;
+  *timestamp_time = reference_timestamp_time;
+  *remote_timestamp_time = remote_reference_timestamp_time;
+}
+
+void clear_reference_timestamp(void) {
+  reference_timestamp = 0;
+  reference_timestamp_time = 0;
+  timeline_reset(&timeline);
+}
+
+double get_source_drift_ppm(void) { return timeline_drift_ppm(&timeline); }
+
+static void receive_sync(int64_t frame) {
+  if (local_to_remote_time_difference) {
+    uint32_t sync_rtp_timestamp = rtp_base + frame;
+    timeline_add_sync(&timeline, sync_rtp_timestamp, fp_of(remote_time_of_frame(frame)));
+    remote_reference_timestamp_time = timeline_remote_time(&timeline, sync_rtp_timestamp);
+    reference_timestamp_time = remote_reference_timestamp_time - local_to_remote_time_difference;
+    reference_timestamp = sync_rtp_timestamp;
+  }
+}
+
+// an exchange of timing packets gives the difference between the clocks, give or take the
+// difference between the delays in each direction
+static void exchange_timing(double t) {
+  if (!in_net_stall(t)) {
+    double asymmetry = (uniform() - 0.5) * sc.jitter_ms * 0.001;
+    local_to_remote_time_difference = fp_of(remote_time_at(t)) - fp_of(t);
+    if (asymmetry >= 0)
+      local_to_remote_time_difference += fp_of(asymmetry);
+    else
+      local_to_remote_time_difference -= fp_of(-asymmetry);
+  }
+}
+
+void rtp_request_resend(seq_t first, uint32_t count) {
+  // find the packet number of the first one, taking it to be the nearest at or before the last
+  // one sent
+  int64_t last_sent = next_packet - 1;
+  int64_t packet = last_sent - (seq_t)((seq_t)(seq_base + last_sent) - first);
+  uint32_t i;
+  for (i = 0; i < count; i++, packet++) {
+    if ((packet >= 0) && (packet <= last_sent) && (packet_lost[packet])) {
+      packets_resent++;
+      send_packet(packet, sim_time + 0.002 + sc.jitter_ms * 0.001 * uniform());
+    }
+  }
+}
+
+// bring everything the source and network do up to the given time, in order
+static void run_until(double t) {
+  for (;;) {
+    double next_time = local_time_of_frame(next_packet * 352);
+    int next = 0; // 0: send a packet; 1: send a sync point; 2: exchange timing; 3: an arrival
+    if (next_sync_time < next_time) {
+      next_time = next_sync_time;
+      next = 1;
+    }
+    if (next_timing_time < next_time) {
+      next_time = next_timing_time;
+      next = 2;
+    }
+    int i, earliest = -1;
+    for (i = 0; i < event_count; i++)
+      if ((earliest == -1) || (events[i].time < events[earliest].time))
+        earliest = i;
+    if ((earliest != -1) && (events[earliest].time < next_time)) {
+      next_time = events[earliest].time;
+      next = 3;
+    }
+    if (next_time > t)
+      break;
+    if (next_time > sim_time)
+      sim_time = next_time;
+    switch (next) {
+    case 0:
+      if (next_packet < packets_in_scenario)
+        send_packet(next_packet, sim_time);
+      next_packet++;
+      break;
+    case 1: {
+      int64_t frame = (remote_time_at(sim_time) - remote_start) * source_frame_rate();
+      schedule(arrival_time(sim_time), 1, frame);
+      next_sync_time += 1.0;
+    } break;
+    case 2:
+      exchange_timing(sim_time);
+      next_timing_time += 3.0;
+      break;
+    case 3: {
+      event e = events[earliest];
+      events[earliest] = events[--event_count];
+      if (e.is_sync) {
+        receive_sync(e.value);
+      } else if (packet_lost[e.value] == 0) {
+        uint8_t packet[2048];
+        int length = alac_frame_of_packet(e.value, packet);
+        player_put_packet(seq_base + e.value, rtp_base + e.value * 352, packet, length);
+      }
+    } break;
+    }
+  }
+  if (t > sim_time)
+    sim_time = t;
+}
+
+// the clock
+
+static pthread_mutex_t finished_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;
+static int finished;
+
+static uint64_t virtual_now(void) { return fp_of(sim_time); }
+
+// called by the player, with the mutex locked, when it has nothing to do until the time given
+static int virtual_timedwait_until(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t time_fp) {
+  pthread_mutex_unlock(mutex); // the simulation may give the player packets
+  if (finished) {
+    usleep(1000); // until the player is stopped
+  } else {
+    run_until(seconds_of(time_fp));
+    if (sim_time >= end_time) {
+      pthread_mutex_lock(&finished_mutex);
+      finished = 1;
+      pthread_cond_signal(&finished_cond);
+      pthread_mutex_unlock(&finished_mutex);
+    }
+  }
+  pthread_mutex_lock(mutex);
+  return ETIMEDOUT;
+}
+
+static clock_source virtual_clock = {.now = &virtual_now,
+                                     .timedwait_until = &virtual_timedwait_until};
+
+// the DAC
+
+static double dac_frames; // frames in the DAC
+static double dac_time;   // when dac_frames was right
+static int dac_running;
+static uint64_t frames_played, underruns, flushes, silent_packets;
+
+// sync error statistics
+static double first_audio_time, last_time_out_of_tolerance;
+static double error_sum, error_sum_of_squares, error_maximum;
+static uint64_t error_count;
+static const double settling_time = 10.0; // seconds after the first audio before errors count
+
+static double dac_rate(void) { return 44100.0 * (1.0 + sc.dac_ppm * 1e-6); }
+
+static void dac_update(void) {
+  if (dac_running) {
+    double playing_time = sim_time - dac_time;
+    if (sc.dac_stall_at != 0) {
+      double stall_start = local_start + sc.dac_stall_at;
+      double stall_end = stall_start + sc.dac_stall_length;
+      double overlap_start = dac_time > stall_start ? dac_time : stall_start;
+      double overlap_end = sim_time < stall_end ? sim_time : stall_end;
+      if (overlap_end > overlap_start)
+        playing_time -= overlap_end - overlap_start;
+    }
+    double frames = playing_time * dac_rate();
+    if (frames >= dac_frames) {
+      underruns++;
+      dac_frames = 0;
+      dac_running = 0;
+    } else {
+      dac_frames -= frames;
+    }
+  }
+  dac_time = sim_time;
+}
+
+static void dac_start(int sample_rate) {}
+
+static void dac_play(short buf[], int samples) {
+  dac_update();
+  if ((buf[0] == 0) && (buf[1] == 0)) {
+    if (first_audio_time != 0)
+      silent_packets++;
+  } else {
+    // when will the first frame be heard, and which is it?
+    double play_time = sim_time + dac_frames / dac_rate();
+    double latency = config.latency / 44100.0;
+    int64_t rough_frame = (play_time - latency - local_start) * 44100.0;
+    int64_t frame = rough_frame + (int16_t)((uint16_t)buf[1] - (uint16_t)rough_frame);
+    double error = (play_time - local_time_of_frame(frame) - latency) * 44100.0;
+    if (first_audio_time == 0)
+      first_audio_time = sim_time;
+    if (fabs(error) > 2 * config.tolerance)
+      last_time_out_of_tolerance = sim_time;
+    if (sim_time >= first_audio_time + settling_time) {
+      error_sum += error;
+      error_sum_of_squares += error * error;
+      if (fabs(error) > error_maximum)
+        error_maximum = fabs(error);
+      error_count++;
+    }
+  }
+  dac_frames += samples;
+  dac_running = 1;
+  frames_played += samples;
+}
+
+static uint32_t dac_delay() {
+  dac_update();
+  return dac_frames;
+}
+
+static void dac_flush(void) {
+  dac_update();
+  dac_frames = 0;
+  dac_running = 0;
+  flushes++;
+}
+
+static void dac_stop(void) {
+  dac_frames = 0;
+  dac_running = 0;
+}
+
+static audio_output simulated_dac = {.name = "simulated",
+                                     .help = NULL,
+                                     .init = NULL,
+                                     .deinit = NULL,
+                                     .start = &dac_start,
+                                     .stop = &dac_stop,
+                                     .flush = &dac_flush,
+                                     .delay = &dac_delay,
+                                     .timed_delay = NULL,
+                                     .play = &dac_play,
+                                     .volume = NULL,
+                                     .parameters = NULL};
+
+// what the player needs from the rest of Shairport Sync
+
+void rtsp_request_shutdown_stream(void) { debug(1, "Simulator: the player asked to stop."); }
+
+#ifdef CONFIG_METADATA
+int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, enum metadata_policy policy) {
+  return 0;
+}
+#endif
+
+void shairport_shutdown() {}
+
+static void run_scenario(void) {
+  config.output = &simulated_dac;
+  config.latency = 88200;
+  config.tolerance = 88;
+  config.resyncthreshold = 441 * 5;
+  config.flushthreshold = 44100;
+  config.buffer_start_fill = 220;
+  config.audio_backend_buffer_desired_length = 6615;
+  config.audio_backend_latency_offset = 0;
+  config.packet_stuffing = ST_basic;
+  config.dont_check_timeout = 1;
+
+  sim_time = local_start;
+  end_time = local_start + sc.duration;
+  next_packet = 0;
+  packets_in_scenario = sc.duration * 44100 / 352 + 1;
+  packet_lost = calloc(packets_in_scenario, 1);
+  if (packet_lost == NULL)
+    die("Can't allocate simulator packet records.");
+  next_sync_time = local_start + 0.5;
+  next_timing_time = local_start;
+  timeline_reset(&timeline);
+  set_clock_source(&virtual_clock);
+  player_set_random_seed((rng_state >> 32) | 1);
+
+  stream_cfg stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.encrypted = 0;
+  int32_t fmtp[12] = {96, 352, 0, 16, 40, 10, 14, 2, 255, 0, 0, 44100};
+  memcpy(stream.fmtp, fmtp, sizeof(fmtp));
+
+  struct timeval real_start, real_end;
+  gettimeofday(&real_start, NULL);
+  player_play(&stream);
+  pthread_mutex_lock(&finished_mutex);
+  while (finished == 0)
+    pthread_cond_wait(&finished_cond, &finished_mutex);
+  pthread_mutex_unlock(&finished_mutex);
+  player_stop();
+  gettimeofday(&real_end, NULL);
+  double real_time =
+      (real_end.tv_sec - real_start.tv_sec) + (real_end.tv_usec - real_start.tv_usec) * 1e-6;
+
+  printf("%s: %.0f seconds simulated in %.2f seconds.\n", sc.name, sc.duration, real_time);
+  if (first_audio_time == 0) {
+    printf("  no audio was played.\n");
+  } else {
+    double convergence = last_time_out_of_tolerance > first_audio_time
+                             ? last_time_out_of_tolerance - first_audio_time
+                             : 0.0;
+    printf("  first audio after %.2f seconds; within %d frames of sync from %.2f seconds on.\n",
+           first_audio_time - local_start, 2 * config.tolerance, convergence);
+    if (error_count) {
+      double mean = error_sum / error_count;
+      printf("  sync error after %.0f seconds: mean %.1f, rms %.1f, maximum %.1f (frames).\n",
+             settling_time, mean, sqrt(error_sum_of_squares / error_count), error_maximum);
+    }
+  }
+  printf("  net correction %.1f ppm (%.1f ppm expected).\n",
+         frames_played ? session_corrections * 1e6 / frames_played : 0.0,
+         sc.dac_ppm - sc.source_ppm - sc.clock_ppm);
+  printf("  dropouts: %" PRIu64 " underruns, %" PRIu64 " flushes, %" PRIu64
+         " silent packets; %" PRIu64 " packets lost, %" PRIu64 " resent.\n",
+         underruns, flushes, silent_packets, packets_lost, packets_resent);
+  fflush(stdout);
+}
+
+static void usage(char *name) {
+  unsigned int i;
+  printf("Usage: %s [options]\n"
+         "Runs the player against a simulated source, network and DAC, in virtual time.\n"
+         "    -s scenario     run this scenario [all*", name);
+  for (i = 0; i < number_of_scenarios; i++)
+    printf("|%s", scenarios[i].name);
+  printf("]\n"
+         "    -d seconds      simulate this long\n"
+         "    -c ppm          the source's clock runs this much fast\n"
+         "    -a ppm          the source's DAC runs this much fast relative to its clock\n"
+         "    -o ppm          our DAC runs this much fast\n"
+         "    -j ms           network jitter\n"
+         "    -l percent      packet loss\n"
+         "    -r seed         random number seed\n"
+         "    -S              print the player's statistics\n"
+         "    -v              more debug messages; repeat for more\n"
+         "    *) default option\n"
+         "Options other than -s, -r, -S and -v override the scenario's settings.\n");
+}
+
+int main(int argc, char **argv) {
+  char *which = "all";
+  double duration = -1, clock_ppm = NAN, source_ppm = NAN, dac_ppm = NAN, jitter_ms = -1,
+         loss_percent = -1;
+  int opt;
+  daemon_log_ident = "shairport-sync-sim";
+  while ((opt = getopt(argc, argv, "s:d:c:a:o:j:l:r:Svh")) > 0) {
+    switch (opt) {
+    case 's':
+      which = optarg;
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'c':
+      clock_ppm = atof(optarg);
+      break;
+    case 'a':
+      source_ppm = atof(optarg);
+      break;
+    case 'o':
+      dac_ppm = atof(optarg);
+      break;
+    case 'j':
+      jitter_ms = atof(optarg);
+      break;
+    case 'l':
+      loss_percent = atof(optarg);
+      break;
+    case 'r':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    case 'S':
+      config.statistics_requested = 1;
+      break;
+    case 'v':
+      debuglev++;
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  unsigned int i, run = 0;
+  for (i = 0; i < number_of_scenarios; i++) {
+    if ((strcmp(which, "all") != 0) && (strcmp(which, scenarios[i].name) != 0))
+      continue;
+    sc = scenarios[i];
+    if (duration > 0)
+      sc.duration = duration;
+    if (!isnan(clock_ppm))
+      sc.clock_ppm = clock_ppm;
+    if (!isnan(source_ppm))
+      sc.source_ppm = source_ppm;
+    if (!isnan(dac_ppm))
+      sc.dac_ppm = dac_ppm;
+    if (jitter_ms >= 0)
+      sc.jitter_ms = jitter_ms;
+    if (loss_percent >= 0)
+      sc.loss_percent = loss_percent;
+    // the player keeps its state in statics, so each scenario gets a fresh process
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_scenario();
+      exit(0);
+    } else if (pid > 0) {
+      int status;
+      waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+        printf("%s: failed.\n", sc.name);
+    } else {
+      die("Can't fork a scenario: %s.", strerror(errno));
+    }
+    run++;
+  }
+  if (run == 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Thread scheduling, CPU affinity and memory locking. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#define _GNU_SOURCE // for pthread_setaffinity_np()
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "thread_policy.h"
+
+// A thread running this much after it was due to has missed its deadline. It's the duration of
+// one packet of audio.
+#define deadline_tolerance ((((uint64_t)352) << 32) / 44100)
+
+static const char *role_names[thread_role_count] = {"player", "rtp", "rtsp", "metadata"};
+
+// set if a thread in this role asked for real-time scheduling but didn't get it
+static int rt_refused[thread_role_count];
+static uint64_t missed_deadlines[thread_role_count];
+
+const char *thread_role_name(thread_role role) { return role_names[role]; }
+
+int thread_policy_parse_cpu_list(const char *list, uint64_t *mask) {
+  const char *p = list;
+  char *end;
+  *mask = 0;
+  while (*p) {
+    long first = strtol(p, &end, 10);
+    if (end == p)
+      return -1;
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &end, 10);
+      if (end == p)
+        return -1;
+      p = end;
+    }
+    if ((first < 0) || (last < first) || (last > 63))
+      return -1;
+    for (; first <= last; first++)
+      *mask |= (uint64_t)1 << first;
+    while (*p == ' ')
+      p++;
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+    while (*p == ' ')
+      p++;
+  }
+  return 0;
+}
+
+// touch every page of the next size bytes of stack, so that the thread doesn't take page faults
+// there later
+static void prefault_stack(int size) {
+  volatile char stack[size];
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size <= 0)
+    page_size = 4096;
+  int i;
+  for (i = 0; i < size; i += page_size)
+    stack[i] = 0;
+  (void)stack; // it's only written, to make the pages resident
+}
+
+void thread_policy_apply(thread_role role) {
+  thread_settings *settings = &config.thread_settings[role];
+  int rc;
+  rt_refused[role] = 0;
+  if (settings->policy) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = settings->priority;
+    rc = pthread_setschedparam(pthread_self(), settings->policy, &param);
+    if (rc) {
+      rt_refused[role] = 1;
+      warn("Can't give the %s thread real-time priority %d: %s. Missed deadlines will be reported.",
+           role_names[role], settings->priority, strerror(rc));
+    } else {
+      debug(1, "The %s thread has real-time priority %d.", role_names[role], settings->priority);
+    }
+  }
+
+  if (settings->cpu_affinity) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int cpu;
+    for (cpu = 0; (cpu < 64) && (cpu < CPU_SETSIZE); cpu++)
+      if (settings->cpu_affinity & ((uint64_t)1 << cpu))
+        CPU_SET(cpu, &cpus);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc)
+      warn("Can't set the CPU affinity of the %s thread: %s.", role_names[role], strerror(rc));
+#else
+    warn("Can't set the CPU affinity of the %s thread: not supported on this system.",
+         role_names[role]);
+#endif
+  }
+
+  if (settings->stack_prefault > 0)
+    prefault_stack(settings->stack_prefault);
+}
+
+void thread_policy_lock_memory(void) {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    warn("Can't lock memory: %s.", strerror(errno));
+  else
+    debug(1, "Memory locked.");
+}
+
+int thread_policy_check_deadline(thread_role role, uint64_t deadline) {
+  uint64_t time_now = get_absolute_time_in_fp();
+  if (time_now <= deadline + deadline_tolerance)
+    return 0;
+  uint64_t n = ++missed_deadlines[role];
+  int64_t lateness = ((time_now - deadline) * 1000) >> 32;
+  // report the first and then every time the count doubles, to keep the log readable
+  if (rt_refused[role] && ((n & (n - 1)) == 0))
+    warn("The %s thread, which doesn't have real-time priority, was %lld ms late. Deadlines "
+         "missed: %llu.",
+         role_names[role], lateness, n);
+  else
+    debug(2, "The %s thread was %lld ms late.", role_names[role], lateness);
+  return 1;
+}
+
+uint64_t thread_policy_missed_deadlines(thread_role role) { return missed_deadlines[role]; }
@@ -0,0 +1,41 @@
+#ifndef _THREAD_POLICY_H
+#define _THREAD_POLICY_H
+
+#include <stdint.h>
+
+// the threads whose scheduling can be set in the configuration file
+typedef enum {
+  thread_role_player = 0, // decodes, synchronises and outputs the audio
+  thread_role_rtp,        // receives the audio, control and timing packets
+  thread_role_rtsp,       // looks after a conversation with a source
+  thread_role_metadata,   // writes metadata to the metadata pipe
+  thread_role_count
+} thread_role;
+
+typedef struct {
+  int policy;            // SCHED_FIFO or SCHED_RR, or zero to leave the scheduling alone
+  int priority;          // only used with SCHED_FIFO and SCHED_RR
+  uint64_t cpu_affinity; // bit n set means the thread may run on CPU n. Zero means any CPU.
+  int stack_prefault;    // touch this many bytes of stack as the thread starts
+} thread_settings;
+
+const char *thread_role_name(thread_role role); // as used in the configuration file
+
+// parse a list of CPUs such as "0,2-3" into a mask. Returns 0 if successful.
+int thread_policy_parse_cpu_list(const char *list, uint64_t *mask);
+
+// call this from the start of a thread to apply the settings for its role
+void thread_policy_apply(thread_role role);
+
+// lock all current and future memory of the process into RAM
+void thread_policy_lock_memory(void);
+
+// call this when a thread was supposed to run at the time given (as from
+// get_absolute_time_in_fp()) and check whether it ran too late. Returns 1 if it did.
+// Missed deadlines are counted and, if the thread asked for but didn't get real-time priority,
+// reported.
+int thread_policy_check_deadline(thread_role role, uint64_t deadline);
+
+uint64_t thread_policy_missed_deadlines(thread_role role);
+
+#endif // _THREAD_POLICY_H
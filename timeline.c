@@ -0,0 +1,171 @@
+/*
+ * RTP timeline model. This file is part of Shairport Sync.
+ * Copyright (c) agent 2026
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "timeline.h"
+
+// The source sends a sync packet about once a second, pairing an RTP timestamp with the time on
+// its own clock at which the frame with that timestamp is to be played. Rather than take each one
+// at face value, we keep the last few and fit a straight line through them -- remote time against
+// frame number -- using least squares.
+// The fit smooths out the jitter in the individual sync packets, and its slope tells us how fast
+// the source's DAC is running relative to the source's clock.
+
+// Until the samples span this many seconds, the slope is too noisy to be useful, so we assume the
+// nominal rate and only average the offsets.
+#define minimum_span_for_slope 8
+
+// If the fitted rate differs from the nominal rate by more than this, something is wrong -- e.g. an
+// unflagged discontinuity -- and we start again
+#define maximum_drift_ppm 1000.0
+
+// Even if not, don't apply more correction than this
+#define maximum_applied_drift_ppm 500.0
+
+void timeline_reset(rtp_timeline *t) { memset(t, 0, sizeof(rtp_timeline)); }
+
+static void timeline_fit(rtp_timeline *t) {
+  double nominal_slope = 1.0 / 44100;
+  double n = t->count;
+  double sx = 0.0, sy = 0.0;
+  int i;
+  for (i = 0; i < t->count; i++) {
+    sx += t->frames[i];
+    sy += t->times[i];
+  }
+  double mx = sx / n;
+  double my = sy / n;
+  double sxx = 0.0, sxy = 0.0;
+  for (i = 0; i < t->count; i++) {
+    sxx += (t->frames[i] - mx) * (t->frames[i] - mx);
+    sxy += (t->frames[i] - mx) * (t->times[i] - my);
+  }
+
+  double slope = nominal_slope;
+  // the spread of the frame numbers tells us how many seconds the samples span
+  if ((t->count > 2) && (sxx > 0.0) &&
+      ((t->maximum_frame - t->minimum_frame) >= minimum_span_for_slope * 44100)) {
+    slope = sxy / sxx;
+    // as in timeline_drift_ppm(), +ve if the source's DAC is running fast
+    t->fitted_drift_ppm = (1.0 - slope * 44100) * 1000000.0;
+    if (t->fitted_drift_ppm > maximum_applied_drift_ppm)
+      slope = nominal_slope * (1.0 - maximum_applied_drift_ppm / 1000000.0);
+    else if (t->fitted_drift_ppm < -maximum_applied_drift_ppm)
+      slope = nominal_slope * (1.0 + maximum_applied_drift_ppm / 1000000.0);
+    t->slope_valid = 1;
+  } else {
+    t->fitted_drift_ppm = 0.0;
+    t->slope_valid = 0;
+  }
+  t->slope = slope;
+  t->intercept = my - slope * mx;
+}
+
+void timeline_add_sync(rtp_timeline *t, uint32_t rtp_timestamp, uint64_t remote_time) {
+  if (t->count == 0) {
+    t->base_rtp_timestamp = rtp_timestamp;
+    t->base_remote_time = remote_time;
+    t->minimum_frame = t->maximum_frame = 0;
+  }
+
+  int64_t frame = (int32_t)(rtp_timestamp - t->base_rtp_timestamp); // takes care of wrap
+  int64_t remote_time_difference = remote_time - t->base_remote_time;
+  double time = (1.0 * remote_time_difference) / ((uint64_t)1 << 32); // seconds
+
+  if (t->count) {
+    // check the new sample is consistent with what we have -- if the source has jumped without
+    // telling us, start again with this sample
+    double predicted_time = t->intercept + t->slope * frame;
+    double discrepancy = time - predicted_time;
+    if ((discrepancy > 0.1) || (discrepancy < -0.1)) {
+      debug(1, "Sync packet is %.1f ms away from the timeline -- restarting the timeline.",
+            discrepancy * 1000.0);
+      timeline_reset(t);
+      timeline_add_sync(t, rtp_timestamp, remote_time);
+      return;
+    }
+  }
+
+  if (t->count < timeline_history)
+    t->count++;
+  t->frames[t->next] = frame;
+  t->times[t->next] = time;
+  t->next = (t->next + 1) % timeline_history;
+
+  t->minimum_frame = t->maximum_frame = frame;
+  int i;
+  for (i = 0; i < t->count; i++) {
+    if (t->frames[i] < t->minimum_frame)
+      t->minimum_frame = t->frames[i];
+    if (t->frames[i] > t->maximum_frame)
+      t->maximum_frame = t->frames[i];
+  }
+
+  timeline_fit(t);
+
+  // the drift before it's clamped
+  if ((t->fitted_drift_ppm > maximum_drift_ppm) || (t->fitted_drift_ppm < -maximum_drift_ppm)) {
+    debug(1, "Source DAC drift of %.1f ppm is implausible -- restarting the timeline.",
+          t->fitted_drift_ppm);
+    timeline_reset(t);
+    timeline_add_sync(t, rtp_timestamp, remote_time);
+    return;
+  }
+
+  // periodically re-base, so that the frame numbers don't grow without limit
+  if ((t->count == timeline_history) && (t->minimum_frame > 0)) {
+    int64_t frame_shift = t->minimum_frame;
+    uint64_t remote_time_shift =
+        (uint64_t)((t->intercept + t->slope * frame_shift) * ((uint64_t)1 << 32));
+    double time_shift = (1.0 * remote_time_shift) / ((uint64_t)1 << 32);
+    for (i = 0; i < t->count; i++) {
+      t->frames[i] -= frame_shift;
+      t->times[i] -= time_shift;
+    }
+    t->base_rtp_timestamp += frame_shift;
+    t->base_remote_time += remote_time_shift;
+    t->minimum_frame -= frame_shift;
+    t->maximum_frame -= frame_shift;
+    timeline_fit(t);
+  }
+}
+
+uint64_t timeline_remote_time(rtp_timeline *t, uint32_t rtp_timestamp) {
+  int64_t frame = (int32_t)(rtp_timestamp - t->base_rtp_timestamp);
+  double time = t->intercept + t->slope * frame;
+  int64_t offset = (int64_t)(time * ((uint64_t)1 << 32));
+  return t->base_remote_time + offset;
+}
+
+double timeline_drift_ppm(rtp_timeline *t) {
+  if ((t->count == 0) || (t->slope_valid == 0))
+    return 0.0;
+  // if the frames take less time to play than they should, the source's DAC is running fast
+  return (1.0 - t->slope * 44100) * 1000000.0;
+}
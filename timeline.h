@@ -0,0 +1,36 @@
+#ifndef _TIMELINE_H
+#define _TIMELINE_H
+
+#include <stdint.h>
+
+// a running least-squares fit of the source's clock against the RTP timestamps in its sync packets
+
+#define timeline_history 32
+
+typedef struct {
+  int count; // number of samples held
+  int next;  // where the next sample will be put
+  uint32_t base_rtp_timestamp;
+  uint64_t base_remote_time;
+  int64_t frames[timeline_history]; // frames since the base timestamp
+  double times[timeline_history];   // seconds since the base remote time
+  int64_t minimum_frame, maximum_frame;
+  double slope;     // seconds per frame
+  double intercept; // seconds
+  int slope_valid;  // zero until enough samples have been seen to estimate the slope
+  double fitted_drift_ppm; // the drift the fit gives, before it's limited for use in the slope
+} rtp_timeline;
+
+void timeline_reset(rtp_timeline *t);
+
+// add a sync point: the time, on the source's clock, that the frame with this timestamp is played
+void timeline_add_sync(rtp_timeline *t, uint32_t rtp_timestamp, uint64_t remote_time);
+
+// the time, on the source's clock, that the frame with this timestamp should be played, according
+// to the fit. Only meaningful if at least one sync point has been added.
+uint64_t timeline_remote_time(rtp_timeline *t, uint32_t rtp_timestamp);
+
+// how much faster (+ve) or slower the source's DAC runs relative to the source's clock
+double timeline_drift_ppm(rtp_timeline *t);
+
+#endif // _TIMELINE_H